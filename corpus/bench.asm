@@ -0,0 +1,161 @@
+; bench.gbs - a small GBS driver written for gbs2wav's benchmark and
+; profile training runs. It does what real drivers spend their time on:
+; a ROM bank switch on every play call, melody and bass tables read out
+; of the banked ROM, wave RAM rewritten each frame and a 256 byte
+; "software mix" loop over banked data. Each of the 4 tracks plays from
+; its own bank (1-4), which hold generated tables, see the end of file.
+;
+; The listing is hand-assembled; bench.gbs is the GBS header, this code
+; at $0400 and the four banks.
+
+DEF wTrack EQU $C000
+DEF wTick  EQU $C001
+DEF wSum   EQU $C002
+
+; header
+;   "GBS", version 1, 4 tracks, first track 1
+;   load $0400, init Init, play Play, stack $FFFE
+;   TMA 0, TAC 0 (play on vblank)
+;   title "gbs2wav bench", author "gbs2wav", copyright "MIT"
+
+SECTION "driver", ROM0[$0400]
+
+Init:
+    ld [wTrack], a
+    xor a
+    ld [wTick], a
+    ld [wSum], a
+    ld [wSum+1], a
+    ld a, $80
+    ldh [$26], a        ; NR52, sound on
+    ld a, $77
+    ldh [$24], a        ; NR50
+    ld a, $FF
+    ldh [$25], a        ; NR51
+    ld a, $80
+    ldh [$11], a        ; NR11, 50% duty
+    ld a, $F3
+    ldh [$12], a        ; NR12
+    ld a, $40
+    ldh [$16], a        ; NR21, 25% duty
+    ld a, $A2
+    ldh [$17], a        ; NR22
+    ld a, $20
+    ldh [$1C], a        ; NR32, wave at full volume
+    ld a, $C1
+    ldh [$21], a        ; NR42
+    ld a, $35
+    ldh [$22], a        ; NR43
+    ret
+
+Play:
+    ld hl, wTick
+    inc [hl]
+
+    ; the track's bank, 1-4
+    ld a, [wTrack]
+    and $03
+    inc a
+    ld [$2000], a
+
+    ; pulse 1, a note from the melody table every tick, retriggered
+    ; every 8th
+    ld a, [wTick]
+    and $3F
+    add a, a
+    ld l, a
+    ld h, $40
+    ld a, [hl+]
+    ldh [$13], a
+    ld a, [hl]
+    ld e, a
+    ld a, [wTick]
+    and $07
+    ld a, e
+    jr nz, .pulse1
+    or $80
+.pulse1:
+    ldh [$14], a
+
+    ; pulse 2, a bass note every 16 ticks
+    ld a, [wTick]
+    and $0F
+    jr nz, .wave
+    ld a, [wTick]
+    swap a
+    and $0F
+    add a, a
+    add a, $80
+    ld l, a
+    ld h, $40
+    ld a, [hl+]
+    ldh [$18], a
+    ld a, [hl]
+    or $80
+    ldh [$19], a
+
+    ; wave RAM, the bank's waveform shifted by the tick
+.wave:
+    xor a
+    ldh [$1A], a        ; DAC off while wave RAM is written
+    ld hl, $4100
+    ld a, [wTick]
+    and $0F
+    ld b, a
+    ld c, $30
+.waveLoop:
+    ld a, [hl+]
+    add a, b
+    ldh [c], a
+    inc c
+    ld a, c
+    cp $40
+    jr nz, .waveLoop
+    ld a, $80
+    ldh [$1A], a
+    ld a, [wTick]
+    ldh [$1D], a
+    ld a, $86
+    ldh [$1E], a
+
+    ; "software mix": sum 256 bytes of banked data into wSum
+    ld hl, $4200
+    ld a, [wSum]
+    ld e, a
+    ld a, [wSum+1]
+    ld d, a
+    ld b, 0
+.mixLoop:
+    ld a, [hl+]
+    add a, e
+    ld e, a
+    ld a, d
+    adc a, 0
+    ld d, a
+    dec b
+    jr nz, .mixLoop
+    ld a, e
+    ld [wSum], a
+    ld a, d
+    ld [wSum+1], a
+
+    ; noise on the off-beat, its tone from the sum
+    ld a, [wTick]
+    and $07
+    cp $04
+    ret nz
+    ld a, e
+    and $07
+    or $30
+    ldh [$22], a        ; NR43
+    ld a, $80
+    ldh [$23], a        ; NR44
+    ret
+
+; banks 1-4, generated: for bank n a 32-bit LCG (x = x * 1103515245 +
+; 12345, seeded with n, taking bits 16-23) picks each entry
+;   $4000  64 melody notes, NR13/NR14 pairs from a pentatonic scale
+;          over two octaves
+;   $4080  16 bass notes, the same scale an octave below
+;   $4100  16 wave RAM bytes
+;   $4200  256 bytes for the mix loop
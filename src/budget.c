@@ -0,0 +1,93 @@
+#include "budget.h"
+#include "trace.h"
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+static pthread_mutex_t budgetLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budgetCond = PTHREAD_COND_INITIALIZER;
+static budget_stats budget;
+/* the part of budget.inUse taken by budget_acquire */
+static uint64_t acquired = 0;
+
+static int fits(uint64_t bytes);
+static void add_use(uint64_t bytes);
+static double now(void);
+
+void budget_set_limit(uint64_t bytes) {
+    pthread_mutex_lock(&budgetLock);
+    budget.limit = bytes;
+    pthread_cond_broadcast(&budgetCond);
+    pthread_mutex_unlock(&budgetLock);
+}
+
+int budget_acquire(uint64_t bytes, unsigned int wait) {
+    double start;
+    uint64_t traceStart;
+
+    pthread_mutex_lock(&budgetLock);
+    if(!fits(bytes) && acquired != 0) {
+        if(!wait) {
+            budget.shed++;
+            pthread_mutex_unlock(&budgetLock);
+            return -1;
+        }
+        budget.waits++;
+        start = now();
+        traceStart = trace_begin();
+        while(!fits(bytes) && acquired != 0) {
+            pthread_cond_wait(&budgetCond,&budgetLock);
+        }
+        trace_end(traceStart,"budget wait",-1);
+        budget.waitSeconds += now() - start;
+    }
+    if(!fits(bytes)) budget.overruns++;
+    acquired += bytes;
+    add_use(bytes);
+    pthread_mutex_unlock(&budgetLock);
+    return 0;
+}
+
+void budget_release(uint64_t bytes) {
+    pthread_mutex_lock(&budgetLock);
+    acquired -= bytes;
+    budget.inUse -= bytes;
+    pthread_cond_broadcast(&budgetCond);
+    pthread_mutex_unlock(&budgetLock);
+}
+
+void budget_charge(uint64_t bytes) {
+    pthread_mutex_lock(&budgetLock);
+    if(!fits(bytes)) budget.overruns++;
+    add_use(bytes);
+    pthread_mutex_unlock(&budgetLock);
+}
+
+void budget_refund(uint64_t bytes) {
+    pthread_mutex_lock(&budgetLock);
+    budget.inUse -= bytes;
+    pthread_cond_broadcast(&budgetCond);
+    pthread_mutex_unlock(&budgetLock);
+}
+
+void budget_get_stats(budget_stats *s) {
+    pthread_mutex_lock(&budgetLock);
+    memcpy(s,&budget,sizeof(budget_stats));
+    pthread_mutex_unlock(&budgetLock);
+}
+
+static int fits(uint64_t bytes) {
+    return budget.limit == 0 || budget.inUse + bytes <= budget.limit;
+}
+
+static void add_use(uint64_t bytes) {
+    budget.inUse += bytes;
+    if(budget.inUse > budget.peak) budget.peak = budget.inUse;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
@@ -0,0 +1,45 @@
+#ifndef GBS2WAV_BUDGET_H
+#define GBS2WAV_BUDGET_H
+
+/* process-wide memory budget for the buffers renders allocate:
+ * sample and pack blocks, split segments, ID3 buffers, daemon
+ * renderers. Everything is counted, with or without a limit, so the
+ * peak can be reported.
+ *
+ * There are two kinds of use. Memory a render can't go on without
+ * (its block buffers, tags) is charged: it always succeeds, and only
+ * counts towards the limit. Memory that comes and goes with the
+ * amount of work in flight (a segment waiting to be written, a
+ * daemon request) is acquired: when it doesn't fit, the caller either
+ * waits for other renders to give some back or sheds the work. An
+ * acquire that wouldn't fit even with nothing else acquired is let
+ * through, so a lone render always makes progress. */
+
+#include <stdint.h>
+
+typedef struct budget_stats {
+    /* 0 without a limit */
+    uint64_t limit;
+    uint64_t inUse;
+    uint64_t peak;
+    /* acquires that had to wait, and for how long altogether */
+    uint64_t waits;
+    double waitSeconds;
+    /* acquires refused without waiting */
+    uint64_t shed;
+    /* granted past the limit */
+    uint64_t overruns;
+} budget_stats;
+
+void budget_set_limit(uint64_t bytes);
+
+/* 0 once bytes are taken, -1 when they don't fit and wait is 0 */
+int budget_acquire(uint64_t bytes, unsigned int wait);
+void budget_release(uint64_t bytes);
+
+void budget_charge(uint64_t bytes);
+void budget_refund(uint64_t bytes);
+
+void budget_get_stats(budget_stats *s);
+
+#endif
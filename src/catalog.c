@@ -0,0 +1,670 @@
+#include "catalog.h"
+#include "journal.h"
+#include "libgbs2wav.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define lstat stat
+#endif
+
+#define CATALOG_MAGIC "GBSC"
+#define CATALOG_VERSION 1
+#define CATALOG_SET_SIZE 80
+#define CATALOG_TRACK_SIZE 24
+#define CATALOG_WRITE_SIZE 4096
+
+#define GBS_HEADER_SIZE 0x70
+#define GBS_FIELD_SIZE 32
+
+/* a set found on disk, and what parsing it gave */
+typedef struct scan_entry {
+    char *path;
+    char *m3uPath;
+    struct stat gbsStat;
+    struct stat m3uStat;
+    /* the old catalog's record, when the files are unchanged */
+    const catalog_set *old;
+
+    unsigned int ok;
+    char title[GBS_FIELD_SIZE + 1];
+    char author[GBS_FIELD_SIZE + 1];
+    char copyright[GBS_FIELD_SIZE + 1];
+    unsigned int gbsTrackCount;
+    unsigned int firstTrack;
+    catalog_track *tracks;
+    char **names;
+    unsigned int trackCount;
+} scan_entry;
+
+typedef struct scan_list {
+    scan_entry *entries;
+    unsigned int count;
+    unsigned int alloc;
+} scan_list;
+
+typedef struct scan_job {
+    scan_list *list;
+    unsigned int next;
+    pthread_mutex_t lock;
+} scan_job;
+
+static int walk(scan_list *list, const char *dir);
+static int add_entry(scan_list *list, const char *path, const struct stat *st);
+static void *scan_worker(void *userdata);
+static void parse_set(scan_entry *e);
+static int parse_tracks(scan_entry *e, const uint8_t *hdr, const char *m3uData, unsigned int m3uSize);
+static int compare_entries(const void *a, const void *b);
+static const catalog_set *find_set(const catalog *c, const char *path);
+static int copy_set(catalog *c, const catalog *old, const catalog_set *s);
+static int add_set(catalog *c, const scan_entry *e);
+static catalog_set *new_set(catalog *c);
+static catalog_track *new_track(catalog *c);
+static uint32_t add_string(catalog *c, const char *s);
+static char *str_dup(const char *s);
+static uint32_t get_le32(const uint8_t *d);
+static uint64_t get_le64(const uint8_t *d);
+static void put_le32(uint8_t *d, uint32_t n);
+static void put_le64(uint8_t *d, uint64_t n);
+
+int catalog_load(catalog *c, const char *filename) {
+    uint8_t hdr[CATALOG_HEADER_SIZE];
+    uint8_t rec[CATALOG_SET_SIZE];
+    catalog_set *s;
+    catalog_track *t;
+    uint32_t setCount;
+    uint32_t trackCount;
+    uint32_t stringsLen;
+    uint32_t i;
+    FILE *f;
+
+    memset(c,0,sizeof(catalog));
+    f = fopen(filename,"rb");
+    if(f == NULL) return errno == ENOENT ? 0 : -1;
+
+    if(fread(hdr,1,sizeof(hdr),f) != sizeof(hdr)) goto fail;
+    if(memcmp(hdr,CATALOG_MAGIC,4) != 0 || get_le32(&hdr[4]) != CATALOG_VERSION) goto fail;
+    setCount = get_le32(&hdr[8]);
+    trackCount = get_le32(&hdr[12]);
+    stringsLen = get_le32(&hdr[16]);
+
+    if(fseek(f,(long)get_le32(&hdr[20]),SEEK_SET) != 0) goto fail;
+    for(i = 0; i < setCount; i++) {
+        if(fread(rec,1,CATALOG_SET_SIZE,f) != CATALOG_SET_SIZE) goto fail;
+        if((s = new_set(c)) == NULL) goto fail;
+        s->gbsMtime = get_le64(&rec[0]);
+        s->gbsSize = get_le64(&rec[8]);
+        s->m3uMtime = get_le64(&rec[16]);
+        s->m3uSize = get_le64(&rec[24]);
+        s->totalMs = get_le64(&rec[32]);
+        s->path = get_le32(&rec[40]);
+        s->m3uPath = get_le32(&rec[44]);
+        s->title = get_le32(&rec[48]);
+        s->author = get_le32(&rec[52]);
+        s->copyright = get_le32(&rec[56]);
+        s->gbsTrackCount = get_le32(&rec[60]);
+        s->firstTrack = get_le32(&rec[64]);
+        s->firstEntry = get_le32(&rec[68]);
+        s->trackCount = get_le32(&rec[72]);
+        s->reserved = 0;
+        if((uint64_t)s->firstEntry + s->trackCount > trackCount) goto fail;
+    }
+
+    if(fseek(f,(long)get_le32(&hdr[24]),SEEK_SET) != 0) goto fail;
+    for(i = 0; i < trackCount; i++) {
+        if(fread(rec,1,CATALOG_TRACK_SIZE,f) != CATALOG_TRACK_SIZE) goto fail;
+        if((t = new_track(c)) == NULL) goto fail;
+        t->number = get_le32(&rec[0]);
+        t->song = get_le32(&rec[4]);
+        t->lengthMs = get_le32(&rec[8]);
+        t->fadeMs = get_le32(&rec[12]);
+        t->name = get_le32(&rec[16]);
+        t->startMs = get_le32(&rec[20]);
+    }
+
+    if(fseek(f,(long)get_le32(&hdr[28]),SEEK_SET) != 0) goto fail;
+    c->strings = (char *)malloc(stringsLen + 1);
+    if(c->strings == NULL) goto fail;
+    if(fread(c->strings,1,stringsLen,f) != stringsLen) goto fail;
+    /* a damaged string can't run off the end */
+    c->strings[stringsLen] = '\0';
+    c->stringsLen = stringsLen;
+    c->stringsAlloc = stringsLen + 1;
+
+    fclose(f);
+    return 0;
+
+    fail:
+    fprintf(stderr,"Error reading catalog %s\n",filename);
+    fclose(f);
+    catalog_free(c);
+    return -1;
+}
+
+int catalog_save(const catalog *c, const char *filename) {
+    uint8_t buf[CATALOG_WRITE_SIZE];
+    output_set out;
+    const catalog_set *s;
+    const catalog_track *t;
+    uint32_t setPos = CATALOG_HEADER_SIZE;
+    uint32_t trackPos = setPos + c->setCount * CATALOG_SET_SIZE;
+    uint32_t stringPos = trackPos + c->trackCount * CATALOG_TRACK_SIZE;
+    size_t len = 0;
+    uint32_t i;
+    FILE *f;
+
+    memset(&out,0,sizeof(output_set));
+    f = output_open(&out,filename);
+    if(f == NULL) goto fail;
+
+    memset(buf,0,CATALOG_HEADER_SIZE);
+    memcpy(&buf[0],CATALOG_MAGIC,4);
+    put_le32(&buf[4],CATALOG_VERSION);
+    put_le32(&buf[8],c->setCount);
+    put_le32(&buf[12],c->trackCount);
+    put_le32(&buf[16],c->stringsLen);
+    put_le32(&buf[20],setPos);
+    put_le32(&buf[24],trackPos);
+    put_le32(&buf[28],stringPos);
+    len = CATALOG_HEADER_SIZE;
+
+    for(i = 0; i < c->setCount; i++) {
+        s = &c->sets[i];
+        if(len + CATALOG_SET_SIZE > sizeof(buf)) {
+            if(fwrite(buf,1,len,f) != len) goto fail;
+            len = 0;
+        }
+        put_le64(&buf[len + 0],s->gbsMtime);
+        put_le64(&buf[len + 8],s->gbsSize);
+        put_le64(&buf[len + 16],s->m3uMtime);
+        put_le64(&buf[len + 24],s->m3uSize);
+        put_le64(&buf[len + 32],s->totalMs);
+        put_le32(&buf[len + 40],s->path);
+        put_le32(&buf[len + 44],s->m3uPath);
+        put_le32(&buf[len + 48],s->title);
+        put_le32(&buf[len + 52],s->author);
+        put_le32(&buf[len + 56],s->copyright);
+        put_le32(&buf[len + 60],s->gbsTrackCount);
+        put_le32(&buf[len + 64],s->firstTrack);
+        put_le32(&buf[len + 68],s->firstEntry);
+        put_le32(&buf[len + 72],s->trackCount);
+        put_le32(&buf[len + 76],0);
+        len += CATALOG_SET_SIZE;
+    }
+
+    for(i = 0; i < c->trackCount; i++) {
+        t = &c->tracks[i];
+        if(len + CATALOG_TRACK_SIZE > sizeof(buf)) {
+            if(fwrite(buf,1,len,f) != len) goto fail;
+            len = 0;
+        }
+        put_le32(&buf[len + 0],t->number);
+        put_le32(&buf[len + 4],t->song);
+        put_le32(&buf[len + 8],t->lengthMs);
+        put_le32(&buf[len + 12],t->fadeMs);
+        put_le32(&buf[len + 16],t->name);
+        put_le32(&buf[len + 20],t->startMs);
+        len += CATALOG_TRACK_SIZE;
+    }
+    if(fwrite(buf,1,len,f) != len) goto fail;
+    if(c->stringsLen && fwrite(c->strings,1,c->stringsLen,f) != c->stringsLen) goto fail;
+
+    if(output_close(f) != 0) {
+        f = NULL;
+        goto fail;
+    }
+    f = NULL;
+    if(output_commit(&out) != 0) goto fail;
+    output_free(&out);
+    return 0;
+
+    fail:
+    fprintf(stderr,"Error writing catalog %s\n",filename);
+    if(f != NULL) fclose(f);
+    output_free(&out);
+    return -1;
+}
+
+void catalog_free(catalog *c) {
+    if(c->sets != NULL) free(c->sets);
+    if(c->tracks != NULL) free(c->tracks);
+    if(c->strings != NULL) free(c->strings);
+    memset(c,0,sizeof(catalog));
+}
+
+int catalog_scan(catalog *c, const catalog *old, const char *const *dirs, unsigned int dirCount, unsigned int threads, catalog_scan_stats *stats) {
+    scan_list list;
+    scan_job job;
+    scan_entry *e;
+    pthread_t *workers = NULL;
+    unsigned int workerCount = 0;
+    unsigned int pending = 0;
+    unsigned int i;
+    unsigned int k;
+    int r = -1;
+
+    memset(c,0,sizeof(catalog));
+    memset(&list,0,sizeof(scan_list));
+    memset(stats,0,sizeof(catalog_scan_stats));
+
+    for(i = 0; i < dirCount; i++) {
+        if(walk(&list,dirs[i]) != 0) goto done;
+    }
+    if(list.count) {
+        qsort(list.entries,list.count,sizeof(scan_entry),compare_entries);
+    }
+
+    /* unchanged sets are copied across, the rest are parsed */
+    for(i = 0; i < list.count; i++) {
+        e = &list.entries[i];
+        e->old = find_set(old,e->path);
+        if(e->old != NULL &&
+          e->old->gbsMtime == (uint64_t)e->gbsStat.st_mtime && e->old->gbsSize == (uint64_t)e->gbsStat.st_size &&
+          (e->old->m3uPath == CATALOG_NO_STRING) == (e->m3uPath == NULL) &&
+          (e->m3uPath == NULL || (e->old->m3uMtime == (uint64_t)e->m3uStat.st_mtime &&
+            e->old->m3uSize == (uint64_t)e->m3uStat.st_size))) continue;
+        e->old = NULL;
+        pending++;
+    }
+
+    if(pending) {
+        if(threads > pending) threads = pending;
+        job.list = &list;
+        job.next = 0;
+        pthread_mutex_init(&job.lock,NULL);
+        workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+        if(workers != NULL) {
+            for(k = 0; k < threads; k++) {
+                if(pthread_create(&workers[k],NULL,scan_worker,&job) != 0) break;
+                workerCount++;
+            }
+        }
+        /* parse here with no workers */
+        if(workerCount == 0) scan_worker(&job);
+        for(k = 0; k < workerCount; k++) {
+            pthread_join(workers[k],NULL);
+        }
+        pthread_mutex_destroy(&job.lock);
+    }
+
+    for(i = 0; i < list.count; i++) {
+        e = &list.entries[i];
+        if(e->old != NULL) {
+            if(copy_set(c,old,e->old) != 0) goto done;
+            stats->unchanged++;
+        } else if(e->ok) {
+            if(add_set(c,e) != 0) goto done;
+            stats->parsed++;
+        } else {
+            stats->failed++;
+        }
+    }
+    r = 0;
+
+    done:
+    if(r != 0) {
+        fprintf(stderr,"out of memory\n");
+        catalog_free(c);
+    }
+    for(i = 0; i < list.count; i++) {
+        e = &list.entries[i];
+        free(e->path);
+        if(e->m3uPath != NULL) free(e->m3uPath);
+        if(e->tracks != NULL) free(e->tracks);
+        if(e->names != NULL) {
+            for(k = 0; k < e->trackCount; k++) {
+                if(e->names[k] != NULL) free(e->names[k]);
+            }
+            free(e->names);
+        }
+    }
+    if(list.entries != NULL) free(list.entries);
+    if(workers != NULL) free(workers);
+    return r;
+}
+
+const char *catalog_string(const catalog *c, uint32_t offset) {
+    if(offset == CATALOG_NO_STRING || offset >= c->stringsLen) return "";
+    return &c->strings[offset];
+}
+
+/* adds every .gbs under dir, with the .m3u of the same name beside it */
+static int walk(scan_list *list, const char *dir) {
+    struct stat st;
+    struct dirent *d;
+    DIR *dh;
+    char *path;
+    size_t len;
+    int r = 0;
+
+    dh = opendir(dir);
+    if(dh == NULL) {
+        fprintf(stderr,"Error opening %s: %s\n",dir,strerror(errno));
+        return 0;
+    }
+
+    while(r == 0 && (d = readdir(dh)) != NULL) {
+        if(strcmp(d->d_name,".") == 0 || strcmp(d->d_name,"..") == 0) continue;
+
+        len = strlen(dir) + 1 + strlen(d->d_name);
+        path = (char *)malloc(len + 1);
+        if(path == NULL) {
+            r = -1;
+            break;
+        }
+        snprintf(path,len + 1,"%s/%s",dir,d->d_name);
+
+        /* symlinked directories aren't followed, there may be loops */
+        if(lstat(path,&st) == 0) {
+            if(S_ISDIR(st.st_mode)) {
+                r = walk(list,path);
+            } else if(stat(path,&st) == 0 && S_ISREG(st.st_mode)) {
+                len = strlen(d->d_name);
+                if(len > 4 && (strcmp(&d->d_name[len - 4],".gbs") == 0 || strcmp(&d->d_name[len - 4],".GBS") == 0)) {
+                    r = add_entry(list,path,&st);
+                }
+            }
+        }
+        free(path);
+    }
+
+    closedir(dh);
+    return r;
+}
+
+static int add_entry(scan_list *list, const char *path, const struct stat *st) {
+    scan_entry *e;
+    void *t;
+    size_t len = strlen(path);
+
+    if(list->count == list->alloc) {
+        t = realloc(list->entries,sizeof(scan_entry) * (list->alloc ? list->alloc * 2 : 64));
+        if(t == NULL) return -1;
+        list->entries = (scan_entry *)t;
+        list->alloc = list->alloc ? list->alloc * 2 : 64;
+    }
+    e = &list->entries[list->count];
+    memset(e,0,sizeof(scan_entry));
+    e->gbsStat = *st;
+
+    e->path = str_dup(path);
+    e->m3uPath = str_dup(path);
+    if(e->path == NULL || e->m3uPath == NULL) {
+        if(e->path != NULL) free(e->path);
+        if(e->m3uPath != NULL) free(e->m3uPath);
+        return -1;
+    }
+    memcpy(&e->m3uPath[len - 3],"m3u",3);
+    if(stat(e->m3uPath,&e->m3uStat) != 0) {
+        memcpy(&e->m3uPath[len - 3],"M3U",3);
+        if(stat(e->m3uPath,&e->m3uStat) != 0) {
+            free(e->m3uPath);
+            e->m3uPath = NULL;
+        }
+    }
+    list->count++;
+    return 0;
+}
+
+static void *scan_worker(void *userdata) {
+    scan_job *job = (scan_job *)userdata;
+    scan_entry *e;
+    unsigned int i;
+
+    for(;;) {
+        pthread_mutex_lock(&job->lock);
+        while(job->next < job->list->count && job->list->entries[job->next].old != NULL) {
+            job->next++;
+        }
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if(i >= job->list->count) break;
+
+        e = &job->list->entries[i];
+        parse_set(e);
+        if(!e->ok) {
+            fprintf(stderr,"Skipping %s: not a readable GBS\n",e->path);
+        }
+    }
+    return NULL;
+}
+
+/* reads the GBS header and the M3U, the same way gbs2wav_open does */
+static void parse_set(scan_entry *e) {
+    uint8_t hdr[GBS_HEADER_SIZE];
+    char *m3uData = NULL;
+    long m3uSize = 0;
+    FILE *f;
+
+    f = fopen(e->path,"rb");
+    if(f == NULL) return;
+    if(fread(hdr,1,GBS_HEADER_SIZE,f) != GBS_HEADER_SIZE) {
+        fclose(f);
+        return;
+    }
+    fclose(f);
+    if(memcmp(hdr,"GBS",3) != 0 || hdr[3] != 1) return;
+
+    e->gbsTrackCount = hdr[4];
+    e->firstTrack = (uint8_t)(hdr[5] - 1);
+    if(e->firstTrack >= e->gbsTrackCount) e->firstTrack = 0;
+    memcpy(e->title,&hdr[0x10],GBS_FIELD_SIZE);
+    memcpy(e->author,&hdr[0x30],GBS_FIELD_SIZE);
+    memcpy(e->copyright,&hdr[0x50],GBS_FIELD_SIZE);
+
+    if(e->m3uPath != NULL) {
+        f = fopen(e->m3uPath,"rb");
+        if(f == NULL) return;
+        if(fseek(f,0,SEEK_END) != 0 || (m3uSize = ftell(f)) < 0 || fseek(f,0,SEEK_SET) != 0) {
+            fclose(f);
+            return;
+        }
+        m3uData = (char *)malloc((size_t)m3uSize + 1);
+        if(m3uData == NULL || fread(m3uData,1,(size_t)m3uSize,f) != (size_t)m3uSize) {
+            if(m3uData != NULL) free(m3uData);
+            fclose(f);
+            return;
+        }
+        fclose(f);
+    }
+
+    if(parse_tracks(e,hdr,m3uData,(unsigned int)m3uSize) == 0) e->ok = 1;
+    if(m3uData != NULL) free(m3uData);
+}
+
+/* the library's track plan, with the lengths as rendered */
+static int parse_tracks(scan_entry *e, const uint8_t *hdr, const char *m3uData, unsigned int m3uSize) {
+    gbs2wav_plan_track *plan;
+    catalog_track *t;
+    uint32_t total;
+    uint32_t start;
+    int count;
+    int i;
+
+    count = gbs2wav_plan(hdr,GBS_HEADER_SIZE,m3uData,m3uSize,&plan);
+    if(count < 0) return -1;
+    if(count == 0) {
+        gbs2wav_plan_free(plan,0);
+        return 0;
+    }
+
+    e->tracks = (catalog_track *)malloc(sizeof(catalog_track) * (size_t)count);
+    e->names = (char **)malloc(sizeof(char *) * (size_t)count);
+    if(e->tracks == NULL || e->names == NULL) {
+        gbs2wav_plan_free(plan,count);
+        return -1;
+    }
+
+    for(i = 0; i < count; i++) {
+        t = &e->tracks[i];
+        memset(t,0,sizeof(catalog_track));
+        t->number = plan[i].number;
+        t->song = plan[i].song;
+        t->fadeMs = plan[i].fadeMs;
+        total = plan[i].lengthMs + plan[i].fadeMs;
+        /* the library keeps at least a frame, near enough */
+        start = plan[i].startMs;
+        if(start >= total) start = total ? total - 1 : 0;
+        t->startMs = start;
+        t->lengthMs = total - start;
+        e->names[e->trackCount++] = plan[i].name;
+        plan[i].name = NULL;
+    }
+
+    gbs2wav_plan_free(plan,count);
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const scan_entry *)a)->path,((const scan_entry *)b)->path);
+}
+
+/* the old catalog's sets are sorted by path */
+static const catalog_set *find_set(const catalog *c, const char *path) {
+    uint32_t lo = 0;
+    uint32_t hi = c->setCount;
+    uint32_t mid;
+    int cmp;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(path,catalog_string(c,c->sets[mid].path));
+        if(cmp == 0) return &c->sets[mid];
+        if(cmp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return NULL;
+}
+
+static int copy_set(catalog *c, const catalog *old, const catalog_set *s) {
+    catalog_set *d;
+    catalog_track *t;
+    uint32_t i;
+
+    if((d = new_set(c)) == NULL) return -1;
+    *d = *s;
+    d->firstEntry = c->trackCount;
+    if((d->path = add_string(c,catalog_string(old,s->path))) == CATALOG_NO_STRING) return -1;
+    d->m3uPath = CATALOG_NO_STRING;
+    if(s->m3uPath != CATALOG_NO_STRING &&
+      (d->m3uPath = add_string(c,catalog_string(old,s->m3uPath))) == CATALOG_NO_STRING) return -1;
+    if((d->title = add_string(c,catalog_string(old,s->title))) == CATALOG_NO_STRING) return -1;
+    if((d->author = add_string(c,catalog_string(old,s->author))) == CATALOG_NO_STRING) return -1;
+    if((d->copyright = add_string(c,catalog_string(old,s->copyright))) == CATALOG_NO_STRING) return -1;
+
+    for(i = 0; i < s->trackCount; i++) {
+        if((t = new_track(c)) == NULL) return -1;
+        *t = old->tracks[s->firstEntry + i];
+        if((t->name = add_string(c,catalog_string(old,t->name))) == CATALOG_NO_STRING) return -1;
+    }
+    return 0;
+}
+
+static int add_set(catalog *c, const scan_entry *e) {
+    catalog_set *d;
+    catalog_track *t;
+    unsigned int i;
+
+    if((d = new_set(c)) == NULL) return -1;
+    memset(d,0,sizeof(catalog_set));
+    d->gbsMtime = (uint64_t)e->gbsStat.st_mtime;
+    d->gbsSize = (uint64_t)e->gbsStat.st_size;
+    if(e->m3uPath != NULL) {
+        d->m3uMtime = (uint64_t)e->m3uStat.st_mtime;
+        d->m3uSize = (uint64_t)e->m3uStat.st_size;
+    }
+    d->gbsTrackCount = e->gbsTrackCount;
+    d->firstTrack = e->firstTrack;
+    d->firstEntry = c->trackCount;
+    d->trackCount = e->trackCount;
+    if((d->path = add_string(c,e->path)) == CATALOG_NO_STRING) return -1;
+    d->m3uPath = CATALOG_NO_STRING;
+    if(e->m3uPath != NULL && (d->m3uPath = add_string(c,e->m3uPath)) == CATALOG_NO_STRING) return -1;
+    if((d->title = add_string(c,e->title)) == CATALOG_NO_STRING) return -1;
+    if((d->author = add_string(c,e->author)) == CATALOG_NO_STRING) return -1;
+    if((d->copyright = add_string(c,e->copyright)) == CATALOG_NO_STRING) return -1;
+
+    for(i = 0; i < e->trackCount; i++) {
+        if((t = new_track(c)) == NULL) return -1;
+        *t = e->tracks[i];
+        if((t->name = add_string(c,e->names[i])) == CATALOG_NO_STRING) return -1;
+        d->totalMs += t->lengthMs;
+    }
+    return 0;
+}
+
+/* new_set and new_track pointers are only good until the next call */
+static catalog_set *new_set(catalog *c) {
+    void *t;
+    if(c->setCount == c->setAlloc) {
+        t = realloc(c->sets,sizeof(catalog_set) * (c->setAlloc ? c->setAlloc * 2 : 64));
+        if(t == NULL) return NULL;
+        c->sets = (catalog_set *)t;
+        c->setAlloc = c->setAlloc ? c->setAlloc * 2 : 64;
+    }
+    return &c->sets[c->setCount++];
+}
+
+static catalog_track *new_track(catalog *c) {
+    void *t;
+    if(c->trackCount == c->trackAlloc) {
+        t = realloc(c->tracks,sizeof(catalog_track) * (c->trackAlloc ? c->trackAlloc * 2 : 256));
+        if(t == NULL) return NULL;
+        c->tracks = (catalog_track *)t;
+        c->trackAlloc = c->trackAlloc ? c->trackAlloc * 2 : 256;
+    }
+    return &c->tracks[c->trackCount++];
+}
+
+static uint32_t add_string(catalog *c, const char *s) {
+    size_t len = strlen(s) + 1;
+    uint32_t offset = c->stringsLen;
+    uint32_t alloc;
+    void *t;
+
+    if((uint64_t)c->stringsLen + len >= CATALOG_NO_STRING) return CATALOG_NO_STRING;
+    if(c->stringsLen + len > c->stringsAlloc) {
+        alloc = c->stringsAlloc ? c->stringsAlloc : 4096;
+        while(alloc < c->stringsLen + len) alloc *= 2;
+        t = realloc(c->strings,alloc);
+        if(t == NULL) return CATALOG_NO_STRING;
+        c->strings = (char *)t;
+        c->stringsAlloc = alloc;
+    }
+    memcpy(&c->strings[offset],s,len);
+    c->stringsLen += (uint32_t)len;
+    return offset;
+}
+
+static char *str_dup(const char *s) {
+    char *d = (char *)malloc(strlen(s) + 1);
+    if(d != NULL) memcpy(d,s,strlen(s) + 1);
+    return d;
+}
+
+static uint32_t get_le32(const uint8_t *d) {
+    return (uint32_t)d[0] | ((uint32_t)d[1] << 8) | ((uint32_t)d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *d) {
+    return (uint64_t)get_le32(d) | ((uint64_t)get_le32(&d[4]) << 32);
+}
+
+static void put_le32(uint8_t *d, uint32_t n) {
+    d[0] = (uint8_t)(n & 0xFF);
+    d[1] = (uint8_t)((n >> 8) & 0xFF);
+    d[2] = (uint8_t)((n >> 16) & 0xFF);
+    d[3] = (uint8_t)(n >> 24);
+}
+
+static void put_le64(uint8_t *d, uint64_t n) {
+    put_le32(d,(uint32_t)(n & 0xFFFFFFFF));
+    put_le32(&d[4],(uint32_t)(n >> 32));
+}
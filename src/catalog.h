@@ -0,0 +1,92 @@
+#ifndef GBS2WAV_CATALOG_H
+#define GBS2WAV_CATALOG_H
+
+/* catalog of a GBS collection, for planning batch renders. Only the
+ * GBS header and the M3U are read, nothing is loaded into an emulator,
+ * and tracks get the lengths gbs2wav would render them at.
+ *
+ * Each foo.gbs is paired with a foo.m3u beside it, when there is one.
+ * A rescan only rereads sets whose files changed size or mtime.
+ *
+ * The file is little-endian, a header then three sections, each
+ * starting on an 8 byte boundary so the file can be mapped and used
+ * in place:
+ *
+ *   "GBSC", version, set count, track count, string bytes (u32 each),
+ *   then the file offsets of the sets, tracks and strings (u32 each),
+ *   padded to CATALOG_HEADER_SIZE
+ *   sets    set count catalog_set records, sorted by path
+ *   tracks  track count catalog_track records, each set's together
+ *   strings NUL-terminated, the string fields are offsets in here */
+
+#include <stdint.h>
+
+#define CATALOG_HEADER_SIZE 32
+#define CATALOG_NO_STRING 0xFFFFFFFF
+
+typedef struct catalog_set {
+    uint64_t gbsMtime;
+    uint64_t gbsSize;
+    /* 0 for both without an M3U */
+    uint64_t m3uMtime;
+    uint64_t m3uSize;
+    /* every track's length plus fade */
+    uint64_t totalMs;
+    uint32_t path;
+    uint32_t m3uPath;
+    /* from the GBS header */
+    uint32_t title;
+    uint32_t author;
+    uint32_t copyright;
+    uint32_t gbsTrackCount;
+    uint32_t firstTrack;
+    /* the set's tracks, trackCount of them from firstEntry */
+    uint32_t firstEntry;
+    uint32_t trackCount;
+    uint32_t reserved;
+} catalog_set;
+
+typedef struct catalog_track {
+    /* the number in file names, and the GBS song */
+    uint32_t number;
+    uint32_t song;
+    /* as rendered: including the fade, less the start offset */
+    uint32_t lengthMs;
+    uint32_t fadeMs;
+    uint32_t name;
+    /* an M3U "@START" offset into the song */
+    uint32_t startMs;
+} catalog_track;
+
+typedef struct catalog {
+    catalog_set *sets;
+    uint32_t setCount;
+    uint32_t setAlloc;
+    catalog_track *tracks;
+    uint32_t trackCount;
+    uint32_t trackAlloc;
+    char *strings;
+    uint32_t stringsLen;
+    uint32_t stringsAlloc;
+} catalog;
+
+typedef struct catalog_scan_stats {
+    unsigned int parsed;
+    unsigned int unchanged;
+    /* not a GBS, or unreadable */
+    unsigned int failed;
+} catalog_scan_stats;
+
+/* a missing file gives an empty catalog, other failures return -1 */
+int catalog_load(catalog *c, const char *filename);
+int catalog_save(const catalog *c, const char *filename);
+void catalog_free(catalog *c);
+
+/* builds c from every GBS under dirs, taking what it can from old
+ * (which may be empty), parsing the rest on threads workers */
+int catalog_scan(catalog *c, const catalog *old, const char *const *dirs, unsigned int dirCount, unsigned int threads, catalog_scan_stats *stats);
+
+/* "" for CATALOG_NO_STRING */
+const char *catalog_string(const catalog *c, uint32_t offset);
+
+#endif
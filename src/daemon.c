@@ -0,0 +1,1029 @@
+#include "daemon.h"
+#include "journal.h"
+#include "budget.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int daemon_run(const daemon_options *o) {
+    (void)o;
+    fprintf(stderr,"--daemon needs Unix domain sockets, which this platform doesn't have\n");
+    return -1;
+}
+
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DAEMON_QUEUE_FACTOR 4
+#define REQUEST_MAX 4096
+#define REQUEST_FIELDS 16
+/* seconds a client gets to send its request line */
+#define REQUEST_TIMEOUT 10
+/* seconds a client can go without reading before it's dropped */
+#define SEND_TIMEOUT 10
+#define BLOCK_FRAMES 4096
+/* a request's sample and pack buffers */
+#define BLOCK_BYTES (sizeof(int16_t) * BLOCK_FRAMES * GBS2WAV_MAX_CHANNELS * 2)
+#define LATENCY_SAMPLES 1024
+#define POLL_MS 250
+#define WAV_HEADER_SIZE 44
+
+#define FORMAT_WAV 0
+#define FORMAT_PCM 1
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+/* an idle renderer, ready for the next request with the same config */
+typedef struct warm_renderer {
+    gbs2wav_t *h;
+    gbs2wav_config config;
+    uint64_t lastUse;
+    struct warm_renderer *next;
+} warm_renderer;
+
+/* a loaded GBS and M3U. Once either file changes on disk the set is
+ * stale: it's no longer found, and goes when its last request is done */
+typedef struct gbs_set {
+    char *gbsPath;
+    char *m3uPath;
+    time_t mtime[2];
+    off_t fileSize[2];
+    uint8_t *gbs;
+    uint32_t gbsLen;
+    char *m3u;
+    uint32_t m3uLen;
+    uint64_t hash;
+    unsigned int refs;
+    unsigned int stale;
+    uint64_t lastUse;
+    warm_renderer *idle;
+    struct gbs_set *next;
+} gbs_set;
+
+typedef struct pending_conn {
+    int fd;
+    double accepted;
+} pending_conn;
+
+typedef struct server_metrics {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t rejected;
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t warmHits;
+    uint64_t coldStarts;
+    uint64_t bytes;
+    unsigned int active;
+    /* the last LATENCY_SAMPLES finished renders, in seconds from
+     * accept to the first byte of audio and to the last */
+    double firstByte[LATENCY_SAMPLES];
+    double total[LATENCY_SAMPLES];
+    unsigned int latencyPos;
+    unsigned int latencyCount;
+} server_metrics;
+
+typedef struct server {
+    const daemon_options *o;
+    int listenFd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int stopping;
+
+    /* accepted connections waiting for a worker */
+    pending_conn *queue;
+    unsigned int queueHead;
+    unsigned int queueCount;
+    unsigned int queueSize;
+
+    gbs_set *sets;
+    unsigned int setCount;
+    unsigned int idleCount;
+    uint64_t useClock;
+
+    server_metrics m;
+} server;
+
+typedef struct render_request {
+    const char *m3u;
+    unsigned int track;
+    unsigned int format;
+    gbs2wav_config config;
+} render_request;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void *server_worker(void *userdata);
+static void serve(server *s, const pending_conn *c);
+static int serve_render(server *s, const pending_conn *c, char **field, unsigned int count);
+static int serve_load(server *s, const pending_conn *c, char **field, unsigned int count);
+static int serve_stats(server *s, const pending_conn *c);
+static const char *parse_options(render_request *q, char **field, unsigned int count, const gbs2wav_config *defaults);
+
+static gbs_set *set_acquire(server *s, const char *gbs, const char *m3u, const char **err);
+static void set_release(server *s, gbs_set *set);
+static gbs_set *set_load(const char *gbsPath, const char *m3uPath, const struct stat *st);
+static void set_unlink(server *s, gbs_set *set);
+static void set_free(server *s, gbs_set *set);
+static void evict_sets(server *s);
+static gbs2wav_t *renderer_acquire(server *s, gbs_set *set, const gbs2wav_config *c, const char **err);
+static void renderer_release(server *s, gbs_set *set, gbs2wav_t *h, const gbs2wav_config *c);
+static void evict_renderer(server *s);
+static void close_renderer(gbs2wav_t *h);
+
+static int read_line(int fd, char *line, size_t size);
+static unsigned int split_fields(char *line, char **field, unsigned int max);
+static int send_all(int fd, const void *data, size_t len);
+static void send_error(int fd, const char *message);
+static uint8_t *read_file(const char *filename, uint32_t *size);
+static void pack_samples(uint8_t *d, const int16_t *s, uint64_t count);
+static void build_wav_header(uint8_t *d, unsigned int channels, uint64_t frames, unsigned int sampleRate);
+static void put_le32(uint8_t *d, uint32_t n);
+static void record_latency(server *s, double firstByte, double total, uint64_t bytes);
+static double percentile(double *v, unsigned int count, double p);
+static int compare_double(const void *a, const void *b);
+static double now(void);
+static void on_signal(int sig);
+
+int daemon_run(const daemon_options *o) {
+    server s;
+    struct sockaddr_un addr;
+    struct pollfd p;
+    pending_conn c;
+    pthread_t *threads = NULL;
+    unsigned int threadCount = 0;
+    unsigned int bound = 0;
+    unsigned int k;
+    int fd;
+    int r = -1;
+
+    memset(&s,0,sizeof(server));
+    s.o = o;
+    s.listenFd = -1;
+    pthread_mutex_init(&s.lock,NULL);
+    pthread_cond_init(&s.cond,NULL);
+
+    if(strlen(o->socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"Socket path too long: %s\n",o->socketPath);
+        goto done;
+    }
+
+    s.queueSize = o->threads * DAEMON_QUEUE_FACTOR;
+    s.queue = (pending_conn *)malloc(sizeof(pending_conn) * s.queueSize);
+    threads = (pthread_t *)malloc(sizeof(pthread_t) * o->threads);
+    if(s.queue == NULL || threads == NULL) {
+        fprintf(stderr,"out of memory\n");
+        goto done;
+    }
+
+    s.listenFd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(s.listenFd < 0) {
+        fprintf(stderr,"Error creating socket: %s\n",strerror(errno));
+        goto done;
+    }
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path,o->socketPath,strlen(o->socketPath) + 1);
+
+    /* left behind by an earlier run that didn't shut down */
+    unlink(o->socketPath);
+    if(bind(s.listenFd,(struct sockaddr *)&addr,sizeof(addr)) != 0) {
+        fprintf(stderr,"Error binding %s: %s\n",o->socketPath,strerror(errno));
+        goto done;
+    }
+    bound = 1;
+    if(listen(s.listenFd,(int)s.queueSize) != 0) {
+        fprintf(stderr,"Error listening on %s: %s\n",o->socketPath,strerror(errno));
+        goto done;
+    }
+
+    signal(SIGPIPE,SIG_IGN);
+    signal(SIGINT,on_signal);
+    signal(SIGTERM,on_signal);
+
+    for(k = 0; k < o->threads; k++) {
+        if(pthread_create(&threads[k],NULL,server_worker,&s) != 0) break;
+        threadCount++;
+    }
+    if(threadCount == 0) {
+        fprintf(stderr,"Error starting worker threads\n");
+        goto done;
+    }
+
+    printf("Listening on %s: %u worker(s), %u queued, %u GBS set(s) cached, %u warm renderer(s)\n",
+      o->socketPath,threadCount,s.queueSize,o->cacheSize,o->warmSize);
+    fflush(stdout);
+
+    while(!stopRequested) {
+        p.fd = s.listenFd;
+        p.events = POLLIN;
+        p.revents = 0;
+        if(poll(&p,1,POLL_MS) <= 0) continue;
+
+        fd = accept(s.listenFd,NULL,NULL);
+        if(fd < 0) continue;
+        c.fd = fd;
+        c.accepted = now();
+
+        pthread_mutex_lock(&s.lock);
+        if(s.queueCount == s.queueSize) {
+            s.m.rejected++;
+            pthread_mutex_unlock(&s.lock);
+            send_error(fd,"busy");
+            close(fd);
+            continue;
+        }
+        s.queue[(s.queueHead + s.queueCount) % s.queueSize] = c;
+        s.queueCount++;
+        pthread_cond_signal(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+    }
+    printf("Shutting down\n");
+    r = 0;
+
+    done:
+    pthread_mutex_lock(&s.lock);
+    s.stopping = 1;
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+    for(k = 0; k < threadCount; k++) {
+        pthread_join(threads[k],NULL);
+    }
+
+    /* never picked up */
+    while(s.queueCount) {
+        close(s.queue[s.queueHead].fd);
+        s.queueHead = (s.queueHead + 1) % s.queueSize;
+        s.queueCount--;
+    }
+    if(s.listenFd >= 0) close(s.listenFd);
+    if(bound) unlink(o->socketPath);
+
+    while(s.sets != NULL) {
+        set_free(&s,s.sets);
+    }
+    if(s.queue != NULL) free(s.queue);
+    if(threads != NULL) free(threads);
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    return r;
+}
+
+static void *server_worker(void *userdata) {
+    server *s = (server *)userdata;
+    pending_conn c;
+
+    trace_thread_name("daemon worker");
+    for(;;) {
+        pthread_mutex_lock(&s->lock);
+        while(s->queueCount == 0 && !s->stopping) {
+            pthread_cond_wait(&s->cond,&s->lock);
+        }
+        if(s->stopping) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        c = s->queue[s->queueHead];
+        s->queueHead = (s->queueHead + 1) % s->queueSize;
+        s->queueCount--;
+        s->m.active++;
+        pthread_mutex_unlock(&s->lock);
+
+        serve(s,&c);
+        close(c.fd);
+
+        pthread_mutex_lock(&s->lock);
+        s->m.active--;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+static void serve(server *s, const pending_conn *c) {
+    char line[REQUEST_MAX];
+    char *field[REQUEST_FIELDS];
+    unsigned int count = 0;
+    struct timeval tv;
+    uint64_t traceStart = trace_begin();
+    int r = -1;
+
+    tv.tv_sec = REQUEST_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(c->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+
+    if(read_line(c->fd,line,sizeof(line)) == 0) {
+        count = split_fields(line,field,REQUEST_FIELDS);
+    }
+
+    if(count == 0) {
+        send_error(c->fd,"bad request");
+    } else if(strcmp(field[0],"render") == 0) {
+        r = serve_render(s,c,field,count);
+    } else if(strcmp(field[0],"load") == 0) {
+        r = serve_load(s,c,field,count);
+    } else if(strcmp(field[0],"stats") == 0) {
+        r = serve_stats(s,c);
+    } else {
+        send_error(c->fd,"unknown request");
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->m.requests++;
+    if(r != 0) s->m.errors++;
+    pthread_mutex_unlock(&s->lock);
+    trace_end(traceStart,"request",-1);
+}
+
+static int serve_render(server *s, const pending_conn *c, char **field, unsigned int count) {
+    render_request q;
+    gbs_set *set;
+    gbs2wav_t *h = NULL;
+    const char *err;
+    char *end;
+    char header[128];
+    unsigned int index;
+    uint64_t frames;
+    uint64_t total;
+    uint64_t bytes = 0;
+    int16_t *samples = NULL;
+    uint8_t *packed = NULL;
+    unsigned int buffered = 0;
+    double firstByte;
+    uint64_t traceStart;
+    int r = -1;
+
+    if(count < 3) {
+        send_error(c->fd,"usage: render <gbs> <track> [key=value ...]");
+        return -1;
+    }
+    err = parse_options(&q,&field[3],count - 3,&s->o->config);
+    if(err == NULL) {
+        q.track = (unsigned int)strtoul(field[2],&end,10);
+        if(*end != '\0' || q.track == 0) err = "bad track number";
+    }
+    if(err != NULL) {
+        send_error(c->fd,err);
+        return -1;
+    }
+
+    set = set_acquire(s,field[1],q.m3u,&err);
+    if(set == NULL) {
+        send_error(c->fd,err);
+        return -1;
+    }
+
+    h = renderer_acquire(s,set,&q.config,&err);
+    if(h == NULL) goto done;
+    for(index = 0; index < gbs2wav_track_count(h); index++) {
+        if(gbs2wav_track_number(h,index) == q.track) break;
+    }
+    if(index == gbs2wav_track_count(h)) {
+        err = "no such track";
+        goto done;
+    }
+    traceStart = trace_begin();
+    if(gbs2wav_start_track(h,index) != 0) {
+        err = "can't start the track";
+        goto done;
+    }
+    trace_end(traceStart,"start track",(int)q.track);
+
+    if(budget_acquire(BLOCK_BYTES,0) != 0) {
+        err = "busy";
+        goto done;
+    }
+    buffered = 1;
+    samples = (int16_t *)malloc(sizeof(int16_t) * BLOCK_FRAMES * GBS2WAV_MAX_CHANNELS);
+    packed = (uint8_t *)malloc(sizeof(int16_t) * BLOCK_FRAMES * GBS2WAV_MAX_CHANNELS);
+    if(samples == NULL || packed == NULL) {
+        err = "out of memory";
+        goto done;
+    }
+
+    total = gbs2wav_track_frames(h,index);
+    snprintf(header,sizeof(header),"ok %016llx %llu %u %u\n",(unsigned long long)set->hash,
+      (unsigned long long)total,q.config.sampleRate,q.config.channels);
+    /* from here on a failed send means the client went away */
+    if(send_all(c->fd,header,strlen(header)) != 0) goto done;
+    if(q.format == FORMAT_WAV) {
+        build_wav_header(packed,q.config.channels,total,q.config.sampleRate);
+        if(send_all(c->fd,packed,WAV_HEADER_SIZE) != 0) goto done;
+    }
+
+    firstByte = 0.0;
+    for(;;) {
+        traceStart = trace_begin();
+        frames = stopRequested ? 0 : gbs2wav_render(h,samples,BLOCK_FRAMES);
+        trace_end(traceStart,"render",(int)q.track);
+        if(frames == 0) break;
+        traceStart = trace_begin();
+        pack_samples(packed,samples,frames * q.config.channels);
+        trace_end(traceStart,"pack",-1);
+        /* blocks while the client's socket buffer is full, so a slow
+         * reader holds the render back instead of it piling up here */
+        traceStart = trace_begin();
+        if(send_all(c->fd,packed,(size_t)(frames * q.config.channels * 2)) != 0) goto done;
+        trace_end(traceStart,"send",-1);
+        if(bytes == 0) firstByte = now() - c->accepted;
+        bytes += frames * q.config.channels * 2;
+    }
+    if(gbs2wav_frames_left(h) != 0) goto done;
+
+    record_latency(s,firstByte,now() - c->accepted,bytes);
+    r = 0;
+
+    done:
+    if(err != NULL) send_error(c->fd,err);
+    if(samples != NULL) free(samples);
+    if(packed != NULL) free(packed);
+    if(buffered) budget_release(BLOCK_BYTES);
+    if(h != NULL) renderer_release(s,set,h,&q.config);
+    set_release(s,set);
+    return r;
+}
+
+static int serve_load(server *s, const pending_conn *c, char **field, unsigned int count) {
+    render_request q;
+    gbs_set *set;
+    gbs2wav_t *h;
+    const char *err;
+    char answer[64];
+    unsigned int tracks;
+
+    if(count < 2) {
+        send_error(c->fd,"usage: load <gbs> [m3u=path]");
+        return -1;
+    }
+    err = parse_options(&q,&field[2],count - 2,&s->o->config);
+    if(err != NULL) {
+        send_error(c->fd,err);
+        return -1;
+    }
+
+    set = set_acquire(s,field[1],q.m3u,&err);
+    if(set == NULL) {
+        send_error(c->fd,err);
+        return -1;
+    }
+    h = renderer_acquire(s,set,&q.config,&err);
+    if(h == NULL) {
+        send_error(c->fd,err);
+        set_release(s,set);
+        return -1;
+    }
+    tracks = gbs2wav_track_count(h);
+    renderer_release(s,set,h,&q.config);
+
+    snprintf(answer,sizeof(answer),"ok %016llx %u\n",(unsigned long long)set->hash,tracks);
+    set_release(s,set);
+    return send_all(c->fd,answer,strlen(answer));
+}
+
+static int serve_stats(server *s, const pending_conn *c) {
+    server_metrics *m;
+    budget_stats mem;
+    char answer[1024];
+    unsigned int queued;
+    unsigned int cached;
+    unsigned int warm;
+    unsigned int n;
+    int r;
+
+    m = (server_metrics *)malloc(sizeof(server_metrics));
+    if(m == NULL) {
+        send_error(c->fd,"out of memory");
+        return -1;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    memcpy(m,&s->m,sizeof(server_metrics));
+    queued = s->queueCount;
+    cached = s->setCount;
+    warm = s->idleCount;
+    pthread_mutex_unlock(&s->lock);
+    budget_get_stats(&mem);
+
+    n = m->latencyCount;
+    snprintf(answer,sizeof(answer),
+      "ok requests=%llu errors=%llu rejected=%llu active=%u queued=%u cached=%u warm=%u"
+      " cache_hits=%llu cache_misses=%llu warm_hits=%llu cold_starts=%llu bytes=%llu"
+      " first_byte_ms_p50=%.1f first_byte_ms_p95=%.1f first_byte_ms_p99=%.1f"
+      " total_ms_p50=%.1f total_ms_p95=%.1f total_ms_p99=%.1f"
+      " mem_bytes=%llu mem_peak=%llu mem_limit=%llu mem_shed=%llu mem_over=%llu\n",
+      (unsigned long long)m->requests,(unsigned long long)m->errors,(unsigned long long)m->rejected,
+      m->active,queued,cached,warm,
+      (unsigned long long)m->cacheHits,(unsigned long long)m->cacheMisses,
+      (unsigned long long)m->warmHits,(unsigned long long)m->coldStarts,(unsigned long long)m->bytes,
+      percentile(m->firstByte,n,0.50) * 1000.0,percentile(m->firstByte,n,0.95) * 1000.0,
+      percentile(m->firstByte,n,0.99) * 1000.0,
+      percentile(m->total,n,0.50) * 1000.0,percentile(m->total,n,0.95) * 1000.0,
+      percentile(m->total,n,0.99) * 1000.0,
+      (unsigned long long)mem.inUse,(unsigned long long)mem.peak,(unsigned long long)mem.limit,
+      (unsigned long long)mem.shed,(unsigned long long)mem.overruns);
+    free(m);
+
+    r = send_all(c->fd,answer,strlen(answer));
+    return r;
+}
+
+/* key=value fields on top of the server's defaults */
+static const char *parse_options(render_request *q, char **field, unsigned int count, const gbs2wav_config *defaults) {
+    unsigned int i;
+    char *val;
+    char *end;
+    int n;
+
+    q->m3u = NULL;
+    q->track = 0;
+    q->format = FORMAT_WAV;
+    q->config = *defaults;
+
+    for(i = 0; i < count; i++) {
+        val = strchr(field[i],'=');
+        if(val == NULL) return "expected key=value";
+        *val++ = '\0';
+
+        if(strcmp(field[i],"m3u") == 0) {
+            q->m3u = val;
+        } else if(strcmp(field[i],"model") == 0) {
+            n = gbs2wav_model_lookup(val);
+            if(n == -1) return "unknown model";
+            q->config.model = n;
+        } else if(strcmp(field[i],"rate") == 0) {
+            q->config.sampleRate = (unsigned int)strtoul(val,&end,10);
+            if(*end != '\0' || q->config.sampleRate == 0) return "bad sample rate";
+        } else if(strcmp(field[i],"channels") == 0) {
+            q->config.channels = (unsigned int)strtoul(val,&end,10);
+            if(*end != '\0' || q->config.channels == 0 || q->config.channels > GBS2WAV_MAX_CHANNELS) return "bad channel count";
+        } else if(strcmp(field[i],"quality") == 0) {
+            n = gbs2wav_quality_lookup(val);
+            if(n == -1) return "unknown quality";
+            gbs2wav_config_set_quality(&q->config,(gbs2wav_quality)n);
+        } else if(strcmp(field[i],"format") == 0) {
+            if(strcmp(val,"wav") == 0) q->format = FORMAT_WAV;
+            else if(strcmp(val,"pcm") == 0) q->format = FORMAT_PCM;
+            else return "unknown format";
+        } else {
+            return "unknown key";
+        }
+    }
+    return NULL;
+}
+
+/* finds gbs in the cache, loading it on a miss. Two requests missing
+ * the same set at once both load it, the spare copy ages out. The set
+ * is held until set_release */
+static gbs_set *set_acquire(server *s, const char *gbs, const char *m3u, const char **err) {
+    struct stat st[2];
+    gbs_set *set;
+    gbs_set *next;
+    uint64_t hash;
+    char *end;
+
+    if(gbs[0] == '#') {
+        hash = strtoull(&gbs[1],&end,16);
+        pthread_mutex_lock(&s->lock);
+        for(set = s->sets; set != NULL; set = set->next) {
+            if(!set->stale && set->hash == hash && (m3u == NULL || set->m3uPath == NULL ||
+              strcmp(set->m3uPath,m3u) == 0)) break;
+        }
+        if(set != NULL) {
+            set->refs++;
+            set->lastUse = ++s->useClock;
+            s->m.cacheHits++;
+        }
+        pthread_mutex_unlock(&s->lock);
+        if(set == NULL) *err = "no cached set with that hash";
+        return set;
+    }
+
+    if(stat(gbs,&st[0]) != 0 || (m3u != NULL && stat(m3u,&st[1]) != 0)) {
+        *err = "can't read the GBS or M3U";
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    for(set = s->sets; set != NULL; set = next) {
+        next = set->next;
+        if(set->stale || strcmp(set->gbsPath,gbs) != 0) continue;
+        if((set->m3uPath == NULL) != (m3u == NULL)) continue;
+        if(m3u != NULL && strcmp(set->m3uPath,m3u) != 0) continue;
+
+        if(set->mtime[0] == st[0].st_mtime && set->fileSize[0] == st[0].st_size &&
+          (m3u == NULL || (set->mtime[1] == st[1].st_mtime && set->fileSize[1] == st[1].st_size))) {
+            set->refs++;
+            set->lastUse = ++s->useClock;
+            s->m.cacheHits++;
+            pthread_mutex_unlock(&s->lock);
+            return set;
+        }
+        set->stale = 1;
+        if(set->refs == 0) {
+            set_unlink(s,set);
+            set_free(s,set);
+        }
+    }
+    s->m.cacheMisses++;
+    pthread_mutex_unlock(&s->lock);
+
+    set = set_load(gbs,m3u,st);
+    if(set == NULL) {
+        *err = "can't load the GBS or M3U";
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    set->refs = 1;
+    set->lastUse = ++s->useClock;
+    set->next = s->sets;
+    s->sets = set;
+    s->setCount++;
+    evict_sets(s);
+    pthread_mutex_unlock(&s->lock);
+    return set;
+}
+
+static void set_release(server *s, gbs_set *set) {
+    pthread_mutex_lock(&s->lock);
+    set->refs--;
+    if(set->refs == 0 && set->stale) {
+        set_unlink(s,set);
+        set_free(s,set);
+    } else {
+        evict_sets(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static gbs_set *set_load(const char *gbsPath, const char *m3uPath, const struct stat *st) {
+    gbs_set *set = (gbs_set *)malloc(sizeof(gbs_set));
+    if(set == NULL) return NULL;
+    memset(set,0,sizeof(gbs_set));
+
+    set->gbsPath = (char *)malloc(strlen(gbsPath) + 1);
+    if(set->gbsPath == NULL) goto fail;
+    memcpy(set->gbsPath,gbsPath,strlen(gbsPath) + 1);
+    set->mtime[0] = st[0].st_mtime;
+    set->fileSize[0] = st[0].st_size;
+    set->gbs = read_file(gbsPath,&set->gbsLen);
+    if(set->gbs == NULL) goto fail;
+
+    if(m3uPath != NULL) {
+        set->m3uPath = (char *)malloc(strlen(m3uPath) + 1);
+        if(set->m3uPath == NULL) goto fail;
+        memcpy(set->m3uPath,m3uPath,strlen(m3uPath) + 1);
+        set->mtime[1] = st[1].st_mtime;
+        set->fileSize[1] = st[1].st_size;
+        set->m3u = (char *)read_file(m3uPath,&set->m3uLen);
+        if(set->m3u == NULL) goto fail;
+    }
+
+    /* the same input hash the journal uses */
+    set->hash = journal_hash(journal_hash(JOURNAL_HASH_INIT,set->gbs,set->gbsLen),set->m3u,set->m3uLen);
+    return set;
+
+    fail:
+    if(set->gbsPath != NULL) free(set->gbsPath);
+    if(set->m3uPath != NULL) free(set->m3uPath);
+    if(set->gbs != NULL) free(set->gbs);
+    if(set->m3u != NULL) free(set->m3u);
+    free(set);
+    return NULL;
+}
+
+/* takes set out of the list, with the lock held */
+static void set_unlink(server *s, gbs_set *set) {
+    gbs_set **p = &s->sets;
+    while(*p != set) p = &(*p)->next;
+    *p = set->next;
+    s->setCount--;
+}
+
+/* frees an unlinked set and its idle renderers, with the lock held.
+ * At shutdown it's called on sets still in the list */
+static void set_free(server *s, gbs_set *set) {
+    warm_renderer *w;
+
+    if(s->sets == set) {
+        s->sets = set->next;
+        s->setCount--;
+    }
+    while(set->idle != NULL) {
+        w = set->idle;
+        set->idle = w->next;
+        close_renderer(w->h);
+        free(w);
+        s->idleCount--;
+    }
+    free(set->gbsPath);
+    if(set->m3uPath != NULL) free(set->m3uPath);
+    free(set->gbs);
+    if(set->m3u != NULL) free(set->m3u);
+    free(set);
+}
+
+/* drops the least recently used unheld sets while over the cache size,
+ * with the lock held */
+static void evict_sets(server *s) {
+    gbs_set *set;
+    gbs_set *lru;
+
+    while(s->setCount > s->o->cacheSize) {
+        lru = NULL;
+        for(set = s->sets; set != NULL; set = set->next) {
+            if(set->refs == 0 && (lru == NULL || set->lastUse < lru->lastUse)) lru = set;
+        }
+        if(lru == NULL) break;
+        set_unlink(s,lru);
+        set_free(s,lru);
+    }
+}
+
+/* a warm renderer for set with config c, or a newly opened one.
+ * Renderers hold their memory from the budget until they're closed,
+ * warm ones included, so a new one may evict idle renderers to fit */
+static gbs2wav_t *renderer_acquire(server *s, gbs_set *set, const gbs2wav_config *c, const char **err) {
+    warm_renderer **p;
+    warm_renderer *w;
+    gbs2wav_t *h;
+    uint64_t size;
+    uint64_t traceStart;
+
+    pthread_mutex_lock(&s->lock);
+    for(p = &set->idle; *p != NULL; p = &(*p)->next) {
+        if(memcmp(&(*p)->config,c,sizeof(gbs2wav_config)) != 0) continue;
+        w = *p;
+        *p = w->next;
+        s->idleCount--;
+        s->m.warmHits++;
+        pthread_mutex_unlock(&s->lock);
+        h = w->h;
+        free(w);
+        return h;
+    }
+    s->m.coldStarts++;
+    pthread_mutex_unlock(&s->lock);
+
+    traceStart = trace_begin();
+    h = gbs2wav_open(set->gbs,set->gbsLen,set->m3u,set->m3uLen,c);
+    trace_end(traceStart,"open",-1);
+    if(h == NULL) {
+        *err = "can't open a renderer with those settings";
+        return NULL;
+    }
+    size = gbs2wav_resident_size(h);
+    while(budget_acquire(size,0) != 0) {
+        pthread_mutex_lock(&s->lock);
+        if(s->idleCount == 0) {
+            pthread_mutex_unlock(&s->lock);
+            gbs2wav_close(h);
+            *err = "busy";
+            return NULL;
+        }
+        evict_renderer(s);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return h;
+}
+
+/* keeps h warm for the next request, closing the least recently used
+ * idle renderer when there are too many */
+static void renderer_release(server *s, gbs_set *set, gbs2wav_t *h, const gbs2wav_config *c) {
+    warm_renderer *w = (warm_renderer *)malloc(sizeof(warm_renderer));
+
+    if(w == NULL) {
+        close_renderer(h);
+        return;
+    }
+    w->h = h;
+    w->config = *c;
+
+    pthread_mutex_lock(&s->lock);
+    if(set->stale || s->o->warmSize == 0) {
+        pthread_mutex_unlock(&s->lock);
+        close_renderer(h);
+        free(w);
+        return;
+    }
+    w->lastUse = ++s->useClock;
+    w->next = set->idle;
+    set->idle = w;
+    s->idleCount++;
+    while(s->idleCount > s->o->warmSize) {
+        evict_renderer(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void evict_renderer(server *s) {
+    gbs_set *set;
+    warm_renderer **p;
+    warm_renderer **lru = NULL;
+    warm_renderer *w;
+
+    for(set = s->sets; set != NULL; set = set->next) {
+        for(p = &set->idle; *p != NULL; p = &(*p)->next) {
+            if(lru == NULL || (*p)->lastUse < (*lru)->lastUse) lru = p;
+        }
+    }
+    if(lru == NULL) return;
+    w = *lru;
+    *lru = w->next;
+    s->idleCount--;
+    close_renderer(w->h);
+    free(w);
+}
+
+static void close_renderer(gbs2wav_t *h) {
+    budget_release(gbs2wav_resident_size(h));
+    gbs2wav_close(h);
+}
+
+/* reads up to the first newline, which is cut off along with any \r */
+static int read_line(int fd, char *line, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+    char *nl;
+
+    while(len < size - 1) {
+        n = recv(fd,&line[len],size - 1 - len,0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        len += (size_t)n;
+        line[len] = '\0';
+        nl = strchr(line,'\n');
+        if(nl != NULL) {
+            *nl = '\0';
+            if(nl > line && nl[-1] == '\r') nl[-1] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static unsigned int split_fields(char *line, char **field, unsigned int max) {
+    unsigned int count = 0;
+    char *c = line;
+
+    if(*c == '\0') return 0;
+    while(count < max) {
+        field[count++] = c;
+        c = strchr(c,'\t');
+        if(c == NULL) break;
+        *c++ = '\0';
+    }
+    return count;
+}
+
+/* waits for the client to take each part, so a client that stops
+ * reading is dropped after SEND_TIMEOUT and doesn't hold up a stop */
+static int send_all(int fd, const void *data, size_t len) {
+    const uint8_t *d = (const uint8_t *)data;
+    struct pollfd p;
+    unsigned int waited = 0;
+    ssize_t n;
+    int ready;
+
+    p.fd = fd;
+    p.events = POLLOUT;
+    while(len) {
+        ready = poll(&p,1,POLL_MS);
+        if(ready < 0 && errno != EINTR) return -1;
+        if(ready <= 0) {
+            waited += POLL_MS;
+            if(stopRequested || waited >= SEND_TIMEOUT * 1000) return -1;
+            continue;
+        }
+        n = send(fd,d,len,SEND_FLAGS | MSG_DONTWAIT);
+        if(n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if(n <= 0) return -1;
+        waited = 0;
+        d += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void send_error(int fd, const char *message) {
+    char line[256];
+    snprintf(line,sizeof(line),"error %s\n",message);
+    send_all(fd,line,strlen(line));
+}
+
+static uint8_t *read_file(const char *filename, uint32_t *size) {
+    uint8_t *buf;
+    long len;
+    uint64_t traceStart = trace_begin();
+    FILE *f = fopen(filename,"rb");
+    if(f == NULL) return NULL;
+
+    if(fseek(f,0,SEEK_END) != 0 || (len = ftell(f)) <= 0 || fseek(f,0,SEEK_SET) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    buf = (uint8_t *)malloc((size_t)len);
+    if(buf != NULL && fread(buf,1,(size_t)len,f) != (size_t)len) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *size = (uint32_t)len;
+    trace_end(traceStart,"slurp",-1);
+    return buf;
+}
+
+static void pack_samples(uint8_t *d, const int16_t *s, uint64_t count) {
+    uint64_t i;
+    for(i = 0; i < count; i++) {
+        d[(i*2)+0] = (uint8_t)((uint16_t)s[i] & 0xFF);
+        d[(i*2)+1] = (uint8_t)((uint16_t)s[i] >> 8);
+    }
+}
+
+/* a plain 16-bit PCM header, sizes capped at what RIFF can hold */
+static void build_wav_header(uint8_t *d, unsigned int channels, uint64_t frames, unsigned int sampleRate) {
+    uint64_t dataSize = frames * channels * 2;
+    if(dataSize > 0xFFFFFFFFULL - 36) dataSize = 0xFFFFFFFFULL - 36;
+
+    memcpy(&d[0],"RIFF",4);
+    put_le32(&d[4],(uint32_t)(dataSize + 36));
+    memcpy(&d[8],"WAVE",4);
+    memcpy(&d[12],"fmt ",4);
+    put_le32(&d[16],16);
+    d[20] = 1;
+    d[21] = 0;
+    d[22] = (uint8_t)channels;
+    d[23] = 0;
+    put_le32(&d[24],sampleRate);
+    put_le32(&d[28],sampleRate * channels * 2);
+    d[32] = (uint8_t)(channels * 2);
+    d[33] = 0;
+    d[34] = 16;
+    d[35] = 0;
+    memcpy(&d[36],"data",4);
+    put_le32(&d[40],(uint32_t)dataSize);
+}
+
+static void put_le32(uint8_t *d, uint32_t n) {
+    d[0] = (uint8_t)(n & 0xFF);
+    d[1] = (uint8_t)((n >> 8) & 0xFF);
+    d[2] = (uint8_t)((n >> 16) & 0xFF);
+    d[3] = (uint8_t)(n >> 24);
+}
+
+static void record_latency(server *s, double firstByte, double total, uint64_t bytes) {
+    pthread_mutex_lock(&s->lock);
+    s->m.firstByte[s->m.latencyPos] = firstByte;
+    s->m.total[s->m.latencyPos] = total;
+    s->m.latencyPos = (s->m.latencyPos + 1) % LATENCY_SAMPLES;
+    if(s->m.latencyCount < LATENCY_SAMPLES) s->m.latencyCount++;
+    s->m.bytes += bytes;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* sorts v in place */
+static double percentile(double *v, unsigned int count, double p) {
+    if(count == 0) return 0.0;
+    qsort(v,count,sizeof(double),compare_double);
+    return v[(unsigned int)((double)(count - 1) * p + 0.5)];
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/* a second signal gets the default handling */
+static void on_signal(int sig) {
+    stopRequested = 1;
+    signal(sig,SIG_DFL);
+}
+
+#endif
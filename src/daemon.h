@@ -0,0 +1,45 @@
+#ifndef GBS2WAV_DAEMON_H
+#define GBS2WAV_DAEMON_H
+
+/* render server on a local Unix domain socket.
+ *
+ * Loaded GBS sets (the GBS and M3U buffers) are kept in a small LRU
+ * cache, and renderers opened from them are kept warm once a request
+ * is done with them, so a popular set is only read, parsed and
+ * initialized once. Each connection carries one request, a line of
+ * tab-separated fields:
+ *
+ *   render <gbs> <track> [key=value ...]
+ *   load <gbs> [m3u=path]
+ *   stats
+ *
+ * <gbs> is a path, or "#" followed by the hash a previous answer gave
+ * for a cached set. <track> is the track number used in file names.
+ * Keys: m3u=path, model=, rate=, channels=, quality=, format=wav|pcm.
+ *
+ * A render answers "ok <hash> <frames> <rate> <channels>\n" followed
+ * by the track as a WAV or raw 16-bit little-endian PCM. Audio is
+ * only rendered as fast as the client reads it. load caches a set and
+ * warms a renderer with the defaults, answering "ok <hash> <tracks>".
+ * stats answers "ok" and key=value counters and latency percentiles
+ * on one line. Errors are "error <message>\n". */
+
+#include "libgbs2wav.h"
+
+typedef struct daemon_options {
+    const char *socketPath;
+    /* requests rendered at once, more wait in a queue of
+     * threads * DAEMON_QUEUE_FACTOR, past that they're turned away */
+    unsigned int threads;
+    /* GBS sets kept loaded */
+    unsigned int cacheSize;
+    /* idle renderers kept open */
+    unsigned int warmSize;
+    /* what a request gets for any key it leaves out */
+    gbs2wav_config config;
+} daemon_options;
+
+/* serves until SIGINT or SIGTERM, returns 0 on a clean shutdown */
+int daemon_run(const daemon_options *o);
+
+#endif
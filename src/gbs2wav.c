@@ -1,20 +1,83 @@
-#include "thirdparty/SameBoy/Core/gb.h"
-#include "thirdparty/SameBoy/Core/apu.h"
-
-#define NEZ_M3U_IMPLEMENTATION
-#define NEZ_M3U_STATIC
-#include "nez-m3u-parser.h"
+#include "libgbs2wav.h"
+#include "loudness.h"
+#include "peaks.h"
+#include "segments.h"
+#include "journal.h"
+#include "daemon.h"
+#include "catalog.h"
+#include "budget.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
 
-#define DEFAULT_SAMPLE_RATE 48000
-#define MAX_CHANNELS 2
+#define MAX_CHANNELS GBS2WAV_MAX_CHANNELS
 #define BUFFER_SIZE (8192 * 2)
-#define DEFAULT_GB_MODEL GB_MODEL_DMG_B
+#define LOW_MEMORY_BLOCK_FRAMES 1024
+#define LOW_MEMORY_ID3_SIZE 512
+#define DEFAULT_APU_FACTOR 4
+#define DEFAULT_BENCH_RUNS 2
+#define DEFAULT_SPLIT_SECONDS 30
+#define DEFAULT_INDEX_SECONDS 5
+#define DEFAULT_INDEX_BUDGET 1024
+#define DEFAULT_PEAK_FRAMES 256
+#define DEFAULT_JOURNAL_NAME "gbs2wav.journal"
+#define DEFAULT_REPORT_NAME "gbs2wav.report"
+#define DEFAULT_PROFILE_NAME "gbs2wav.profile.json"
+#define DEFAULT_TRACE_NAME "gbs2wav.trace.json"
+#define DEFAULT_DAEMON_CACHE 16
+#define DEFAULT_DAEMON_WARM 8
+/* --catalog render estimates, in multiples of realtime */
+#define DEFAULT_CATALOG_SPEED 50
+
+/* --dedupe: PCM hash checkpoints, the emulator is snapshotted after
+ * the last one */
+#define DEDUPE_CHECKPOINTS 3
+
+#define TRACK_RENDERED  0
+#define TRACK_DUPLICATE 1
+#define TRACK_RESUMED   2
+/* stopped early, nothing of the track is kept */
+#define TRACK_TIMEOUT   3
+#define TRACK_CYCLES    4
+#define TRACK_TOO_LARGE 5
+#define TRACK_CANCELLED 6
+#define TRACK_WRITE_ERROR 7
+/* not started, an earlier track ended the run */
+#define TRACK_SKIPPED   8
+#define track_failed(t) ((t)->status >= TRACK_TIMEOUT)
+
+/* tracks render in slices of this many emulated cycles (half a
+ * second), the limits and the cancel flag are checked in between */
+#define SLICE_CYCLES (1 << 22)
+#define CYCLES_PER_SECOND (1 << 23)
+
+/* --profile: emulated cycles between samples, and how many routines
+ * the summary lists */
+#define PROFILE_INTERVAL 1024
+#define PROFILE_TOP_ROUTINES 10
+
+/* 64-bit FNV-1a, for comparing rendered PCM */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+#define ALBUM_NONE 0
+#define ALBUM_CUE  1
+#define ALBUM_TAR  2
+
+/* ReplayGain 2.0 reference level */
+#define REPLAYGAIN_REFERENCE (-18.0)
+
+#define TAR_BLOCK_SIZE 512
+#define CUE_FRAMES_PER_SECOND 75
+/* INDEX is mm:ss:ff and readers stop at 99 minutes */
+#define CUE_MAX_MINUTES 99
 
 #define CLAMP(val, min, max) ( (val) < (min) ? (min) : (val) > (max) ? (max) : (val) )
 #define str_equals(s1,s2) (strcmp(s1,s2) == 0)
@@ -27,31 +90,196 @@ typedef struct str_buffer {
     uint32_t len;
 } str_buffer;
 
+typedef struct stem_buffer {
+    FILE *output;
+    int16_t *samples;
+} stem_buffer;
+
 typedef struct audio_buffer {
     FILE *output;
-    uint64_t startFrames;
-    uint64_t totalFrames;
-    uint64_t fadeFrames;
-    int16_t samples[MAX_CHANNELS * BUFFER_SIZE];
-    uint8_t packed[MAX_CHANNELS * BUFFER_SIZE * 2];
-    uint64_t curSample;
+    unsigned int channels;
+    uint64_t blockFrames;
+    int16_t *samples;
+    uint8_t *packed;
+    /* stems mode: GBS2WAV_STEM_COUNT extra outputs, one per APU
+     * channel, NULL otherwise */
+    stem_buffer *stems;
+    /* measures the faded mix as it's written, NULL when disabled */
+    loudness_state *loudness;
+    /* --peaks: the waveform overview of the mix, NULL when disabled */
+    peaks_state *peaks;
+    /* cleared once the mix has a non-zero sample */
+    unsigned int silent;
 } audio_buffer;
 
-static str_buffer id3_buffer;
+/* one entry per track to render, planned before rendering starts
+ * so album outputs know every size up front */
+typedef struct track_entry {
+    unsigned int number;
+    uint64_t totalFrames;
+    uint64_t fadeFrames;
+    uint64_t offsetFrames;
+    const char *name;
+    /* filled in with --replaygain: the track's values, and where its
+     * album placeholders ended up (path NULL = the album file) */
+    double gain;
+    double peak;
+    char *path;
+    long albumGainPos;
+    long albumPeakPos;
+    /* the finished WAV's hash, size and mtime, for the journal */
+    uint64_t hash;
+    uint64_t size;
+    int64_t mtime;
+    /* --dedupe: the PCM hash at each checkpoint, a snapshot taken
+     * after the last one, and where the track's PCM starts (dataPath
+     * NULL = the album file) */
+    uint64_t runHash;
+    uint64_t checkHash[DEDUPE_CHECKPOINTS];
+    unsigned int checks;
+    uint8_t *state;
+    uint64_t stateFrames;
+    char *dataPath;
+    long dataPos;
+    loudness_histogram *hist;
+    peaks_state *peaks;
+    /* for the run report */
+    unsigned int status;
+    unsigned int dupOf;
+    unsigned int silent;
+    double seconds;
+} track_entry;
+
+/* offsets of fixed-width placeholder values within an ID3 buffer,
+ * so they can be filled in once measured without changing its size */
+typedef struct gain_tags {
+    uint32_t trackGain;
+    uint32_t trackPeak;
+    uint32_t albumGain;
+    uint32_t albumPeak;
+    uint32_t loudness;
+    uint32_t truePeak;
+} gain_tags;
+
+typedef struct album_tags {
+    const char *title;
+    const char *artist;
+    const char *composer;
+    const char *date;
+    const char *ripper;
+    const char *tagger;
+} album_tags;
+
+static const unsigned int dedupe_seconds[DEDUPE_CHECKPOINTS] = { 1, 2, 4 };
+
+/* set on SIGINT or SIGTERM, the track in progress stops at the end of
+ * its slice and the run ends there */
+static volatile sig_atomic_t cancelled = 0;
+
+static const char *stem_names[GBS2WAV_STEM_COUNT] = {
+    "Pulse 1",
+    "Pulse 2",
+    "Wave",
+    "Noise",
+};
+
+/* --split: render long tracks as segments on worker threads */
+typedef struct split_options {
+    const uint8_t *gbs;
+    uint32_t gbsSize;
+    const uint8_t *m3u;
+    uint32_t m3uSize;
+    uint64_t segmentFrames;
+    unsigned int threads;
+    unsigned int verify;
+} split_options;
+
+/* per-track limits, 0 = none */
+typedef struct track_limits {
+    unsigned int seconds;
+    uint64_t cycles;
+    uint64_t bytes;
+} track_limits;
+
+/* the limits as the --split prepass sees them */
+typedef struct limit_check {
+    const track_limits *limits;
+    double startClock;
+    unsigned int status;
+} limit_check;
+
+/* per-worker scratch, allocated once and reused for every track:
+ * sample blocks for the mix and any stems, one shared pack buffer
+ * and the ID3 tag buffers. The stems get a tag of their own, the
+ * mix's loudness and gain don't describe them */
+typedef struct render_arena {
+    uint64_t blockFrames;
+    unsigned int stemCount;
+    int16_t *samples;
+    uint8_t *packed;
+    stem_buffer *stems;
+    str_buffer id3;
+    str_buffer stemId3;
+} render_arena;
+
+/* one quality preset's --bench figures, as kept in a baseline file */
+typedef struct bench_result {
+    unsigned int present;
+    unsigned int apuFactor;
+    double framesPerSecond;
+    uint64_t hash;
+} bench_result;
+
+static int arena_init(render_arena *a, uint64_t blockFrames, unsigned int stemCount, uint32_t id3Size);
+static void arena_free(render_arena *a);
+static size_t arena_size(const render_arena *a);
+static void arena_attach(render_arena *a, audio_buffer *abuffer);
+
+static int write_frames(audio_buffer *abuffer, uint64_t frameCount);
+static int render_split(gbs2wav_t *h, unsigned int index, audio_buffer *abuffer, const split_options *o, const track_limits *l, double startClock, unsigned int *status);
+static double wall_clock(void);
+static unsigned int check_limits(const track_limits *l, double startClock, uint64_t cycles);
+static int prepass_stop(void *userdata, const gbs2wav_t *h);
+static void on_signal(int sig);
+static int run_bench(const uint8_t *gbsData, uint32_t gbsSize, const uint8_t *m3uData, uint32_t m3uSize, const gbs2wav_config *base, unsigned int apuFactor, unsigned int runs, const char *baselineName, render_arena *arena);
+static unsigned int load_baseline(const char *filename, bench_result *results);
+static int save_baseline(const char *filename, const bench_result *results);
+static int run_catalog(const char *filename, const char *const *dirs, unsigned int dirCount, const char *query, unsigned int threads, unsigned int speed);
+static void format_duration(char *buf, size_t len, uint64_t ms);
+static uint64_t hash_samples(uint64_t hash, const int16_t *s, uint64_t count);
+static int journal_done(const journal *j, uint64_t input, unsigned int track, const char *params, const char *baseName);
+static int journal_commit(journal *j, output_set *outputs, uint64_t input, unsigned int track, const char *params, const char *name, const char *baseName);
+static int dedupe_check(track_entry *tracks, unsigned int index, gbs2wav_t *h, const int16_t *samples, uint64_t frames, uint64_t framesDone, unsigned int channels, uint64_t sampleRate);
+static int copy_track_data(FILE *out, FILE *album, const track_entry *src, uint64_t offset, uint64_t len, uint8_t *buf, size_t bufLen);
+static int write_report(const char *filename, const track_entry *tracks, unsigned int count);
+static int write_profile(const char *filename, const gbs2wav_t *h);
+
+static unsigned int plan_tracks(track_entry **tracks, const gbs2wav_t *h);
+static void free_tracks(track_entry *tracks, unsigned int count);
+static void sanitize_filename(char *name);
+static void id3_build(str_buffer *id3, const album_tags *tags, const char *trackName);
+static void id3_add_gain_tags(str_buffer *id3, gain_tags *g);
+static void id3_fill_gain_tags(str_buffer *id3, const gain_tags *g, const loudness_histogram *track, const loudness_histogram *album);
+static void format_gain(char *buf, size_t len, double lufs, const char *unit);
+static void format_peak(char *buf, size_t len, double peak);
+
+static int write_tar_header(FILE *f, const char *name, uint64_t size);
+static int write_tar_padding(FILE *f, uint64_t size);
+static int write_cue_sheet(const char *filename, const char *wavName, const album_tags *tags, const track_entry *tracks, unsigned int count, uint64_t sampleRate, const loudness_histogram *album);
+static int patch_album_gain(const char *filename, FILE *f, const track_entry *track, const loudness_histogram *album);
+static uint64_t wav_file_size(uint64_t channels, uint64_t totalFrames, str_buffer *id3);
 
 static uint8_t *slurp(const char *filename, uint32_t *size);
-static void dump_gbs_info(const GB_gbs_info_t *info);
+static void dump_gbs_info(const gbs2wav_t *h);
 
-static void fade_frames_mono(int16_t *d, uint64_t framesRem, uint64_t fadeFrames, uint64_t frameCount);
 static void pack_frames_mono(uint8_t *d, int16_t *s, uint64_t frameCount);
-
-static void fade_frames_stereo(int16_t *d, uint64_t framesRem, uint64_t fadeFrames, uint64_t frameCount);
 static void pack_frames_stereo(uint8_t *d, int16_t *s, uint64_t frameCount);
 
 static int write_wav_header(FILE *f, uint64_t channels, uint64_t totalFrames, uint32_t sampleRate, str_buffer *id3);
 static int write_wav_footer(FILE *f, str_buffer *id3);
 
 static void id3_init(str_buffer *s);
+static int id3_reserve(str_buffer *s, size_t len);
 static int id3_add_text(str_buffer *s, const char *frame, const char *data, size_t datalen);
 static int id3_add_private(str_buffer *s, const char *description, const char *data, size_t datalen);
 
@@ -61,58 +289,6 @@ static void pack_uint32le(uint8_t *d, uint32_t n);
 static uint64_t scan_uint(const char *s);
 static int usage(const char *self, int e);
 
-static void on_sample_mono(GB_gameboy_t *gb, GB_sample_t *sample) {
-    int32_t s;
-    audio_buffer *abuffer = GB_get_user_data(gb);
-    if(abuffer->totalFrames) {
-        s = (int32_t)sample->left;
-        s += (int32_t)sample->right;
-        s /= 2;
-        abuffer->samples[abuffer->curSample++] = CLAMP(s,-0x8000,0x7FFF);
-        abuffer->totalFrames--;
-
-        if(abuffer->curSample == BUFFER_SIZE) {
-            fade_frames_mono(abuffer->samples,abuffer->totalFrames,abuffer->fadeFrames,BUFFER_SIZE);
-            pack_frames_mono(abuffer->packed,abuffer->samples,BUFFER_SIZE);
-            fwrite(abuffer->packed,1, BUFFER_SIZE * 2, abuffer->output);
-            abuffer->curSample = 0;
-        }
-    }
-}
-
-static void on_sample_stereo(GB_gameboy_t *gb, GB_sample_t *sample) {
-    audio_buffer *abuffer = GB_get_user_data(gb);
-    if(abuffer->totalFrames) {
-        abuffer->samples[abuffer->curSample++] = sample->left;
-        abuffer->samples[abuffer->curSample++] = sample->right;
-        abuffer->totalFrames--;
-
-        if(abuffer->curSample == 2 * BUFFER_SIZE) {
-            fade_frames_stereo(abuffer->samples,abuffer->totalFrames,abuffer->fadeFrames,BUFFER_SIZE);
-            pack_frames_stereo(abuffer->packed,abuffer->samples,BUFFER_SIZE);
-            fwrite(abuffer->packed,1,2 * BUFFER_SIZE * 2, abuffer->output);
-            abuffer->curSample = 0;
-        }
-    }
-}
-
-static const char *NAME_DMG_B          = "Game Boy";
-static const char *NAME_SGB            = "Super Game Boy (NTSC)";
-static const char *NAME_SGB_NO_SFC     = "Super Game Boy (NTSC) (No SFC)";
-static const char *NAME_SGB_PAL        = "Super Game Boy (PAL)";
-static const char *NAME_SGB_PAL_NO_SFC = "Super Game Boy (PAL) (No SFC)";
-static const char *NAME_SGB2           = "Super Game Boy 2";
-static const char *NAME_SGB2_NO_SFC    = "Super Game Boy 2 (No SFC)";
-static const char *NAME_MGB            = "Game Boy Pocket/Light";
-static const char *NAME_CGB_0          = "Game Boy Color (CPU CGB 0)";
-static const char *NAME_CGB_A          = "Game Boy Color (CPU CGB A)";
-static const char *NAME_CGB_B          = "Game Boy Color (CPU CGB B)";
-static const char *NAME_CGB_C          = "Game Boy Color (CPU CGB C)";
-static const char *NAME_CGB_D          = "Game Boy Color (CPU CGB D)";
-static const char *NAME_CGB_E          = "Game Boy Color";
-static const char *NAME_AGB_A          = "Game Boy Advance";
-static const char *NAME_GBP_A          = "Game Boy Player";
-
 int main(int argc, const char *argv[]) {
     int r = 1;
     const char* self;
@@ -123,44 +299,157 @@ int main(int argc, const char *argv[]) {
     uint32_t gbsSize;
 
     audio_buffer abuffer;
+    render_arena arena;
+    gbs2wav_t *renderer;
+    gbs2wav_config config;
 
     unsigned int i;
-    unsigned int trackNo;
     unsigned int t;
+    unsigned int trackCount;
+    unsigned int albumMode;
+    uint64_t albumFrames;
+    track_entry *tracks;
+    album_tags tags;
+    str_buffer albumId3;
+    FILE *albumFile;
     unsigned int channels;
+    unsigned int apuFactor;
+    unsigned int stems;
+    unsigned int lowMemory;
+    unsigned int replayGain;
+    unsigned int benchRuns;
+    const char *baselineName;
+    unsigned int splitSeconds;
+    unsigned int threads;
+    unsigned int verify;
+    unsigned int indexSeconds;
+    unsigned int peakFrames;
+    unsigned int indexBudget;
+    unsigned int apuLog;
+    unsigned int useJournal;
+    unsigned int dedupe;
+    unsigned int report;
+    unsigned int profile;
+    unsigned int trace;
+    uint64_t traceStart;
+    int dupOf;
+    const loudness_histogram *trackHist;
+    peaks_state peaks;
+    const peaks_state *trackPeaks;
+    unsigned int resume;
+    journal jrnl;
+    output_set outputs;
+    uint64_t inputHash;
+    split_options split;
+    track_limits limits;
+    daemon_options daemon;
+    const char *catalogName;
+    const char *query;
+    unsigned int speed;
+    unsigned int startSeconds;
+    unsigned int startSet;
+    unsigned int memoryBudget;
+    unsigned int status;
+    unsigned int failed;
+    unsigned int differed;
+    int segmentsDiffered;
+    unsigned int firstOutput;
+    uint64_t cycles;
+    int quality;
+    int simd;
+    loudness_state loudness;
+    loudness_histogram *albumLoudness;
+    gain_tags gainTags;
+    gain_tags albumGainTags;
+    long footerPos;
     uint64_t sampleRate;
+    uint64_t frames;
+    uint64_t framesDone;
+    int16_t *stemSamples[GBS2WAV_STEM_COUNT];
+    int model;
+    unsigned int pct;
+    unsigned int lastPct;
+    double startClock;
+    double elapsed;
 
-    char trackName[BUFFER_SIZE];
     char outName[BUFFER_SIZE];
     char baseName[BUFFER_SIZE];
+    char stemName[BUFFER_SIZE];
+    char albumName[BUFFER_SIZE];
+    char indexName[BUFFER_SIZE];
+    char logName[BUFFER_SIZE];
+    char peaksName[BUFFER_SIZE];
+    char journalName[BUFFER_SIZE];
+    char reportName[BUFFER_SIZE];
+    char profileName[BUFFER_SIZE];
+    char traceName[BUFFER_SIZE];
+    char params[BUFFER_SIZE];
+    const char *temp;
+    const char *outTemp;
 
-    char *tmp = NULL;
-    size_t tmpAlloc;
-    char *title = NULL;
-    char *artist = NULL;
-    char *composer = NULL;
-    char *date = NULL;
-    char *ripper = NULL;
-    char *tagger = NULL;
     char *c = NULL;
     const char *s = NULL;
-    const char *modelName = NULL;
-
-    GB_gameboy_t gb;
-    GB_gbs_info_t gbsInfo;
-    GB_model_t gb_model;
-    nez_m3u_t m3u;
 
     m3uData = NULL;
     gbsData = NULL;
-    tmp = NULL;
+    renderer = NULL;
+    outTemp = NULL;
 
     m3uSize = 0;
     gbsSize = 0;
-    tmpAlloc = 0;
-    sampleRate = DEFAULT_SAMPLE_RATE;
+    sampleRate = GBS2WAV_DEFAULT_SAMPLE_RATE;
     channels = MAX_CHANNELS;
-    gb_model = DEFAULT_GB_MODEL;
+    apuFactor = 0;
+    benchRuns = 0;
+    baselineName = NULL;
+    splitSeconds = 0;
+    threads = 0;
+    verify = 0;
+    indexSeconds = 0;
+    peakFrames = 0;
+    indexBudget = DEFAULT_INDEX_BUDGET;
+    apuLog = 0;
+    useJournal = 0;
+    dedupe = 0;
+    report = 0;
+    reportName[0] = '\0';
+    profile = 0;
+    profileName[0] = '\0';
+    trace = 0;
+    traceName[0] = '\0';
+    resume = 0;
+    journalName[0] = '\0';
+    memset(&jrnl,0,sizeof(journal));
+    memset(&outputs,0,sizeof(output_set));
+    memset(&limits,0,sizeof(track_limits));
+    memset(&daemon,0,sizeof(daemon_options));
+    daemon.cacheSize = DEFAULT_DAEMON_CACHE;
+    daemon.warmSize = DEFAULT_DAEMON_WARM;
+    catalogName = NULL;
+    query = NULL;
+    speed = DEFAULT_CATALOG_SPEED;
+    startSeconds = 0;
+    startSet = 0;
+    memoryBudget = 0;
+    failed = 0;
+    differed = 0;
+    stems = 0;
+    lowMemory = 0;
+    albumMode = ALBUM_NONE;
+    albumFile = NULL;
+    tracks = NULL;
+    trackCount = 0;
+    albumId3.x = NULL;
+    replayGain = 0;
+    albumLoudness = NULL;
+    loudness.hist = NULL;
+    memset(&peaks,0,sizeof(peaks_state));
+    trackPeaks = NULL;
+    trackHist = NULL;
+    memset(&arena,0,sizeof(render_arena));
+    gbs2wav_config_init(&config);
+    model = config.model;
+    quality = config.quality;
 
     self = *argv++;
     argc--;
@@ -179,7 +468,312 @@ int main(int argc, const char *argv[]) {
             argv++;
             argc--;
         }
-        else if(str_istarts(*argv,"--model")) {
+        else if(str_istarts(*argv,"--low-memory")) {
+            lowMemory = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--album")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            if(s != NULL && str_iequals(s,"cue")) {
+                albumMode = ALBUM_CUE;
+            } else if(s != NULL && str_iequals(s,"tar")) {
+                albumMode = ALBUM_TAR;
+            } else {
+                fprintf(stderr,"unknown album mode %s\n",s == NULL ? "" : s);
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--replaygain")) {
+            replayGain = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--stems")) {
+            stems = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--fast-apu")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                apuFactor = (unsigned int)scan_uint(&c[1]);
+            } else {
+                apuFactor = DEFAULT_APU_FACTOR;
+            }
+            if(apuFactor == 0 || apuFactor > GBS2WAV_MAX_APU_FACTOR || (apuFactor & (apuFactor - 1))) {
+                fprintf(stderr,"fast APU factor must be a power of two between 1 and %u\n",GBS2WAV_MAX_APU_FACTOR);
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--quality")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            quality = s == NULL ? -1 : gbs2wav_quality_lookup(s);
+            if(quality == -1) {
+                fprintf(stderr,"unknown quality %s\n",s == NULL ? "" : s);
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--simd")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            simd = s == NULL ? -1 : gbs2wav_simd_lookup(s);
+            if(simd == -1) {
+                fprintf(stderr,"unknown instruction set %s\n",s == NULL ? "" : s);
+                return usage(self,1);
+            }
+            if(!gbs2wav_simd_supported((gbs2wav_simd)simd)) {
+                fprintf(stderr,"%s isn't supported on this CPU\n",s);
+                return usage(self,1);
+            }
+            config.simd = (gbs2wav_simd)simd;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--bench")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                benchRuns = (unsigned int)scan_uint(&c[1]);
+            } else {
+                benchRuns = DEFAULT_BENCH_RUNS;
+            }
+            if(benchRuns == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--split")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                splitSeconds = (unsigned int)scan_uint(&c[1]);
+            } else {
+                splitSeconds = DEFAULT_SPLIT_SECONDS;
+            }
+            if(splitSeconds == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--threads")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            threads = s == NULL ? 0 : (unsigned int)scan_uint(s);
+            if(threads == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--seek-index")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                indexSeconds = (unsigned int)scan_uint(&c[1]);
+            } else {
+                indexSeconds = DEFAULT_INDEX_SECONDS;
+            }
+            if(indexSeconds == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--peaks")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                peakFrames = (unsigned int)scan_uint(&c[1]);
+            } else {
+                peakFrames = DEFAULT_PEAK_FRAMES;
+            }
+            if(peakFrames == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--index-budget")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            indexBudget = s == NULL ? 0 : (unsigned int)scan_uint(s);
+            if(indexBudget == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--memory-budget")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            memoryBudget = s == NULL ? 0 : (unsigned int)scan_uint(s);
+            if(memoryBudget == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--journal")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                if(strlen(&c[1]) == 0 || strlen(&c[1]) >= sizeof(journalName)) {
+                    return usage(self,1);
+                }
+                memcpy(journalName,&c[1],strlen(&c[1]) + 1);
+            }
+            useJournal = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--dedupe")) {
+            dedupe = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--report")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                if(strlen(&c[1]) == 0 || strlen(&c[1]) >= sizeof(reportName)) {
+                    return usage(self,1);
+                }
+                memcpy(reportName,&c[1],strlen(&c[1]) + 1);
+            }
+            report = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--profile")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                if(strlen(&c[1]) == 0 || strlen(&c[1]) >= sizeof(profileName)) {
+                    return usage(self,1);
+                }
+                memcpy(profileName,&c[1],strlen(&c[1]) + 1);
+            }
+            profile = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--trace")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                if(strlen(&c[1]) == 0 || strlen(&c[1]) >= sizeof(traceName)) {
+                    return usage(self,1);
+                }
+                memcpy(traceName,&c[1],strlen(&c[1]) + 1);
+            }
+            trace = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--track-timeout")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            limits.seconds = s == NULL ? 0 : (unsigned int)scan_uint(s);
+            if(limits.seconds == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--max-cycles")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            limits.cycles = s == NULL ? 0 : scan_uint(s);
+            if(limits.cycles == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--max-output")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            limits.bytes = s == NULL ? 0 : scan_uint(s) * 1024 * 1024;
+            if(limits.bytes == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--daemon")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            if(s == NULL || *s == '\0') {
+                return usage(self,1);
+            }
+            daemon.socketPath = s;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--cache")) {
             c = strchr(*argv,'=');
             if(c != NULL) {
                 s = &c[1];
@@ -188,419 +782,1821 @@ int main(int argc, const char *argv[]) {
                 argc--;
                 s = *argv;
             }
-            if(str_iequals(s,"dmg-b")) {
-                gb_model = GB_MODEL_DMG_B;
-            } else if(str_iequals(s,"sgb")) {
-                gb_model = GB_MODEL_SGB;
-            } else if(str_iequals(s,"sgb-no-sfc")) {
-                gb_model = GB_MODEL_SGB_NO_SFC;
-            } else if(str_iequals(s,"sgb-ntsc")) {
-                gb_model = GB_MODEL_SGB_NTSC;
-            } else if(str_iequals(s,"sgb-ntsc-no-sfc")) {
-                gb_model = GB_MODEL_SGB_NTSC_NO_SFC;
-            } else if(str_iequals(s,"sgb-pal")) {
-                gb_model = GB_MODEL_SGB_PAL;
-            } else if(str_iequals(s,"sgb-pal-no-sfc")) {
-                gb_model = GB_MODEL_SGB_PAL_NO_SFC;
-            } else if(str_iequals(s,"mgb")) {
-                gb_model = GB_MODEL_MGB;
-            } else if(str_iequals(s,"sgb2")) {
-                gb_model = GB_MODEL_SGB2;
-            } else if(str_iequals(s,"sgb2-no-sfc")) {
-                gb_model = GB_MODEL_SGB2_NO_SFC;
-            } else if(str_iequals(s,"cgb-0")) {
-                gb_model = GB_MODEL_CGB_0;
-            } else if(str_iequals(s,"cgb-a")) {
-                gb_model = GB_MODEL_CGB_A;
-            } else if(str_iequals(s,"cgb-b")) {
-                gb_model = GB_MODEL_CGB_B;
-            } else if(str_iequals(s,"cgb-c")) {
-                gb_model = GB_MODEL_CGB_C;
-            } else if(str_iequals(s,"cgb-d")) {
-                gb_model = GB_MODEL_CGB_D;
-            } else if(str_iequals(s,"cgb-e")) {
-                gb_model = GB_MODEL_CGB_E;
-            } else if(str_iequals(s,"agb-a")) {
-                gb_model = GB_MODEL_AGB_A;
-            } else if(str_iequals(s,"gbp-a")) {
-                gb_model = GB_MODEL_GBP_A;
-            } else if(str_iequals(s,"dmg")) {
-                gb_model = GB_MODEL_DMG_B;
-            } else if(str_iequals(s,"cgb")) {
-                gb_model = GB_MODEL_CGB_E;
-            } else if(str_iequals(s,"agb")) {
-                gb_model = GB_MODEL_AGB;
-            } else if(str_iequals(s,"gbp")) {
-                gb_model = GB_MODEL_GBP;
+            daemon.cacheSize = s == NULL ? 0 : (unsigned int)scan_uint(s);
+            if(daemon.cacheSize == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--warm")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
             } else {
-                fprintf(stderr,"unknown model string %s\n",s);
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            if(s == NULL) {
                 return usage(self,1);
             }
-            argv++;
-            argc--;
+            daemon.warmSize = (unsigned int)scan_uint(s);
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--baseline")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            if(s == NULL || *s == '\0') {
+                return usage(self,1);
+            }
+            baselineName = s;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--catalog")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            if(s == NULL || *s == '\0') {
+                return usage(self,1);
+            }
+            catalogName = s;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--query")) {
+            c = strchr(*argv,'=');
+            query = c != NULL ? &c[1] : "";
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--speed")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            speed = s == NULL ? 0 : (unsigned int)scan_uint(s);
+            if(speed == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--start")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            if(s == NULL || *s < '0' || *s > '9') {
+                return usage(self,1);
+            }
+            startSeconds = (unsigned int)scan_uint(s);
+            startSet = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--resume")) {
+            useJournal = 1;
+            resume = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--apu-log")) {
+            apuLog = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--verify")) {
+            verify = 1;
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--model")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            model = s == NULL ? -1 : gbs2wav_model_lookup(s);
+            if(model == -1) {
+                fprintf(stderr,"unknown model string %s\n",s == NULL ? "" : s);
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        }
+        else if(str_istarts(*argv,"--sample-rate") || str_istarts(*argv,"--samplerate")) {
+            c = strchr(*argv,'=');
+            if(c != NULL) {
+                s = &c[1];
+            } else {
+                argv++;
+                argc--;
+                s = *argv;
+            }
+            sampleRate = scan_uint(s);
+            if(sampleRate == 0) {
+                return usage(self,1);
+            }
+            argv++;
+            argc--;
+        } else break;
+    }
+
+    budget_set_limit((uint64_t)memoryBudget * 1024 * 1024);
+
+    if(catalogName != NULL) {
+        return run_catalog(catalogName,argv,(unsigned int)argc,query,
+          threads ? threads : segments_cpu_count(),speed) == 0 ? 0 : 1;
+    }
+
+    if(argc < 1 && daemon.socketPath == NULL) {
+        return usage(self,1);
+    }
+
+    if(stems && albumMode != ALBUM_NONE) {
+        fprintf(stderr,"--stems can't be combined with --album\n");
+        return usage(self,1);
+    }
+
+    /* the quality preset picks the fast APU factor unless it was given */
+    gbs2wav_config_set_quality(&config,(gbs2wav_quality)quality);
+    if(apuFactor == 0 && benchRuns == 0) {
+        apuFactor = config.apuFactor;
+    }
+
+    if(apuFactor != 0 && sampleRate % apuFactor != 0) {
+        fprintf(stderr,"sample rate %lu is not divisible by the fast APU factor %u\n",sampleRate,apuFactor);
+        return usage(self,1);
+    }
+
+    if(trace) {
+        trace_enable();
+        trace_thread_name("main");
+    }
+
+    if(daemon.socketPath != NULL) {
+        config.model = model;
+        config.sampleRate = (unsigned int)sampleRate;
+        config.channels = channels;
+        config.apuFactor = apuFactor;
+        daemon.config = config;
+        daemon.threads = threads ? threads : segments_cpu_count();
+        r = daemon_run(&daemon) == 0 ? 0 : 1;
+        if(trace) {
+            if(traceName[0] == '\0') {
+                memcpy(traceName,DEFAULT_TRACE_NAME,sizeof(DEFAULT_TRACE_NAME));
+            }
+            printf("Saving trace to: %s\n",traceName);
+            if(trace_write(traceName) != 0) r = 1;
+        }
+        return r;
+    }
+
+    abuffer.channels = channels;
+
+    if(lowMemory) {
+        if(arena_init(&arena,LOW_MEMORY_BLOCK_FRAMES,stems ? GBS2WAV_STEM_COUNT : 0,LOW_MEMORY_ID3_SIZE) != 0) goto done;
+    } else {
+        if(arena_init(&arena,BUFFER_SIZE,stems ? GBS2WAV_STEM_COUNT : 0,BUFFER_SIZE) != 0) goto done;
+    }
+    arena_attach(&arena,&abuffer);
+    abuffer.loudness = NULL;
+    for(t = 0; t < GBS2WAV_STEM_COUNT; t++) {
+        stemSamples[t] = abuffer.stems != NULL ? abuffer.stems[t].samples : NULL;
+    }
+
+    if(replayGain) {
+        if(loudness_init(&loudness,channels,sampleRate) != 0) goto done;
+        albumLoudness = (loudness_histogram *)malloc(sizeof(loudness_histogram));
+        if(albumLoudness == NULL) goto done;
+        memset(albumLoudness,0,sizeof(loudness_histogram));
+        abuffer.loudness = &loudness;
+    }
+
+    abuffer.peaks = NULL;
+    if(peakFrames) {
+        peaks_init(&peaks,channels,peakFrames);
+        abuffer.peaks = &peaks;
+    }
+
+    gbsData = slurp(argv[0], &gbsSize);
+    if(gbsData == NULL) goto done;
+
+    memcpy(baseName,argv[0],strlen(argv[0]));
+    baseName[strlen(argv[0])] = '\0';
+
+    c = &baseName[strlen(baseName)-1];
+    while(c >= &baseName[0] && *c != '/') {
+        *c = '\0';
+        c--;
+    }
+    if(trace && traceName[0] == '\0') {
+        snprintf(traceName,sizeof(traceName),"%s%s",baseName,DEFAULT_TRACE_NAME);
+    }
+
+    if(argc > 1) {
+        m3uData = slurp(argv[1], &m3uSize);
+        if(m3uData == NULL) goto done;
+    }
+
+    config.model = model;
+    config.sampleRate = (unsigned int)sampleRate;
+    config.channels = channels;
+    config.apuFactor = apuFactor;
+    config.stems = stems;
+
+    if(verify && splitSeconds == 0) {
+        splitSeconds = DEFAULT_SPLIT_SECONDS;
+    }
+    /* segments render on the workers' own emulators, which aren't
+     * profiled */
+    if(profile && splitSeconds) {
+        printf("--split is off with --profile\n");
+        splitSeconds = 0;
+        verify = 0;
+    }
+    if(threads == 0) {
+        threads = segments_cpu_count();
+    }
+    split.gbs = gbsData;
+    split.gbsSize = gbsSize;
+    split.m3u = m3uData;
+    split.m3uSize = m3uSize;
+    split.segmentFrames = (uint64_t)splitSeconds * sampleRate;
+    split.threads = threads;
+    split.verify = verify;
+
+    if(benchRuns) {
+        if(run_bench(gbsData,gbsSize,m3uData,m3uSize,&config,apuFactor,benchRuns,baselineName,&arena) == 0) r = 0;
+        goto done;
+    }
+
+    /* loads the GBS and parses the M3U */
+    traceStart = trace_begin();
+    renderer = gbs2wav_open(gbsData,gbsSize,(const char *)m3uData,m3uSize,&config);
+    trace_end(traceStart,"open",-1);
+    if(renderer == NULL) {
+        fprintf(stderr,"Error loading %s\n",argv[0]);
+        goto done;
+    }
+    budget_charge(gbs2wav_resident_size(renderer));
+    if(apuLog) {
+        gbs2wav_log_enable(renderer,1);
+    }
+    /* before the track list is read, so the WAV sizes are trimmed */
+    if(startSet) {
+        for(i = 0; i < gbs2wav_track_count(renderer); i++) {
+            gbs2wav_set_track_start(renderer,i,(uint64_t)startSeconds * sampleRate);
+        }
+    }
+    if(indexSeconds) {
+        gbs2wav_index_enable(renderer,(uint64_t)indexSeconds * sampleRate,(size_t)indexBudget * 1024);
+    }
+    if(profile) {
+        gbs2wav_profile_enable(renderer,PROFILE_INTERVAL);
+    }
+
+    /* everything that changes the output, so a record only matches
+     * a render made the same way. --split and --threads aren't in it,
+     * segments render the same samples */
+    snprintf(params,sizeof(params),"model=%x,rate=%lu,channels=%u,apu=%u,quality=%s,stems=%u,replaygain=%u,album=%u,seek=%u/%u,apulog=%u,peaks=%u,start=%d",
+      (unsigned int)gbs2wav_get_config(renderer)->model,sampleRate,channels,
+      gbs2wav_get_config(renderer)->apuFactor,gbs2wav_quality_name(quality),
+      stems,replayGain,albumMode,indexSeconds,indexSeconds ? indexBudget : 0,apuLog,peakFrames,
+      startSet ? (int)startSeconds : -1);
+    inputHash = journal_hash(journal_hash(JOURNAL_HASH_INIT,gbsData,gbsSize),m3uData,m3uSize);
+
+    if(report && reportName[0] == '\0') {
+        snprintf(reportName,sizeof(reportName),"%s%s",baseName,DEFAULT_REPORT_NAME);
+    }
+    if(profile && profileName[0] == '\0') {
+        snprintf(profileName,sizeof(profileName),"%s%s",baseName,DEFAULT_PROFILE_NAME);
+    }
+    /* a duplicate's stems, seek index and APU log would still need the
+     * whole track emulated */
+    if(dedupe && (stems || indexSeconds || apuLog)) {
+        printf("--dedupe is off with --stems, --seek-index and --apu-log\n");
+        dedupe = 0;
+    }
+
+    if(useJournal) {
+        if(journalName[0] == '\0') {
+            snprintf(journalName,sizeof(journalName),"%s%s",baseName,DEFAULT_JOURNAL_NAME);
+        }
+        if(journal_open(&jrnl,journalName,resume) != 0) goto done;
+    }
+
+    tags.title = gbs2wav_get_tag(renderer,GBS2WAV_TAG_TITLE);
+    tags.artist = gbs2wav_get_tag(renderer,GBS2WAV_TAG_ARTIST);
+    tags.composer = gbs2wav_get_tag(renderer,GBS2WAV_TAG_COMPOSER);
+    tags.date = gbs2wav_get_tag(renderer,GBS2WAV_TAG_DATE);
+    tags.ripper = gbs2wav_get_tag(renderer,GBS2WAV_TAG_RIPPER);
+    tags.tagger = gbs2wav_get_tag(renderer,GBS2WAV_TAG_TAGGER);
+
+    dump_gbs_info(renderer);
+    if(m3uData != NULL) {
+        printf("Parsed M3U tags:\n");
+        if(tags.title != NULL && tags.title != gbs2wav_get_tag(renderer,GBS2WAV_TAG_GBS_TITLE)) {
+            printf("Title: %s\n",tags.title);
+        }
+        if(tags.artist != NULL && tags.artist != gbs2wav_get_tag(renderer,GBS2WAV_TAG_GBS_AUTHOR)) {
+            printf("Artist: %s\n",tags.artist);
+        }
+        if(tags.composer != NULL) {
+            printf("Composer: %s\n",tags.composer);
+        }
+        if(tags.date != NULL) {
+            printf("Date: %s\n",tags.date);
+        }
+        if(tags.ripper != NULL) {
+            printf("Ripper: %s\n",tags.ripper);
+        }
+        if(tags.tagger != NULL) {
+            printf("tagger: %s\n",tags.tagger);
+        }
+        printf("\n");
+    }
+
+    printf("Emulating %s\n",gbs2wav_model_name(model));
+    printf("Instance memory: %lu bytes (renderer %lu, arena %lu)\n",
+      (unsigned long)(gbs2wav_resident_size(renderer) + arena_size(&arena)),
+      (unsigned long)gbs2wav_resident_size(renderer),
+      (unsigned long)arena_size(&arena));
+
+    printf("Rendering as 16-bit, %u-channel, %luHz WAVE, %s quality\n",
+      channels, sampleRate, gbs2wav_quality_name(quality));
+    if(apuFactor > 1) {
+        printf("Fast APU: synthesizing at %luHz, interpolating %u frames per APU sample\n",
+          sampleRate / apuFactor, apuFactor);
+    }
+    if(splitSeconds) {
+        printf("Splitting tracks into %us segments on %u thread(s)%s\n",
+          splitSeconds, threads, verify ? ", verifying against a serial render" : "");
+    }
+
+    trackCount = plan_tracks(&tracks,renderer);
+    if(trackCount == 0) goto done;
+
+    /* an album, or tracks sharing an album gain, resume as a whole */
+    if(resume && (albumMode != ALBUM_NONE || replayGain)) {
+        for(i = 0; i < (albumMode != ALBUM_NONE ? 1 : trackCount); i++) {
+            if(!journal_done(&jrnl,inputHash,albumMode != ALBUM_NONE ? 0 : tracks[i].number,params,baseName)) break;
+        }
+        if(i == (albumMode != ALBUM_NONE ? 1 : trackCount)) {
+            printf("All tracks already rendered, nothing to resume\n");
+            r = 0;
+            goto done;
+        }
+    }
+
+    if(albumMode != ALBUM_NONE) {
+        albumFrames = 0;
+        for(i = 0; i < trackCount; i++) {
+            tracks[i].offsetFrames = albumFrames;
+            albumFrames += tracks[i].totalFrames;
+        }
+
+        albumId3.x = (uint8_t *)malloc(sizeof(uint8_t) * arena.id3.a);
+        if(albumId3.x == NULL) goto done;
+        albumId3.a = arena.id3.a;
+        budget_charge(albumId3.a);
+        id3_build(&albumId3,&tags,NULL);
+        if(replayGain && albumMode == ALBUM_CUE) {
+            id3_add_gain_tags(&albumId3,&albumGainTags);
+        }
+
+        /* the RIFF sizes are 32 bits and the last track has to start
+         * where the CUE sheet can index it */
+        if(albumMode == ALBUM_CUE) {
+            if(wav_file_size(channels,albumFrames,&albumId3) - 8 > UINT32_MAX) {
+                fprintf(stderr,"Album is over 4GiB, too large for one WAV, try --album=tar\n");
+                goto done;
+            }
+            if(tracks[trackCount - 1].offsetFrames / sampleRate / 60 > CUE_MAX_MINUTES) {
+                fprintf(stderr,"Album runs past %u minutes, too long for a CUE sheet, try --album=tar\n",CUE_MAX_MINUTES);
+                goto done;
+            }
+        }
+
+        snprintf(albumName,sizeof(albumName),"%s%s.%s",baseName,
+          tags.title != NULL ? tags.title : "album",
+          albumMode == ALBUM_CUE ? "wav" : "tar");
+        sanitize_filename(&albumName[strlen(baseName)]);
+
+        printf("Saving album to: %s\n",albumName);
+        albumFile = output_open(&outputs,albumName);
+        if(albumFile == NULL) goto done;
+
+        if(albumMode == ALBUM_CUE && !write_wav_header(albumFile,channels,albumFrames,(uint32_t)sampleRate,&albumId3)) {
+            fprintf(stderr,"Error writing %s\n",albumName);
+            goto done;
+        }
+    }
+
+    signal(SIGINT,on_signal);
+    signal(SIGTERM,on_signal);
+
+    for(i = 0; i < trackCount; i++) {
+        if(resume && albumMode == ALBUM_NONE && !replayGain &&
+          journal_done(&jrnl,inputHash,tracks[i].number,params,baseName)) {
+            printf("Track %u already rendered, skipping\n",tracks[i].number);
+            tracks[i].status = TRACK_RESUMED;
+            continue;
+        }
+
+        id3_build(&arena.id3,&tags,tracks[i].name);
+        if(abuffer.stems != NULL) {
+            id3_build(&arena.stemId3,&tags,tracks[i].name);
+        }
+        if(replayGain) {
+            id3_add_gain_tags(&arena.id3,&gainTags);
+            loudness_reset(&loudness);
+        }
+        if(peakFrames && peaks_reset(&peaks,tracks[i].totalFrames) != 0) {
+            fprintf(stderr,"out of memory\n");
+            goto done;
+        }
+
+        status = TRACK_RENDERED;
+        abuffer.output = NULL;
+        for(t = 0; abuffer.stems != NULL && t < GBS2WAV_STEM_COUNT; t++) {
+            abuffer.stems[t].output = NULL;
+        }
+        firstOutput = outputs.count;
+        startClock = wall_clock();
+        if(limits.bytes && wav_file_size(channels,tracks[i].totalFrames,&arena.id3) +
+          (abuffer.stems != NULL ? GBS2WAV_STEM_COUNT * wav_file_size(channels,tracks[i].totalFrames,&arena.stemId3) : 0) > limits.bytes) {
+            status = TRACK_TOO_LARGE;
+            goto stopped;
+        }
+
+        snprintf(outName,sizeof(outName),"%s%03u %s.wav",
+          baseName,tracks[i].number,tracks[i].name);
+        sanitize_filename(&outName[strlen(baseName)]);
+
+        if(albumMode == ALBUM_NONE) {
+            printf("Saving track %u to: %s\n",tracks[i].number,outName);
+            abuffer.output = output_open(&outputs,outName);
+            if(abuffer.output == NULL) goto done;
+            outTemp = outputs.files[outputs.count - 1].temp;
+        } else {
+            printf("Adding track %u: %s\n",tracks[i].number,tracks[i].name);
+            abuffer.output = albumFile;
+        }
+
+        if(albumMode == ALBUM_TAR && !write_tar_header(abuffer.output,&outName[strlen(baseName)],
+          wav_file_size(channels,tracks[i].totalFrames,&arena.id3))) {
+            status = TRACK_WRITE_ERROR;
+            goto stopped;
+        }
+        if(albumMode != ALBUM_CUE &&
+          !write_wav_header(abuffer.output,channels,tracks[i].totalFrames,(uint32_t)sampleRate,&arena.id3)) {
+            status = TRACK_WRITE_ERROR;
+            goto stopped;
+        }
+
+        if(abuffer.stems != NULL) {
+            for(t = 0; t < GBS2WAV_STEM_COUNT; t++) {
+                snprintf(stemName,sizeof(stemName),"%s%03u %s (%s).wav",
+                  baseName,tracks[i].number,tracks[i].name,stem_names[t]);
+                sanitize_filename(&stemName[strlen(baseName)]);
+                printf("Saving %s stem to: %s\n",stem_names[t],stemName);
+                abuffer.stems[t].output = output_open(&outputs,stemName);
+                if(abuffer.stems[t].output == NULL) goto done;
+                if(!write_wav_header(abuffer.stems[t].output,channels,tracks[i].totalFrames,(uint32_t)sampleRate,&arena.stemId3)) {
+                    status = TRACK_WRITE_ERROR;
+                    goto stopped;
+                }
+            }
+        }
+
+        printf("%02.0f%%\n",0.0);
+        abuffer.silent = 1;
+        dupOf = -1;
+        tracks[i].dataPos = ftell(abuffer.output);
+
+        if(split.segmentFrames != 0 && tracks[i].totalFrames > split.segmentFrames) {
+            segmentsDiffered = render_split(renderer,i,&abuffer,&split,&limits,startClock,&status);
+            if(segmentsDiffered < 0) goto done;
+            differed += (unsigned int)segmentsDiffered;
+            /* the prepass stops at the last segment, the seek index and
+             * APU log need the whole track */
+            if(status == TRACK_RENDERED && (apuLog || indexSeconds)) {
+                gbs2wav_skip(renderer,gbs2wav_frames_left(renderer));
+            }
+        } else {
+            traceStart = trace_begin();
+            if(gbs2wav_start_track(renderer,i) != 0) {
+                fprintf(stderr,"Error starting track %u\n",tracks[i].number);
+                goto done;
+            }
+            trace_end(traceStart,"start track",(int)tracks[i].number);
+
+            framesDone = 0;
+            lastPct = 0;
+            while(gbs2wav_frames_left(renderer) > 0) {
+                status = check_limits(&limits,startClock,gbs2wav_track_cycles(renderer));
+                if(status != TRACK_RENDERED) break;
+                cycles = gbs2wav_track_cycles(renderer);
+                traceStart = trace_begin();
+                frames = gbs2wav_render_ex(renderer,abuffer.samples,
+                  abuffer.stems != NULL ? stemSamples : NULL,abuffer.blockFrames,SLICE_CYCLES);
+                trace_end(traceStart,"render",(int)tracks[i].number);
+                if(frames == 0) {
+                    /* the renderer gave up on the rest of the track */
+                    if(gbs2wav_track_cycles(renderer) == cycles) break;
+                    continue;
+                }
+                if(write_frames(&abuffer,frames) != 0) {
+                    status = TRACK_WRITE_ERROR;
+                    break;
+                }
+                if(dedupe) {
+                    dupOf = dedupe_check(tracks,i,renderer,abuffer.samples,frames,framesDone,channels,sampleRate);
+                }
+                framesDone += frames;
+                pct = (unsigned int)(framesDone * 100 / tracks[i].totalFrames);
+                if(pct != lastPct) {
+                    printf("\x1b[1F%02u%%\n",pct);
+                    lastPct = pct;
+                }
+                if(dupOf >= 0) break;
+            }
+
+            /* the rest of the track is the earlier one's PCM */
+            if(dupOf >= 0) {
+                printf("Track %u duplicates track %u, copying the rest\n",
+                  tracks[i].number,tracks[dupOf].number);
+                if(copy_track_data(abuffer.output,albumFile,&tracks[dupOf],framesDone * channels * 2,
+                  (tracks[i].totalFrames - framesDone) * channels * 2,arena.packed,
+                  (size_t)(arena.blockFrames * MAX_CHANNELS * 2)) != 0) goto done;
+                tracks[i].status = TRACK_DUPLICATE;
+                tracks[i].dupOf = tracks[dupOf].number;
+                abuffer.silent = tracks[dupOf].silent;
+            }
+        }
+
+        stopped:
+        if(status != TRACK_RENDERED) {
+            tracks[i].status = status;
+            tracks[i].seconds = wall_clock() - startClock;
+            failed++;
+            switch(status) {
+                case TRACK_TIMEOUT: fprintf(stderr,"Track %u ran past %us, dropped\n",tracks[i].number,limits.seconds); break;
+                case TRACK_CYCLES: fprintf(stderr,"Track %u ran past %lu cycles, dropped\n",tracks[i].number,(unsigned long)limits.cycles); break;
+                case TRACK_TOO_LARGE: fprintf(stderr,"Track %u would be over %luMiB, skipped\n",tracks[i].number,(unsigned long)(limits.bytes / (1024 * 1024))); break;
+                case TRACK_WRITE_ERROR: fprintf(stderr,"Error writing track %u, dropped\n",tracks[i].number); break;
+                default: fprintf(stderr,"Cancelled during track %u\n",tracks[i].number); break;
+            }
+            /* a later duplicate can't copy from it */
+            if(tracks[i].state != NULL) {
+                free(tracks[i].state);
+                tracks[i].state = NULL;
+            }
+            if(albumMode == ALBUM_NONE) {
+                if(abuffer.output != NULL) fclose(abuffer.output);
+                for(t = 0; abuffer.stems != NULL && t < GBS2WAV_STEM_COUNT; t++) {
+                    if(abuffer.stems[t].output != NULL) fclose(abuffer.stems[t].output);
+                }
+                output_discard(&outputs,firstOutput);
+            }
+            abuffer.output = NULL;
+            /* an album can't be finished without it */
+            if(status == TRACK_CANCELLED || albumMode != ALBUM_NONE) {
+                for(t = i + 1; t < trackCount; t++) {
+                    tracks[t].status = TRACK_SKIPPED;
+                }
+                break;
+            }
+            continue;
+        }
+
+        tracks[i].silent = abuffer.silent;
+        if(tracks[i].silent) {
+            printf("Track %u is silent\n",tracks[i].number);
+        }
+
+        if(peakFrames) {
+            peaks_finish(&peaks);
+            trackPeaks = dupOf >= 0 ? tracks[dupOf].peaks : &peaks;
+            /* a later duplicate takes its overview from here */
+            if(tracks[i].state != NULL) {
+                tracks[i].peaks = peaks_clone(trackPeaks);
+                if(tracks[i].peaks == NULL) goto done;
+            }
+        }
+
+        if(replayGain) {
+            trackHist = dupOf >= 0 ? tracks[dupOf].hist : loudness.hist;
+            tracks[i].gain = REPLAYGAIN_REFERENCE - loudness_integrated(trackHist);
+            tracks[i].peak = trackHist->samplePeak;
+            id3_fill_gain_tags(&arena.id3,&gainTags,trackHist,NULL);
+            /* a later duplicate takes its loudness from here */
+            if(tracks[i].state != NULL) {
+                tracks[i].hist = (loudness_histogram *)malloc(sizeof(loudness_histogram));
+                if(tracks[i].hist == NULL) goto done;
+                memcpy(tracks[i].hist,trackHist,sizeof(loudness_histogram));
+            }
+        }
+
+        if(albumMode != ALBUM_CUE) {
+            footerPos = ftell(abuffer.output) + 8;
+            if(!write_wav_footer(abuffer.output,&arena.id3)) {
+                status = TRACK_WRITE_ERROR;
+                goto stopped;
+            }
+            if(replayGain) {
+                tracks[i].albumGainPos = footerPos + gainTags.albumGain;
+                tracks[i].albumPeakPos = footerPos + gainTags.albumPeak;
+                if(albumMode == ALBUM_NONE) {
+                    /* still under its temporary name */
+                    tracks[i].path = malloc(strlen(outTemp) + 1);
+                    if(tracks[i].path == NULL) goto done;
+                    memcpy(tracks[i].path,outTemp,strlen(outTemp) + 1);
+                }
+            }
+        }
+        if(albumMode == ALBUM_TAR &&
+          !write_tar_padding(abuffer.output,wav_file_size(channels,tracks[i].totalFrames,&arena.id3))) {
+            status = TRACK_WRITE_ERROR;
+            goto stopped;
+        }
+        for(t = 0; abuffer.stems != NULL && t < GBS2WAV_STEM_COUNT; t++) {
+            if(!write_wav_footer(abuffer.stems[t].output,&arena.stemId3)) {
+                status = TRACK_WRITE_ERROR;
+                goto stopped;
+            }
+        }
+
+        /* whatever failed to reach the disk shows up here */
+        if(albumMode == ALBUM_NONE) {
+            if(output_close(abuffer.output) != 0) status = TRACK_WRITE_ERROR;
+            abuffer.output = NULL;
+        }
+        for(t = 0; abuffer.stems != NULL && t < GBS2WAV_STEM_COUNT; t++) {
+            if(output_close(abuffer.stems[t].output) != 0) status = TRACK_WRITE_ERROR;
+            abuffer.stems[t].output = NULL;
+        }
+        if(status != TRACK_RENDERED) goto stopped;
+        if(replayGain) {
+            loudness_merge(albumLoudness,trackHist);
+        }
+        printf("\x1b[1F%02.0f%%\n",100.0);
+
+        if(indexSeconds) {
+            snprintf(indexName,sizeof(indexName),"%s%03u %s.seek",
+              baseName,tracks[i].number,tracks[i].name);
+            sanitize_filename(&indexName[strlen(baseName)]);
+            temp = output_add(&outputs,indexName);
+            if(temp == NULL || gbs2wav_index_save(renderer,temp) != 0) {
+                fprintf(stderr,"Error writing seek index %s\n",indexName);
+                goto done;
+            }
+            printf("Seek index: %u snapshots, %lu bytes\n",
+              gbs2wav_index_count(renderer),(unsigned long)gbs2wav_index_bytes(renderer));
+        }
+
+        /* a log always replays from the top of the song */
+        if(apuLog && gbs2wav_track_start(renderer,i) != 0) {
+            printf("No APU log for a track with a start offset\n");
+        } else if(apuLog) {
+            snprintf(logName,sizeof(logName),"%s%03u %s.apulog",
+              baseName,tracks[i].number,tracks[i].name);
+            sanitize_filename(&logName[strlen(baseName)]);
+            temp = output_add(&outputs,logName);
+            if(temp == NULL || gbs2wav_log_save(renderer,temp) != 0) {
+                fprintf(stderr,"Error writing APU log %s\n",logName);
+                goto done;
+            }
+            printf("APU log: %lu bytes\n",(unsigned long)gbs2wav_log_bytes(renderer));
+        }
+
+        if(peakFrames) {
+            snprintf(peaksName,sizeof(peaksName),"%s%03u %s.peaks",
+              baseName,tracks[i].number,tracks[i].name);
+            sanitize_filename(&peaksName[strlen(baseName)]);
+            temp = output_add(&outputs,peaksName);
+            if(temp == NULL || peaks_save(trackPeaks,temp,(uint32_t)sampleRate) != 0) {
+                fprintf(stderr,"Error writing waveform peaks %s\n",peaksName);
+                goto done;
+            }
+        }
+
+        elapsed = wall_clock() - startClock;
+        tracks[i].seconds = elapsed;
+        if(elapsed > 0.0) {
+            printf("Rendered in %.2fs (%.1fx realtime)\n", elapsed,
+              ((double)tracks[i].totalFrames / (double)sampleRate) / elapsed);
+        }
+
+        if(albumMode == ALBUM_NONE && !replayGain) {
+            if(journal_commit(useJournal ? &jrnl : NULL,&outputs,inputHash,tracks[i].number,params,outName,baseName) != 0) goto done;
+        }
+
+        /* where a later duplicate copies from */
+        if(tracks[i].state != NULL && albumMode == ALBUM_NONE) {
+            tracks[i].dataPath = malloc(strlen(replayGain ? outTemp : outName) + 1);
+            if(tracks[i].dataPath == NULL) goto done;
+            memcpy(tracks[i].dataPath,replayGain ? outTemp : outName,strlen(replayGain ? outTemp : outName) + 1);
+        }
+    }
+
+    if(i < trackCount) {
+        if(profile) {
+            write_profile(profileName,renderer);
+        }
+        if(report) {
+            printf("Saving run report to: %s\n",reportName);
+            write_report(reportName,tracks,trackCount);
+        }
+        goto done;
+    }
+
+    if(replayGain) {
+        printf("Album loudness: %.2f LUFS, true peak %.2f dBTP\n",
+          loudness_integrated(albumLoudness),
+          20.0 * log10(albumLoudness->truePeak));
+    }
+
+    if(albumMode == ALBUM_CUE) {
+        if(replayGain) {
+            id3_fill_gain_tags(&albumId3,&albumGainTags,albumLoudness,albumLoudness);
+        }
+        if(!write_wav_footer(albumFile,&albumId3)) {
+            fprintf(stderr,"Error writing %s\n",albumName);
+            goto done;
+        }
+        memcpy(outName,albumName,strlen(albumName) - 3);
+        memcpy(&outName[strlen(albumName) - 3],"cue",4);
+        printf("Saving cue sheet to: %s\n",outName);
+        temp = output_add(&outputs,outName);
+        if(temp == NULL) goto done;
+        if(write_cue_sheet(temp,&albumName[strlen(baseName)],&tags,tracks,trackCount,sampleRate,
+          replayGain ? albumLoudness : NULL) != 0) goto done;
+    } else if(replayGain) {
+        /* album gain needs every track, patch it into the footers
+         * that were written with placeholders */
+        for(i = 0; i < trackCount; i++) {
+            if(track_failed(&tracks[i])) continue;
+            if(patch_album_gain(tracks[i].path,albumFile,&tracks[i],albumLoudness) != 0) goto done;
+        }
+    }
+
+    /* tracks sharing an album gain are only done once it's patched in */
+    if(albumMode == ALBUM_NONE && replayGain) {
+        if(useJournal) {
+            for(i = 0; i < trackCount; i++) {
+                if(track_failed(&tracks[i])) continue;
+                if(journal_hash_file(tracks[i].path,&tracks[i].hash) != 0) goto done;
+                if(journal_stat_file(tracks[i].path,&tracks[i].size,&tracks[i].mtime) != 0) goto done;
+            }
+        }
+        if(output_commit(&outputs) != 0) goto done;
+        for(i = 0; i < trackCount && useJournal; i++) {
+            if(track_failed(&tracks[i])) continue;
+            snprintf(outName,sizeof(outName),"%03u %s.wav",tracks[i].number,tracks[i].name);
+            sanitize_filename(outName);
+            if(journal_append(&jrnl,inputHash,tracks[i].number,params,tracks[i].hash,tracks[i].size,tracks[i].mtime,outName) != 0) goto done;
+        }
+    }
+
+    if(albumMode == ALBUM_TAR) {
+        /* end-of-archive marker */
+        fseek(albumFile,0,SEEK_END);
+        memset(arena.packed,0,TAR_BLOCK_SIZE * 2);
+        fwrite(arena.packed,1,TAR_BLOCK_SIZE * 2,albumFile);
+    }
+
+    if(albumMode != ALBUM_NONE) {
+        if(output_close(albumFile) != 0) {
+            fprintf(stderr,"Error writing %s\n",albumName);
+            albumFile = NULL;
+            goto done;
+        }
+        albumFile = NULL;
+        if(journal_commit(useJournal ? &jrnl : NULL,&outputs,inputHash,0,params,albumName,baseName) != 0) goto done;
+    }
+
+    if(profile) {
+        if(write_profile(profileName,renderer) != 0) goto done;
+    }
+    if(report) {
+        printf("Saving run report to: %s\n",reportName);
+        if(write_report(reportName,tracks,trackCount) != 0) goto done;
+    }
+
+    if(failed) {
+        fprintf(stderr,"%u track(s) stopped early\n",failed);
+        goto done;
+    }
+    if(differed) {
+        fprintf(stderr,"%u segment(s) differed from the serial render\n",differed);
+        goto done;
+    }
+    r = 0;
+
+    done:
+    if(albumFile != NULL) fclose(albumFile);
+    /* anything not committed was left unfinished */
+    output_free(&outputs);
+    journal_close(&jrnl);
+    if(albumId3.x != NULL) {
+        free(albumId3.x);
+        budget_refund(albumId3.a);
+    }
+    if(albumLoudness != NULL) free(albumLoudness);
+    loudness_free(&loudness);
+    peaks_free(&peaks);
+    free_tracks(tracks,trackCount);
+
+    if(renderer != NULL) budget_refund(gbs2wav_resident_size(renderer));
+    gbs2wav_close(renderer);
+    arena_free(&arena);
+    if(gbsData != NULL) free(gbsData);
+    if(m3uData != NULL) free(m3uData);
+
+    if(trace && traceName[0] != '\0') {
+        printf("Saving trace to: %s\n",traceName);
+        if(trace_write(traceName) != 0) r = 1;
+    }
+    return r;
+}
+
+/* copies the renderer's planned track list, returns the number of tracks */
+static unsigned int plan_tracks(track_entry **tracks, const gbs2wav_t *h) {
+    unsigned int i;
+    unsigned int count = gbs2wav_track_count(h);
+    track_entry *list;
+
+    *tracks = NULL;
+    if(count == 0) return 0;
+
+    list = (track_entry *)malloc(sizeof(track_entry) * count);
+    if(list == NULL) {
+        fprintf(stderr,"out of memory\n");
+        return 0;
+    }
+
+    for(i = 0; i < count; i++) {
+        list[i].number = gbs2wav_track_number(h,i);
+        list[i].totalFrames = gbs2wav_track_frames(h,i);
+        list[i].fadeFrames = gbs2wav_track_fade(h,i);
+        list[i].name = gbs2wav_track_name(h,i);
+        list[i].offsetFrames = 0;
+        list[i].gain = 0.0;
+        list[i].peak = 0.0;
+        list[i].path = NULL;
+        list[i].albumGainPos = 0;
+        list[i].albumPeakPos = 0;
+        list[i].hash = 0;
+        list[i].size = 0;
+        list[i].mtime = 0;
+        list[i].runHash = FNV_OFFSET;
+        list[i].checks = 0;
+        list[i].state = NULL;
+        list[i].stateFrames = 0;
+        list[i].dataPath = NULL;
+        list[i].dataPos = 0;
+        list[i].hist = NULL;
+        list[i].peaks = NULL;
+        list[i].status = TRACK_RENDERED;
+        list[i].dupOf = 0;
+        list[i].silent = 0;
+        list[i].seconds = 0.0;
+    }
+
+    *tracks = list;
+    return count;
+}
+
+static void free_tracks(track_entry *tracks, unsigned int count) {
+    unsigned int i;
+    if(tracks == NULL) return;
+    for(i = 0; i < count; i++) {
+        if(tracks[i].path != NULL) free(tracks[i].path);
+        if(tracks[i].state != NULL) free(tracks[i].state);
+        if(tracks[i].dataPath != NULL) free(tracks[i].dataPath);
+        if(tracks[i].hist != NULL) free(tracks[i].hist);
+        if(tracks[i].peaks != NULL) {
+            peaks_free(tracks[i].peaks);
+            free(tracks[i].peaks);
+        }
+    }
+    free(tracks);
+}
+
+/* find any non-file safe characters in a name and replace them */
+static void sanitize_filename(char *name) {
+    while(*name) {
+        switch(*name) {
+            case '/':
+            case '\\':
+            case ':':
+            case '*':
+            case '"':
+            case '?':
+            case '<':
+            case '>':
+            case '|': *name = '_'; break;
+            default: break;
+        }
+        name++;
+    }
+}
+
+/* album-level tags, plus TIT2 when trackName isn't NULL */
+static void id3_build(str_buffer *id3, const album_tags *tags, const char *trackName) {
+    id3_init(id3);
+    if(tags->title != NULL) {
+        id3_add_text(id3,"TALB",tags->title,strlen(tags->title));
+    }
+    if(tags->artist != NULL) {
+        id3_add_text(id3,"TPE1",tags->artist,strlen(tags->artist));
+    }
+    if(tags->composer != NULL) {
+        id3_add_text(id3,"TCOM",tags->composer,strlen(tags->composer));
+    }
+    if(tags->date != NULL) {
+        id3_add_text(id3,"TDRL",tags->date,strlen(tags->date));
+    }
+    if(trackName != NULL && strlen(trackName) > 0) {
+        id3_add_text(id3,"TIT2",trackName,strlen(trackName));
+    }
+    if(tags->ripper != NULL) {
+        id3_add_private(id3,"gbs_ripper",tags->ripper,strlen(tags->ripper));
+    }
+    if(tags->tagger != NULL) {
+        id3_add_private(id3,"gbs_tagger",tags->tagger,strlen(tags->tagger));
+    }
+}
+
+static uint32_t id3_add_placeholder(str_buffer *id3, const char *description, const char *placeholder) {
+    if(id3_add_private(id3,description,placeholder,strlen(placeholder)) != 0) return 0;
+    return id3->len - (uint32_t)strlen(placeholder);
+}
+
+/* ReplayGain 2.0 and EBU R128 TXXX frames, values filled in later */
+static void id3_add_gain_tags(str_buffer *id3, gain_tags *g) {
+    g->trackGain = id3_add_placeholder(id3,"REPLAYGAIN_TRACK_GAIN","+00.00 dB");
+    g->trackPeak = id3_add_placeholder(id3,"REPLAYGAIN_TRACK_PEAK","0.000000");
+    g->albumGain = id3_add_placeholder(id3,"REPLAYGAIN_ALBUM_GAIN","+00.00 dB");
+    g->albumPeak = id3_add_placeholder(id3,"REPLAYGAIN_ALBUM_PEAK","0.000000");
+    g->loudness = id3_add_placeholder(id3,"EBU_R128_INTEGRATED_LOUDNESS","+00.00 LUFS");
+    g->truePeak = id3_add_placeholder(id3,"EBU_R128_TRUE_PEAK","+00.00 dBTP");
+}
+
+static void id3_patch(str_buffer *id3, uint32_t offset, const char *val) {
+    if(offset == 0) return;
+    memcpy(&id3->x[offset],val,strlen(val));
+}
+
+/* album may be NULL, its placeholders are then left for patch_album_gain */
+static void id3_fill_gain_tags(str_buffer *id3, const gain_tags *g, const loudness_histogram *track, const loudness_histogram *album) {
+    char tmp[16];
+    double lufs = loudness_integrated(track);
+
+    format_gain(tmp,sizeof(tmp),REPLAYGAIN_REFERENCE - lufs,"dB");
+    id3_patch(id3,g->trackGain,tmp);
+    format_peak(tmp,sizeof(tmp),track->samplePeak);
+    id3_patch(id3,g->trackPeak,tmp);
+    format_gain(tmp,sizeof(tmp),lufs,"LUFS");
+    id3_patch(id3,g->loudness,tmp);
+    format_gain(tmp,sizeof(tmp),20.0 * log10(track->truePeak),"dBTP");
+    id3_patch(id3,g->truePeak,tmp);
+
+    if(album != NULL) {
+        format_gain(tmp,sizeof(tmp),REPLAYGAIN_REFERENCE - loudness_integrated(album),"dB");
+        id3_patch(id3,g->albumGain,tmp);
+        format_peak(tmp,sizeof(tmp),album->samplePeak);
+        id3_patch(id3,g->albumPeak,tmp);
+    }
+}
+
+/* fixed width, so values always fit their placeholder: +00.00 unit */
+static void format_gain(char *buf, size_t len, double val, const char *unit) {
+    val = CLAMP(val,-99.99,99.99);
+    if(val != val) val = 0.0;
+    snprintf(buf,len,"%+06.2f %s",val,unit);
+}
+
+static void format_peak(char *buf, size_t len, double peak) {
+    snprintf(buf,len,"%.6f",CLAMP(peak,0.0,9.999999));
+}
+
+static int patch_album_gain(const char *filename, FILE *f, const track_entry *track, const loudness_histogram *album) {
+    char gain[16];
+    char peak[16];
+    FILE *out = f;
+    int r = -1;
+
+    format_gain(gain,sizeof(gain),REPLAYGAIN_REFERENCE - loudness_integrated(album),"dB");
+    format_peak(peak,sizeof(peak),album->samplePeak);
+
+    if(filename != NULL) {
+        out = fopen(filename,"r+b");
+        if(out == NULL) {
+            fprintf(stderr,"Error opening %s: %s\n",filename,strerror(errno));
+            return -1;
+        }
+    }
+
+    if(fseek(out,track->albumGainPos,SEEK_SET) != 0) goto done;
+    if(fwrite(gain,1,strlen(gain),out) != strlen(gain)) goto done;
+    if(fseek(out,track->albumPeakPos,SEEK_SET) != 0) goto done;
+    if(fwrite(peak,1,strlen(peak),out) != strlen(peak)) goto done;
+    r = 0;
+
+    done:
+    if(filename != NULL && fclose(out) != 0) r = -1;
+    if(r != 0) fprintf(stderr,"Error writing album gain to %s\n",filename != NULL ? filename : "the album");
+    return r;
+}
+
+static int arena_init(render_arena *a, uint64_t blockFrames, unsigned int stemCount, uint32_t id3Size) {
+    unsigned int i;
+
+    memset(a,0,sizeof(render_arena));
+    a->blockFrames = blockFrames;
+    a->stemCount = stemCount;
+
+    a->samples = (int16_t *)malloc(sizeof(int16_t) * MAX_CHANNELS * blockFrames * (1 + stemCount));
+    a->packed = (uint8_t *)malloc(sizeof(uint8_t) * MAX_CHANNELS * blockFrames * 2);
+    a->id3.x = (uint8_t *)malloc(sizeof(uint8_t) * id3Size);
+    if(a->samples == NULL || a->packed == NULL || a->id3.x == NULL) goto fail;
+    a->id3.a = id3Size;
+    a->id3.len = 0;
+    if(stemCount) {
+        a->stemId3.x = (uint8_t *)malloc(sizeof(uint8_t) * id3Size);
+        if(a->stemId3.x == NULL) goto fail;
+        a->stemId3.a = id3Size;
+        a->stemId3.len = 0;
+    }
+    /* the ID3 buffers' growth is charged as it happens */
+    budget_charge(arena_size(a));
+
+    if(stemCount) {
+        a->stems = (stem_buffer *)malloc(sizeof(stem_buffer) * stemCount);
+        if(a->stems == NULL) goto fail;
+        for(i = 0; i < stemCount; i++) {
+            a->stems[i].output = NULL;
+            a->stems[i].samples = &a->samples[MAX_CHANNELS * blockFrames * (1 + i)];
+        }
+    }
+    return 0;
+
+    fail:
+    fprintf(stderr,"out of memory\n");
+    arena_free(a);
+    return -1;
+}
+
+static void arena_free(render_arena *a) {
+    if(a->id3.a) budget_refund(arena_size(a));
+    if(a->samples != NULL) free(a->samples);
+    if(a->packed != NULL) free(a->packed);
+    if(a->stems != NULL) free(a->stems);
+    if(a->id3.x != NULL) free(a->id3.x);
+    if(a->stemId3.x != NULL) free(a->stemId3.x);
+    memset(a,0,sizeof(render_arena));
+}
+
+static size_t arena_size(const render_arena *a) {
+    return sizeof(render_arena)
+      + sizeof(int16_t) * MAX_CHANNELS * a->blockFrames * (1 + a->stemCount)
+      + sizeof(uint8_t) * MAX_CHANNELS * a->blockFrames * 2
+      + sizeof(stem_buffer) * a->stemCount
+      + a->id3.a
+      + a->stemId3.a;
+}
+
+static void arena_attach(render_arena *a, audio_buffer *abuffer) {
+    abuffer->blockFrames = a->blockFrames;
+    abuffer->samples = a->samples;
+    abuffer->packed = a->packed;
+    abuffer->stems = a->stems;
+}
+
+/* renders track index from segments on worker threads and writes them
+ * in order. With verify the track is also rendered serially on h,
+ * segments are compared against it and the serial output is what gets
+ * written. Returns how many segments differed, or -1. The limits are
+ * checked between segments, status says why it stopped early */
+static int render_split(gbs2wav_t *h, unsigned int index, audio_buffer *abuffer, const split_options *o, const track_limits *l, double startClock, unsigned int *status) {
+    segment_job job;
+    const segment *seg;
+    unsigned int k;
+    unsigned int t;
+    unsigned int mismatched = 0;
+    unsigned int channels = abuffer->channels;
+    uint64_t pos;
+    uint64_t n;
+    uint64_t segFrames;
+    uint64_t framesDone = 0;
+    uint64_t prepassCycles;
+    limit_check check;
+    uint64_t total = gbs2wav_track_frames(h,index);
+    int16_t *samples = abuffer->samples;
+    int16_t *stemSamples[GBS2WAV_STEM_COUNT];
+    uint64_t traceStart;
+    int r = -1;
+
+    for(t = 0; t < GBS2WAV_STEM_COUNT; t++) {
+        stemSamples[t] = abuffer->stems != NULL ? abuffer->stems[t].samples : NULL;
+    }
+
+    check.limits = l;
+    check.startClock = startClock;
+    check.status = TRACK_RENDERED;
+    traceStart = trace_begin();
+    r = segments_start(&job,h,index,o->gbs,o->gbsSize,(const char *)o->m3u,o->m3uSize,o->segmentFrames,o->threads,prepass_stop,&check);
+    trace_end(traceStart,"prepass",(int)gbs2wav_track_number(h,index));
+    if(r == 1) {
+        *status = check.status;
+        return 0;
+    }
+    if(r != 0) {
+        fprintf(stderr,"Error starting segment workers\n");
+        return -1;
+    }
+    r = -1;
+    /* the prepass ran nearly the whole track, so its cycles stand in
+     * for the workers' */
+    prepassCycles = gbs2wav_track_cycles(h);
+    if(o->verify && gbs2wav_start_track(h,index) != 0) {
+        fprintf(stderr,"Error starting track %u\n",gbs2wav_track_number(h,index));
+        goto done;
+    }
+
+    for(k = 0; k < job.count; k++) {
+        *status = check_limits(l,startClock,prepassCycles);
+        if(*status != TRACK_RENDERED) {
+            r = (int)mismatched;
+            goto done;
+        }
+        seg = segments_wait(&job,k);
+        segFrames = job.segments[k].frames;
+        if(seg == NULL) {
+            if(!o->verify) {
+                fprintf(stderr,"Error rendering segment %u\n",k);
+                goto done;
+            }
+            mismatched++;
         }
-        else if(str_istarts(*argv,"--sample-rate") || str_istarts(*argv,"--samplerate")) {
-            c = strchr(*argv,'=');
-            if(c != NULL) {
-                s = &c[1];
+
+        pos = 0;
+        while(pos < segFrames) {
+            n = segFrames - pos;
+            if(n > abuffer->blockFrames) n = abuffer->blockFrames;
+
+            if(o->verify) {
+                if(gbs2wav_render_ex(h,samples,abuffer->stems != NULL ? stemSamples : NULL,n,0) != n) goto done;
+                if(seg != NULL && memcmp(samples,&seg->samples[pos * channels],sizeof(int16_t) * channels * n) != 0) {
+                    fprintf(stderr,"Segment %u differs from the serial render near frame %lu\n",
+                      k,(unsigned long)(seg->offset + pos));
+                    mismatched++;
+                    seg = NULL;
+                }
+                for(t = 0; seg != NULL && abuffer->stems != NULL && t < GBS2WAV_STEM_COUNT; t++) {
+                    if(memcmp(stemSamples[t],&seg->stems[t][pos * channels],sizeof(int16_t) * channels * n) != 0) {
+                        fprintf(stderr,"Segment %u %s stem differs from the serial render near frame %lu\n",
+                          k,stem_names[t],(unsigned long)(seg->offset + pos));
+                        mismatched++;
+                        seg = NULL;
+                    }
+                }
             } else {
-                argv++;
-                argc--;
-                s = *argv;
+                abuffer->samples = &seg->samples[pos * channels];
+                for(t = 0; abuffer->stems != NULL && t < GBS2WAV_STEM_COUNT; t++) {
+                    abuffer->stems[t].samples = &seg->stems[t][pos * channels];
+                }
             }
-            sampleRate = scan_uint(s);
-            if(sampleRate == 0) {
-                return usage(self,1);
+            if(write_frames(abuffer,n) != 0) {
+                *status = TRACK_WRITE_ERROR;
+                r = (int)mismatched;
+                goto done;
             }
-            argv++;
-            argc--;
-        } else break;
+            pos += n;
+        }
+
+        abuffer->samples = samples;
+        for(t = 0; abuffer->stems != NULL && t < GBS2WAV_STEM_COUNT; t++) {
+            abuffer->stems[t].samples = stemSamples[t];
+        }
+        segments_release(&job,k);
+
+        framesDone += segFrames;
+        printf("\x1b[1F%02u%%\n",(unsigned int)(framesDone * 100 / total));
     }
 
+    if(o->verify) {
+        if(mismatched) {
+            printf("Verify: %u of %u segments differed, wrote the serial render\n",mismatched,job.count);
+        } else {
+            printf("Verify: all %u segments match the serial render\n",job.count);
+        }
+    }
+    r = (int)mismatched;
 
-    if(argc < 1) {
-        return usage(self,1);
+    done:
+    abuffer->samples = samples;
+    for(t = 0; abuffer->stems != NULL && t < GBS2WAV_STEM_COUNT; t++) {
+        abuffer->stems[t].samples = stemSamples[t];
     }
+    segments_finish(&job);
+    return r;
+}
 
-    id3_buffer.x = (uint8_t *)malloc(sizeof(uint8_t) * BUFFER_SIZE);
-    if(id3_buffer.x == NULL) goto done;
-    id3_buffer.len = 0;
-    id3_buffer.a = BUFFER_SIZE;
+static double wall_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
 
-    gbsData = slurp(argv[0], &gbsSize);
-    if(gbsData == NULL) goto done;
+/* TRACK_RENDERED while the track may carry on, otherwise why not */
+static unsigned int check_limits(const track_limits *l, double startClock, uint64_t cycles) {
+    if(cancelled) return TRACK_CANCELLED;
+    if(l->seconds && wall_clock() - startClock > (double)l->seconds) return TRACK_TIMEOUT;
+    if(l->cycles && cycles > l->cycles) return TRACK_CYCLES;
+    return TRACK_RENDERED;
+}
 
-    GB_init(&gb, gb_model);
-    GB_set_sample_rate(&gb, sampleRate);
-    GB_set_user_data(&gb, &abuffer);
-    if(channels == 1) {
-        GB_apu_set_sample_callback(&gb, on_sample_mono);
-    } else {
-        GB_apu_set_sample_callback(&gb, on_sample_stereo);
+static int prepass_stop(void *userdata, const gbs2wav_t *h) {
+    limit_check *c = (limit_check *)userdata;
+    c->status = check_limits(c->limits,c->startClock,gbs2wav_track_cycles(h));
+    return c->status != TRACK_RENDERED;
+}
+
+/* a second signal gets the default handling */
+static void on_signal(int sig) {
+    cancelled = 1;
+    signal(sig,SIG_DFL);
+}
+
+/* renders every track runs times with each quality preset, writing
+ * nothing, and reports the throughput and whether each run hashed
+ * the same. apuFactor 0 uses each preset's own factor.
+ * With a baseline file from an earlier run (of another build, say a
+ * changed core) each preset is compared against it: the speedup, and
+ * whether the PCM hash is the same, which it has to be. A missing
+ * baseline file is written instead */
+static int run_bench(const uint8_t *gbsData, uint32_t gbsSize, const uint8_t *m3uData, uint32_t m3uSize, const gbs2wav_config *base, unsigned int apuFactor, unsigned int runs, const char *baselineName, render_arena *arena) {
+    gbs2wav_config config;
+    gbs2wav_t *h;
+    unsigned int q;
+    unsigned int run;
+    unsigned int i;
+    unsigned int stable;
+    unsigned int compare = 0;
+    unsigned int differs = 0;
+    uint64_t frames;
+    uint64_t total;
+    uint64_t hash;
+    uint64_t firstHash;
+    clock_t start;
+    double elapsed;
+    bench_result baseline[GBS2WAV_QUALITY_COUNT];
+    bench_result results[GBS2WAV_QUALITY_COUNT];
+    const bench_result *b;
+
+    memset(results,0,sizeof(results));
+    if(baselineName != NULL) {
+        compare = load_baseline(baselineName,baseline);
     }
-    GB_set_rendering_disabled(&gb, 1);
-    GB_set_turbo_mode(&gb, true, true);
 
-    GB_load_gbs_from_buffer(&gb, gbsData, gbsSize, &gbsInfo);
+    printf("Benchmark: %u run(s) of every track per quality preset, %s mixing\n",runs,
+      gbs2wav_simd_name(gbs2wav_simd_level(base)));
+    printf("%-10s %6s %14s %10s  %-16s  %-*s%s\n","quality","apu","frames/s","realtime","hash",
+      compare ? 6 : 0,"stable",compare ? "  baseline" : "");
 
-    memcpy(baseName,argv[0],strlen(argv[0]));
-    baseName[strlen(argv[0])] = '\0';
+    for(q = 0; q < GBS2WAV_QUALITY_COUNT; q++) {
+        config = *base;
+        gbs2wav_config_set_quality(&config,(gbs2wav_quality)q);
+        if(apuFactor != 0) config.apuFactor = apuFactor;
+        config.stems = 0;
 
-    c = &baseName[strlen(baseName)-1];
-    while(c >= &baseName[0] && *c != '/') {
-        *c = '\0';
-        c--;
-    }
+        if(config.sampleRate % config.apuFactor != 0) {
+            printf("%-10s skipped, sample rate not divisible by %u\n",gbs2wav_quality_name(q),config.apuFactor);
+            continue;
+        }
 
-    if(argc > 1) {
-        m3uData = slurp(argv[1], &m3uSize);
-        if(m3uData == NULL) goto done;
-        nez_m3u_init(&m3u);
-        i = 0;
-        if(nez_m3u_parse(&m3u,(const char *)m3uData,m3uSize) == 0) goto done;
-        while(m3u.linetype == NEZ_M3U_COMMENT) {
-            if(tmpAlloc < m3u.linelength) {
-                tmp = realloc(tmp,m3u.linelength + 1);
-            }
-            memcpy(tmp,&m3u.line[0],m3u.linelength);
-            tmp[m3u.linelength] = '\0';
-
-            if( (c = strstr(tmp,"@TITLE")) != NULL) {
-                c += strlen("@TITLE");
-                if(*c == ':') {
-                    c++;
-                } else if(*c == '@') {
-                    c++;
-                }
-                while(*c && *c == ' ') c++;
-                if(!*c) goto nextline;
-                title = malloc(sizeof(char) * strlen(c) + 1);
-                memcpy(title,c,strlen(c) + 1);
-            } else if( (c = strstr(tmp,"@ARTIST")) != NULL) {
-                c += strlen("@ARTIST");
-                if(*c == ':') {
-                    c++;
-                } else if(*c == '@') {
-                    c++;
-                }
-                while(*c && *c == ' ') c++;
-                if(!*c) goto nextline;
-                artist = malloc(sizeof(char) * strlen(c) + 1);
-                memcpy(artist,c,strlen(c) + 1);
-            } else if( (c = strstr(tmp,"@COMPOSER")) != NULL) {
-                c += strlen("@COMPOSER");
-                if(*c == ':') {
-                    c++;
-                } else if(*c == '@') {
-                    c++;
-                }
-                while(*c && *c == ' ') c++;
-                if(!*c) goto nextline;
-                composer = malloc(sizeof(char) * strlen(c) + 1);
-                memcpy(composer,c,strlen(c) + 1);
-            } else if( (c = strstr(tmp,"@DATE")) != NULL) {
-                c += strlen("@DATE");
-                if(*c == ':') {
-                    c++;
-                } else if(*c == '@') {
-                    c++;
-                }
-                while(*c && *c == ' ') c++;
-                if(!*c) goto nextline;
-                date = malloc(sizeof(char) * strlen(c) + 1);
-                memcpy(date,c,strlen(c) + 1);
-            } else if( (c = strstr(tmp,"@RIPPER")) != NULL) {
-                c += strlen("@RIPPER");
-                if(*c == ':') {
-                    c++;
-                } else if(*c == '@') {
-                    c++;
+        h = gbs2wav_open(gbsData,gbsSize,(const char *)m3uData,m3uSize,&config);
+        if(h == NULL) {
+            fprintf(stderr,"Error loading GBS\n");
+            return -1;
+        }
+
+        total = 0;
+        elapsed = 0.0;
+        stable = 1;
+        firstHash = 0;
+        for(run = 0; run < runs; run++) {
+            hash = FNV_OFFSET;
+            for(i = 0; i < gbs2wav_track_count(h); i++) {
+                if(gbs2wav_start_track(h,i) != 0) {
+                    fprintf(stderr,"Error starting track %u\n",gbs2wav_track_number(h,i));
+                    gbs2wav_close(h);
+                    return -1;
                 }
-                while(*c && *c == ' ') c++;
-                if(!*c) goto nextline;
-                ripper = malloc(sizeof(char) * strlen(c) + 1);
-                memcpy(ripper,c,strlen(c) + 1);
-            } else if( (c = strstr(tmp,"@TAGGER")) != NULL) {
-                c += strlen("@TAGGER");
-                if(*c == ':') {
-                    c++;
-                } else if(*c == '@') {
-                    c++;
+                while(1) {
+                    start = clock();
+                    frames = gbs2wav_render(h,arena->samples,arena->blockFrames);
+                    elapsed += (double)(clock() - start) / (double)CLOCKS_PER_SEC;
+                    if(frames == 0) break;
+                    hash = hash_samples(hash,arena->samples,frames * config.channels);
+                    total += frames;
                 }
-                while(*c && *c == ' ') c++;
-                if(!*c) goto nextline;
-                tagger = malloc(sizeof(char) * strlen(c) + 1);
-                memcpy(tagger,c,strlen(c) + 1);
             }
-            else if(i == 0) {
-                c = tmp;
-                while(*c && *c == '#') c++;
-                while(*c && *c == ' ') c++;
-                if(!*c) goto nextline;
-                title = malloc(sizeof(char) * strlen(c) + 1);
-                memcpy(title,c,strlen(c) + 1);
+            if(run == 0) {
+                firstHash = hash;
+            } else if(hash != firstHash) {
+                stable = 0;
             }
+        }
+
+        if(elapsed <= 0.0) elapsed = 1.0 / (double)CLOCKS_PER_SEC;
+        results[q].present = 1;
+        results[q].apuFactor = config.apuFactor;
+        results[q].framesPerSecond = (double)total / elapsed;
+        results[q].hash = firstHash;
+
+        printf("%-10s %5ux %14.0f %9.1fx  %016lx  %-*s",
+          gbs2wav_quality_name(q),
+          config.apuFactor,
+          results[q].framesPerSecond,
+          ((double)total / (double)config.sampleRate) / elapsed,
+          (unsigned long)firstHash,
+          compare ? 6 : 0,
+          runs < 2 ? "-" : stable ? "yes" : "NO");
+        b = &baseline[q];
+        if(compare && b->present && b->apuFactor == config.apuFactor) {
+            printf("  %.2fx, %s",results[q].framesPerSecond / b->framesPerSecond,
+              b->hash == firstHash ? "same PCM" : "PCM DIFFERS");
+            differs += b->hash != firstHash;
+        } else if(compare) {
+            printf("  -");
+        }
+        printf("\n");
 
-            nextline:
-            if(nez_m3u_parse(&m3u,(const char *)m3uData,m3uSize) == 0) goto done;
-            i++;
+        gbs2wav_close(h);
+    }
+
+    if(baselineName != NULL && !compare) {
+        if(save_baseline(baselineName,results) != 0) {
+            fprintf(stderr,"Error writing baseline %s\n",baselineName);
+            return -1;
         }
-        /* find any tags we can */
-        nez_m3u_init(&m3u);
+        printf("Saved baseline to %s\n",baselineName);
+    }
+    if(differs) {
+        fprintf(stderr,"%u preset(s) rendered different PCM than the baseline\n",differs);
+        return -1;
     }
+    return 0;
+}
 
-    if(title == NULL) {
-        if(strlen(gbsInfo.title)) title = gbsInfo.title;
+/* one line per preset: name, APU factor, frames/s and hash. Returns
+ * how many presets were read, 0 when there's no file */
+static unsigned int load_baseline(const char *filename, bench_result *results) {
+    char line[BUFFER_SIZE];
+    char name[64];
+    unsigned int apu;
+    unsigned long long hash;
+    double fps;
+    unsigned int count = 0;
+    int q;
+    FILE *f;
+
+    memset(results,0,sizeof(bench_result) * GBS2WAV_QUALITY_COUNT);
+    f = fopen(filename,"rb");
+    if(f == NULL) return 0;
+    while(fgets(line,sizeof(line),f) != NULL) {
+        if(line[0] == '#') continue;
+        if(sscanf(line,"%63s %u %lf %llx",name,&apu,&fps,&hash) != 4) continue;
+        q = gbs2wav_quality_lookup(name);
+        if(q < 0 || fps <= 0.0) continue;
+        results[q].present = 1;
+        results[q].apuFactor = apu;
+        results[q].framesPerSecond = fps;
+        results[q].hash = (uint64_t)hash;
+        count++;
     }
-    if(artist == NULL) {
-        if(strlen(gbsInfo.author)) artist = gbsInfo.author;
+    fclose(f);
+    return count;
+}
+
+static int save_baseline(const char *filename, const bench_result *results) {
+    unsigned int q;
+    FILE *f = fopen(filename,"wb");
+
+    if(f == NULL) return -1;
+    fprintf(f,"# quality apu frames/s hash\n");
+    for(q = 0; q < GBS2WAV_QUALITY_COUNT; q++) {
+        if(!results[q].present) continue;
+        fprintf(f,"%s %u %.0f %016llx\n",gbs2wav_quality_name((int)q),results[q].apuFactor,
+          results[q].framesPerSecond,(unsigned long long)results[q].hash);
     }
+    return fclose(f) == 0 ? 0 : -1;
+}
 
-    dump_gbs_info(&gbsInfo);
-    if(m3uData != NULL) {
-        printf("Parsed M3U tags:\n");
-        if(title != NULL && title != gbsInfo.title) {
-            printf("Title: %s\n",title);
-        }
-        if(artist != NULL && artist != gbsInfo.author) {
-            printf("Artist: %s\n",artist);
-        }
-        if(composer != NULL) {
-            printf("Composer: %s\n",composer);
-        }
-        if(date != NULL) {
-            printf("Date: %s\n",date);
-        }
-        if(ripper != NULL) {
-            printf("Ripper: %s\n",ripper);
-        }
-        if(tagger != NULL) {
-            printf("tagger: %s\n",tagger);
+/* --catalog: rescans dirs into the catalog when any are given, then
+ * lists the sets matching query (any set for "") with their lengths
+ * and render estimates, and the totals */
+static int run_catalog(const char *filename, const char *const *dirs, unsigned int dirCount, const char *query, unsigned int threads, unsigned int speed) {
+    catalog old;
+    catalog scanned;
+    catalog_scan_stats stats;
+    const catalog *cat = &old;
+    const catalog_set *set;
+    const char *path;
+    const char *title;
+    const char *author;
+    const char *copyright;
+    char length[32];
+    char estimate[32];
+    unsigned int sets = 0;
+    unsigned int tracks = 0;
+    uint64_t totalMs = 0;
+    uint32_t i;
+    double start;
+    int r = -1;
+
+    memset(&scanned,0,sizeof(catalog));
+    if(catalog_load(&old,filename) != 0) return -1;
+
+    if(dirCount) {
+        start = wall_clock();
+        if(catalog_scan(&scanned,&old,dirs,dirCount,threads,&stats) != 0) goto done;
+        if(catalog_save(&scanned,filename) != 0) goto done;
+        cat = &scanned;
+        printf("Scanned %u sets in %.2fs: %u read, %u unchanged, %u skipped\n",
+          stats.parsed + stats.unchanged + stats.failed,wall_clock() - start,
+          stats.parsed,stats.unchanged,stats.failed);
+    }
+
+    if(query != NULL) {
+        printf("set\ttracks\tlength\testimate\ttitle\tauthor\tcopyright\n");
+    }
+    for(i = 0; i < cat->setCount; i++) {
+        set = &cat->sets[i];
+        path = catalog_string(cat,set->path);
+        title = catalog_string(cat,set->title);
+        author = catalog_string(cat,set->author);
+        copyright = catalog_string(cat,set->copyright);
+        if(query != NULL && strstr(path,query) == NULL && strstr(title,query) == NULL &&
+          strstr(author,query) == NULL && strstr(copyright,query) == NULL) continue;
+
+        sets++;
+        tracks += set->trackCount;
+        totalMs += set->totalMs;
+        if(query != NULL) {
+            format_duration(length,sizeof(length),set->totalMs);
+            format_duration(estimate,sizeof(estimate),set->totalMs / speed);
+            printf("%s\t%u\t%s\t%s\t%s\t%s\t%s\n",path,set->trackCount,length,estimate,title,author,copyright);
         }
-        printf("\n");
     }
 
-    switch(gb_model) {
-        case GB_MODEL_DMG_B: modelName = NAME_DMG_B; break;
-        case GB_MODEL_SGB: modelName = NAME_SGB; break;
-        case GB_MODEL_SGB_NO_SFC: modelName = NAME_SGB_NO_SFC; break;
-        case GB_MODEL_SGB_PAL: modelName = NAME_SGB_PAL; break;
-        case GB_MODEL_SGB_PAL_NO_SFC: modelName = NAME_SGB_PAL_NO_SFC; break;
-        case GB_MODEL_MGB: modelName = NAME_MGB; break;
-        case GB_MODEL_SGB2: modelName = NAME_SGB2; break;
-        case GB_MODEL_SGB2_NO_SFC: modelName = NAME_SGB2_NO_SFC; break;
-        case GB_MODEL_CGB_0: modelName = NAME_CGB_0; break;
-        case GB_MODEL_CGB_A: modelName = NAME_CGB_A; break;
-        case GB_MODEL_CGB_B: modelName = NAME_CGB_B; break;
-        case GB_MODEL_CGB_C: modelName = NAME_CGB_C; break;
-        case GB_MODEL_CGB_D: modelName = NAME_CGB_D; break;
-        case GB_MODEL_CGB_E: modelName = NAME_CGB_E; break;
-        case GB_MODEL_AGB_A: modelName = NAME_AGB_A; break;
-        case GB_MODEL_GBP_A: modelName = NAME_GBP_A; break;
-        default: abort();
-    }
-
-    printf("Emulating %s\n",modelName);
-
-    printf("Rendering as 16-bit, %u-channel, %luHz WAVE\n",
-      channels, sampleRate);
-
-    i = gbsInfo.first_track;
-    while(i < gbsInfo.track_count) {
-        trackName[0] = '\0';
-
-        if(m3uData == NULL) {
-            trackNo = i;
-            abuffer.totalFrames = 3 * 60 * sampleRate;
-            abuffer.fadeFrames  = 10 * sampleRate;
-        } else {
-            if(nez_m3u_parse(&m3u,(const char *)m3uData,m3uSize) == 0) goto done;
-            while(m3u.linetype != NEZ_M3U_TRACK) {
-                if(nez_m3u_parse(&m3u,(const char *)m3uData,m3uSize) == 0) goto done;
-            }
-            trackNo = m3u.tracknum;
-            t = nez_m3u_title(&m3u, NULL, 0);
-            t = t + 1 > sizeof(trackName) ? sizeof(trackName) : t + 1;
-            nez_m3u_title(&m3u,trackName,t);
-            if(m3u.length != -1) {
-                abuffer.totalFrames = m3u.length * sampleRate / 1000;
-            } else {
-                if(m3u.fade == -1) {
-                    abuffer.totalFrames = 170 * sampleRate;
-                } else {
-                    abuffer.totalFrames = 180 * sampleRate;
-                }
-            }
+    format_duration(length,sizeof(length),totalMs);
+    format_duration(estimate,sizeof(estimate),totalMs / speed);
+    printf("# %u sets, %u tracks, %s of audio, about %s to render at %ux realtime\n",
+      sets,tracks,length,estimate,speed);
+    r = 0;
 
-            if(m3u.fade != -1) {
-                abuffer.fadeFrames = m3u.fade * sampleRate / 1000;
-            } else {
-                abuffer.fadeFrames  = 10 * sampleRate;
-            }
+    done:
+    catalog_free(&scanned);
+    catalog_free(&old);
+    return r;
+}
 
-            abuffer.totalFrames += abuffer.fadeFrames;
-        }
+/* h:mm:ss, rounded up so short estimates don't read as nothing */
+static void format_duration(char *buf, size_t len, uint64_t ms) {
+    uint64_t seconds = (ms + 999) / 1000;
+    snprintf(buf,len,"%lu:%02u:%02u",(unsigned long)(seconds / 3600),
+      (unsigned int)((seconds / 60) % 60),(unsigned int)(seconds % 60));
+}
 
+static uint64_t hash_samples(uint64_t hash, const int16_t *s, uint64_t count) {
+    uint64_t i;
+    for(i = 0; i < count; i++) {
+        hash = (hash ^ (uint8_t)(s[i]     )) * FNV_PRIME;
+        hash = (hash ^ (uint8_t)(s[i] >> 8)) * FNV_PRIME;
+    }
+    return hash;
+}
 
-        if(strlen(trackName) == 0) {
-            snprintf(trackName,sizeof(trackName),"%s %03d/%03d", gbsInfo.title,trackNo + 1,gbsInfo.track_count);
-        }
+/* a record for the track whose output is still there unchanged. Only
+ * a file touched since it was recorded is read and hashed again */
+static int journal_done(const journal *j, uint64_t input, unsigned int track, const char *params, const char *baseName) {
+    char name[BUFFER_SIZE];
+    uint64_t hash;
+    uint64_t size;
+    int64_t mtime;
+    const journal_record *rec = journal_find(j,input,track,params);
+
+    if(rec == NULL) return 0;
+    snprintf(name,sizeof(name),"%s%s",baseName,rec->name);
+    if(journal_stat_file(name,&size,&mtime) != 0 || size != rec->size) return 0;
+    if(mtime == rec->mtime) return 1;
+    if(journal_hash_file(name,&hash) != 0) return 0;
+    return hash == rec->output;
+}
 
-        id3_init(&id3_buffer);
-        if(title != NULL) {
-            id3_add_text(&id3_buffer,"TALB",title,strlen(title));
-        }
-        if(artist != NULL) {
-            id3_add_text(&id3_buffer,"TPE1",artist,strlen(artist));
-        }
-        if(composer != NULL) {
-            id3_add_text(&id3_buffer,"TCOM",composer,strlen(composer));
-        }
-        if(date != NULL) {
-            id3_add_text(&id3_buffer,"TDRL",date,strlen(date));
-        }
-        if(strlen(trackName) > 0) {
-            id3_add_text(&id3_buffer,"TIT2",trackName,strlen(trackName));
-        }
-        if(ripper != NULL) {
-            id3_add_private(&id3_buffer,"gbs_ripper",ripper,strlen(ripper));
-        }
-        if(tagger != NULL) {
-            id3_add_private(&id3_buffer,"gbs_tagger",tagger,strlen(tagger));
-        }
+/* renames the pending outputs into place, then records name (one of
+ * them) in the journal when there is one */
+static int journal_commit(journal *j, output_set *outputs, uint64_t input, unsigned int track, const char *params, const char *name, const char *baseName) {
+    unsigned int i;
+    uint64_t hash = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
 
-        /* find any non-file safe characters in trackname and replace them */
-        while( (c = strchr(trackName,'/')) != NULL) {
-            *c = '_';
-        }
-        while( (c = strchr(trackName,'\\')) != NULL) {
-            *c = '_';
-        }
-        while( (c = strchr(trackName,':')) != NULL) {
-            *c = '_';
+    if(j != NULL) {
+        for(i = 0; i < outputs->count; i++) {
+            if(strcmp(outputs->files[i].name,name) == 0) break;
         }
-        while( (c = strchr(trackName,'*')) != NULL) {
-            *c = '_';
-        }
-        while( (c = strchr(trackName,'"')) != NULL) {
-            *c = '_';
-        }
-        while( (c = strchr(trackName,'?')) != NULL) {
-            *c = '_';
-        }
-        while( (c = strchr(trackName,'<')) != NULL) {
-            *c = '_';
-        }
-        while( (c = strchr(trackName,'>')) != NULL) {
-            *c = '_';
-        }
-        while( (c = strchr(trackName,'|')) != NULL) {
-            *c = '_';
+        if(i == outputs->count || journal_hash_file(outputs->files[i].temp,&hash) != 0) return -1;
+        /* the rename keeps both */
+        if(journal_stat_file(outputs->files[i].temp,&size,&mtime) != 0) return -1;
+    }
+    if(output_commit(outputs) != 0) return -1;
+    if(j == NULL) return 0;
+    return journal_append(j,input,track,params,hash,size,mtime,&name[strlen(baseName)]);
+}
+
+/* hashes a rendered block of track index up to each checkpoint. Once
+ * past the last, snapshots the emulator at the end of a block and
+ * looks for an earlier track of the same length and fade with the
+ * same hashes and the same snapshot at the same position, which will
+ * render the same from here on. Returns that track or -1 */
+static int dedupe_check(track_entry *tracks, unsigned int index, gbs2wav_t *h, const int16_t *samples, uint64_t frames, uint64_t framesDone, unsigned int channels, uint64_t sampleRate) {
+    track_entry *t = &tracks[index];
+    const track_entry *c;
+    uint64_t pos = framesDone;
+    uint64_t end = framesDone + frames;
+    uint64_t mark;
+    size_t stateSize;
+    unsigned int i;
+
+    while(t->checks < DEDUPE_CHECKPOINTS) {
+        mark = dedupe_seconds[t->checks] * sampleRate;
+        if(mark > end) {
+            t->runHash = hash_samples(t->runHash,&samples[(pos - framesDone) * channels],(end - pos) * channels);
+            return -1;
         }
+        t->runHash = hash_samples(t->runHash,&samples[(pos - framesDone) * channels],(mark - pos) * channels);
+        t->checkHash[t->checks++] = t->runHash;
+        pos = mark;
+    }
+    if(t->state != NULL || end >= t->totalFrames) return -1;
+
+    stateSize = gbs2wav_state_size(h);
+    t->state = (uint8_t *)malloc(stateSize);
+    if(t->state == NULL) return -1;
+    /* fails while frames are carried over, try the next block */
+    if(gbs2wav_save_state(h,t->state) != 0) {
+        free(t->state);
+        t->state = NULL;
+        return -1;
+    }
+    t->stateFrames = end;
+
+    for(i = 0; i < index; i++) {
+        c = &tracks[i];
+        if(c->state == NULL || c->stateFrames != t->stateFrames) continue;
+        if(c->totalFrames != t->totalFrames || c->fadeFrames != t->fadeFrames) continue;
+        if(memcmp(c->checkHash,t->checkHash,sizeof(t->checkHash)) != 0) continue;
+        if(memcmp(c->state,t->state,stateSize) != 0) continue;
+        return (int)i;
+    }
+    return -1;
+}
 
-        snprintf(outName,sizeof(outName),"%s%03u %s.wav",
-          baseName,i+1,trackName);
+/* appends len bytes of src's PCM, starting offset bytes in, to out.
+ * The album file is both read and written */
+static int copy_track_data(FILE *out, FILE *album, const track_entry *src, uint64_t offset, uint64_t len, uint8_t *buf, size_t bufLen) {
+    FILE *in = album;
+    long pos = src->dataPos + (long)offset;
+    size_t n;
+    int r = -1;
+
+    if(src->dataPath != NULL) {
+        in = fopen(src->dataPath,"rb");
+        if(in == NULL) {
+            fprintf(stderr,"Error opening %s: %s\n",src->dataPath,strerror(errno));
+            return -1;
+        }
+    }
 
-        printf("Saving track %u to: %s\n",i+1,outName);
-        abuffer.output = fopen(outName,"wb");
-        abuffer.curSample = 0;
-        abuffer.startFrames = abuffer.totalFrames;
-        write_wav_header(abuffer.output,channels,abuffer.totalFrames,(uint32_t)sampleRate,&id3_buffer);
+    while(len) {
+        n = len > bufLen ? bufLen : (size_t)len;
+        if(fseek(in,pos,SEEK_SET) != 0 || fread(buf,1,n,in) != n) goto done;
+        pos += (long)n;
+        if(in == out && fseek(out,0,SEEK_END) != 0) goto done;
+        if(fwrite(buf,1,n,out) != n) goto done;
+        len -= n;
+    }
+    r = 0;
 
-        GB_reset(&gb);
-        /* GB_lcd_off(&gb); */
-        GB_gbs_switch_track(&gb,trackNo);
+    done:
+    if(r != 0) fprintf(stderr,"Error copying track %u\n",src->number);
+    if(in != album) fclose(in);
+    return r;
+}
 
-        double nextPct = 0.0f;
-        printf("%02.0f%%\n",0.0);
+static int write_report(const char *filename, const track_entry *tracks, unsigned int count) {
+    budget_stats mem;
+    unsigned int i;
+    unsigned int silent = 0;
+    unsigned int dups = 0;
+    unsigned int stopped = 0;
+    FILE *f = fopen(filename,"wb");
+    if(f == NULL) {
+        fprintf(stderr,"Error opening %s: %s\n",filename,strerror(errno));
+        return -1;
+    }
 
-        while(abuffer.totalFrames) {
-            double pct = 1.0 - ( (double)abuffer.totalFrames / (double)abuffer.startFrames);
-            pct *= 100.0;
-            GB_run(&gb);
-            if(pct >= nextPct) {
-                printf("\x1b[1F%02.0f%%\n",pct);
-                nextPct += 1.0;
-            }
+    fprintf(f,"track\tframes\tseconds\tstatus\tsilent\tname\n");
+    for(i = 0; i < count; i++) {
+        fprintf(f,"%03u\t%lu\t%.2f\t",tracks[i].number,(unsigned long)tracks[i].totalFrames,tracks[i].seconds);
+        switch(tracks[i].status) {
+            case TRACK_DUPLICATE: fprintf(f,"duplicate of %03u",tracks[i].dupOf); dups++; break;
+            case TRACK_RESUMED: fprintf(f,"resumed"); break;
+            case TRACK_TIMEOUT: fprintf(f,"timed out"); break;
+            case TRACK_CYCLES: fprintf(f,"over cycle limit"); break;
+            case TRACK_TOO_LARGE: fprintf(f,"over size limit"); break;
+            case TRACK_CANCELLED: fprintf(f,"cancelled"); break;
+            case TRACK_WRITE_ERROR: fprintf(f,"write error"); break;
+            case TRACK_SKIPPED: fprintf(f,"not started"); break;
+            default: fprintf(f,"rendered"); break;
         }
-
-        if(abuffer.curSample > 0) {
-            if(channels == 1) {
-                fade_frames_mono(abuffer.samples,abuffer.totalFrames,abuffer.fadeFrames,abuffer.curSample);
-                pack_frames_mono(abuffer.packed,abuffer.samples,abuffer.curSample);
-            } else {
-                fade_frames_stereo(abuffer.samples,abuffer.totalFrames,abuffer.fadeFrames,abuffer.curSample / 2);
-                pack_frames_stereo(abuffer.packed,abuffer.samples,abuffer.curSample / 2);
-            }
-            fwrite(abuffer.packed,1,abuffer.curSample * 2, abuffer.output);
+        if(tracks[i].status == TRACK_RESUMED || track_failed(&tracks[i])) {
+            fprintf(f,"\t-\t%s\n",tracks[i].name);
+        } else {
+            fprintf(f,"\t%s\t%s\n",tracks[i].silent ? "yes" : "no",tracks[i].name);
+            silent += tracks[i].silent;
         }
+        stopped += track_failed(&tracks[i]);
+    }
+    fprintf(f,"# %u tracks, %u duplicates, %u silent, %u stopped early\n",count,dups,silent,stopped);
+    budget_get_stats(&mem);
+    fprintf(f,"# memory peak %llu bytes of %llu, %llu waits (%.2fs), %llu held off, %llu over the limit\n",
+      (unsigned long long)mem.peak,(unsigned long long)mem.limit,(unsigned long long)mem.waits,
+      mem.waitSeconds,(unsigned long long)mem.shed,(unsigned long long)mem.overruns);
 
-        write_wav_footer(abuffer.output,&id3_buffer);
-        fclose(abuffer.output);
-        printf("\x1b[1F%02.0f%%\n",100.0);
+    if(fclose(f) != 0) return -1;
+    return 0;
+}
 
-        i++;
+/* prints where the emulated CPU spent its time over the whole run,
+ * and writes the same figures with every routine sampled as JSON */
+static int write_profile(const char *filename, const gbs2wav_t *h) {
+    static const char *phaseNames[GBS2WAV_PHASE_COUNT] = { "init", "play", "halt", "other" };
+    static const char *interruptNames[GBS2WAV_INTERRUPT_COUNT] = { "vblank", "stat", "timer", "serial", "joypad" };
+    gbs2wav_profile p;
+    gbs2wav_routine *routines = NULL;
+    unsigned int count = 0;
+    unsigned int i;
+    double seconds;
+    int r = -1;
+    FILE *f = NULL;
+
+    gbs2wav_profile_get(h,&p);
+    seconds = (double)p.cycles / CYCLES_PER_SECOND;
+    if(p.routines) {
+        routines = (gbs2wav_routine *)malloc(sizeof(gbs2wav_routine) * p.routines);
+        if(routines == NULL) goto done;
+        count = gbs2wav_profile_routines(h,routines,p.routines);
+    }
+
+    printf("Profile: %llu samples every %llu cycles over %.2fs emulated\n",
+      (unsigned long long)p.samples,(unsigned long long)p.intervalCycles,seconds);
+    for(i = 0; i < GBS2WAV_PHASE_COUNT; i++) {
+        printf("  %-6s %6.2f%%\n",phaseNames[i],
+          p.cycles ? 100.0 * (double)p.phaseCycles[i] / (double)p.cycles : 0.0);
+    }
+    printf("  interrupts/s:");
+    for(i = 0; i < GBS2WAV_INTERRUPT_COUNT; i++) {
+        printf(" %s %.2f",interruptNames[i],seconds > 0.0 ? (double)p.interrupts[i] / seconds : 0.0);
+    }
+    printf("\n");
+    for(i = 0; i < count && i < PROFILE_TOP_ROUTINES; i++) {
+        printf("  %02X:%04X %6.2f%%\n",routines[i].bank,routines[i].address,
+          100.0 * (double)routines[i].samples / (double)p.samples);
+    }
+
+    printf("Saving profile to: %s\n",filename);
+    f = fopen(filename,"wb");
+    if(f == NULL) {
+        fprintf(stderr,"Error opening %s: %s\n",filename,strerror(errno));
+        goto done;
+    }
+    fprintf(f,"{\n  \"interval\": %llu,\n  \"samples\": %llu,\n  \"cycles\": %llu,\n  \"seconds\": %.3f,\n",
+      (unsigned long long)p.intervalCycles,(unsigned long long)p.samples,(unsigned long long)p.cycles,seconds);
+    fprintf(f,"  \"phases\": {");
+    for(i = 0; i < GBS2WAV_PHASE_COUNT; i++) {
+        fprintf(f,"%s\"%s\": %llu",i ? ", " : " ",phaseNames[i],(unsigned long long)p.phaseCycles[i]);
     }
+    fprintf(f," },\n  \"interrupts_per_second\": {");
+    for(i = 0; i < GBS2WAV_INTERRUPT_COUNT; i++) {
+        fprintf(f,"%s\"%s\": %.3f",i ? ", " : " ",interruptNames[i],
+          seconds > 0.0 ? (double)p.interrupts[i] / seconds : 0.0);
+    }
+    fprintf(f," },\n  \"routines\": [");
+    for(i = 0; i < count; i++) {
+        fprintf(f,"%s\n    { \"bank\": %u, \"address\": \"%04X\", \"samples\": %llu, \"fraction\": %.6f }",
+          i ? "," : "",routines[i].bank,routines[i].address,(unsigned long long)routines[i].samples,
+          (double)routines[i].samples / (double)p.samples);
+    }
+    fprintf(f,"%s]\n}\n",count ? "\n  " : "");
+    if(fclose(f) != 0) {
+        f = NULL;
+        goto done;
+    }
+    f = NULL;
     r = 0;
 
     done:
-    GB_free(&gb);
-
-    if(title != NULL) free(title);
-    if(artist != NULL) free(artist);
-    if(date != NULL) free(date);
-    if(ripper != NULL) free(ripper);
-    if(tagger != NULL) free(tagger);
-    if(tmp != NULL) free(tmp);
-    if(id3_buffer.x != NULL) free(id3_buffer.x);
-    if(gbsData != NULL) free(gbsData);
-    if(m3uData != NULL) free(m3uData);
-
+    if(f != NULL) fclose(f);
+    if(routines != NULL) free(routines);
+    if(r != 0) fprintf(stderr,"Error writing profile %s\n",filename);
     return r;
 }
 
+/* packs and writes the first frameCount buffered frames of the mix
+ * and of every stem, as returned by the renderer. Returns -1 when a
+ * write falls short */
+static int write_frames(audio_buffer *abuffer, uint64_t frameCount) {
+    uint64_t i;
+    stem_buffer *stem;
+    size_t len = (size_t)(frameCount * abuffer->channels * 2);
+    uint64_t traceStart = trace_begin();
+
+    if(abuffer->channels == 1) {
+        pack_frames_mono(abuffer->packed,abuffer->samples,frameCount);
+    } else {
+        pack_frames_stereo(abuffer->packed,abuffer->samples,frameCount);
+    }
+    if(abuffer->loudness != NULL) {
+        loudness_add_frames(abuffer->loudness,abuffer->samples,frameCount);
+    }
+    if(abuffer->peaks != NULL) {
+        peaks_add_frames(abuffer->peaks,abuffer->samples,frameCount);
+    }
+    if(abuffer->silent) {
+        for(i = 0; i < frameCount * abuffer->channels; i++) {
+            if(abuffer->samples[i] != 0) {
+                abuffer->silent = 0;
+                break;
+            }
+        }
+    }
+    trace_end(traceStart,"pack",-1);
+    traceStart = trace_begin();
+    if(fwrite(abuffer->packed,1,len,abuffer->output) != len) return -1;
+    trace_end(traceStart,"write",-1);
+
+    if(abuffer->stems == NULL) return 0;
+
+    traceStart = trace_begin();
+    for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+        stem = &abuffer->stems[i];
+        if(abuffer->channels == 1) {
+            pack_frames_mono(abuffer->packed,stem->samples,frameCount);
+        } else {
+            pack_frames_stereo(abuffer->packed,stem->samples,frameCount);
+        }
+        if(fwrite(abuffer->packed,1,len,stem->output) != len) return -1;
+    }
+    trace_end(traceStart,"stems",-1);
+    return 0;
+}
+
 static uint8_t *slurp(const char *filename, uint32_t *size) {
     uint8_t *buf;
+    uint64_t traceStart = trace_begin();
     FILE *f = fopen(filename,"rb");
     if(f == NULL) {
         fprintf(stderr,"Error opening %s: %s\n",
@@ -625,16 +2621,17 @@ static uint8_t *slurp(const char *filename, uint32_t *size) {
         return NULL;
     }
     fclose(f);
+    trace_end(traceStart,"slurp",-1);
     return buf;
 }
 
-static void dump_gbs_info(const GB_gbs_info_t *info) {
+static void dump_gbs_info(const gbs2wav_t *h) {
     printf("GBS Info:\n");
-    printf("Track count: %u\n",info->track_count);
-    printf("First track: %u\n",info->first_track);
-    printf("Title: %s\n",info->title);
-    printf("Author: %s\n",info->author);
-    printf("Copyright: %s\n",info->copyright);
+    printf("Track count: %u\n",gbs2wav_gbs_track_count(h));
+    printf("First track: %u\n",gbs2wav_gbs_first_track(h));
+    printf("Title: %s\n",gbs2wav_get_tag(h,GBS2WAV_TAG_GBS_TITLE));
+    printf("Author: %s\n",gbs2wav_get_tag(h,GBS2WAV_TAG_GBS_AUTHOR));
+    printf("Copyright: %s\n",gbs2wav_get_tag(h,GBS2WAV_TAG_GBS_COPYRIGHT));
     printf("\n");
 }
 
@@ -662,17 +2659,26 @@ static void id3_init(str_buffer *s) {
     id3_update_len(s);
 }
 
-static int id3_add_text(str_buffer *s, const char *frame, const char *data, size_t datalen) {
+/* makes room for len more bytes, doubling so a long tag doesn't
+ * take a realloc per step, and charges the growth to the budget */
+static int id3_reserve(str_buffer *s, size_t len) {
     uint8_t *t;
+    size_t a = s->a ? s->a : 512;
 
-    while(s->len + 10 + (1 + datalen) > s->a) {
-        t = realloc(s->x, s->a + 512);
-        if(t == NULL) {
-            return -1;
-        }
-        s->x = t;
-        s->a += 512;
+    if(s->len + len <= s->a) return 0;
+    while(s->len + len > a) a *= 2;
+    t = realloc(s->x,a);
+    if(t == NULL) {
+        return -1;
     }
+    budget_charge(a - s->a);
+    s->x = t;
+    s->a = a;
+    return 0;
+}
+
+static int id3_add_text(str_buffer *s, const char *frame, const char *data, size_t datalen) {
+    if(id3_reserve(s,10 + (1 + datalen)) != 0) return -1;
 
     memcpy(&s->x[s->len],frame,4);
     s->len += 4;
@@ -693,16 +2699,7 @@ static int id3_add_text(str_buffer *s, const char *frame, const char *data, size
 }
 
 static int id3_add_private(str_buffer *s, const char *description, const char *data, size_t datalen) {
-    uint8_t *t;
-
-    while(s->len + 10 + (1 + strlen(description) + 1 + datalen) > s->a) {
-        t = realloc(s->x, s->a + 512);
-        if(t == NULL) {
-            return -1;
-        }
-        s->x = t;
-        s->a += 512;
-    }
+    if(id3_reserve(s,10 + (1 + strlen(description) + 1 + datalen)) != 0) return -1;
 
     s->x[s->len++] = 'T';
     s->x[s->len++] = 'X';
@@ -746,14 +2743,143 @@ static void pack_uint32le(uint8_t *d, uint32_t n) {
 
 static int write_wav_footer(FILE *f, str_buffer *id3) {
     uint8_t tmp[4];
+    uint64_t traceStart;
+    int r = 0;
 
     if(id3->len == 10) return 1;
 
-    if(fwrite("ID3 ",1,4,f) != 4) return 0;
+    traceStart = trace_begin();
+    if(fwrite("ID3 ",1,4,f) != 4) goto done;
     pack_uint32le(tmp,id3->len);
-    if(fwrite(tmp,1,4,f) != 4) return 0;
-    if(fwrite(id3->x,1,id3->len,f) != id3->len) return 0;
-    return 1;
+    if(fwrite(tmp,1,4,f) != 4) goto done;
+    if(fwrite(id3->x,1,id3->len,f) != id3->len) goto done;
+    r = 1;
+
+    done:
+    trace_end(traceStart,"id3 footer",-1);
+    return r;
+}
+
+/* total size of a WAV written by write_wav_header/write_wav_footer */
+static uint64_t wav_file_size(uint64_t channels, uint64_t totalFrames, str_buffer *id3) {
+    uint64_t size = 44 + totalFrames * 2 * channels;
+    if(id3->len > 10) size += id3->len + 8;
+    return size;
+}
+
+static void pack_tar_octal(uint8_t *d, size_t len, uint64_t n) {
+    d[--len] = '\0';
+    while(len--) {
+        d[len] = (uint8_t)('0' + (n & 7));
+        n >>= 3;
+    }
+}
+
+/* ustar header for a regular file, names over 100 bytes keep their
+ * extension and lose the end of the title */
+static int write_tar_header(FILE *f, const char *name, uint64_t size) {
+    uint8_t h[TAR_BLOCK_SIZE];
+    size_t nameLen = strlen(name);
+    const char *ext = strrchr(name,'.');
+    size_t extLen = ext == NULL ? 0 : strlen(ext);
+    uint32_t sum = 0;
+    unsigned int i;
+
+    memset(h,0,sizeof(h));
+    if(nameLen > 100) {
+        memcpy(&h[0],name,100 - extLen);
+        memcpy(&h[100 - extLen],ext,extLen);
+    } else {
+        memcpy(&h[0],name,nameLen);
+    }
+    pack_tar_octal(&h[100],8,0644);       /* mode */
+    pack_tar_octal(&h[108],8,0);          /* uid */
+    pack_tar_octal(&h[116],8,0);          /* gid */
+    pack_tar_octal(&h[124],12,size);
+    pack_tar_octal(&h[136],12,(uint64_t)time(NULL));
+    memset(&h[148],' ',8);                /* checksum placeholder */
+    h[156] = '0';                         /* regular file */
+    memcpy(&h[257],"ustar",6);
+    memcpy(&h[263],"00",2);
+
+    for(i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += h[i];
+    }
+    pack_tar_octal(&h[148],7,sum);
+    h[155] = ' ';
+
+    return fwrite(h,1,TAR_BLOCK_SIZE,f) == TAR_BLOCK_SIZE;
+}
+
+/* pads a member of the given size out to a full tar block */
+static int write_tar_padding(FILE *f, uint64_t size) {
+    uint8_t pad[TAR_BLOCK_SIZE];
+    size_t len = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+    if(len == 0) return 1;
+    memset(pad,0,len);
+    return fwrite(pad,1,len,f) == len;
+}
+
+/* writes key "val", double quotes in val become single quotes */
+static void write_cue_string(FILE *f, const char *indent, const char *key, const char *val, const char *suffix) {
+    fprintf(f,"%s%s \"",indent,key);
+    while(*val) {
+        fputc(*val == '"' ? '\'' : *val, f);
+        val++;
+    }
+    fprintf(f,"\"%s\n",suffix);
+}
+
+static int write_cue_sheet(const char *filename, const char *wavName, const album_tags *tags, const track_entry *tracks, unsigned int count, uint64_t sampleRate, const loudness_histogram *album) {
+    unsigned int i;
+    uint64_t frames;
+    char gain[16];
+    char peak[16];
+    FILE *f = fopen(filename,"wb");
+    if(f == NULL) {
+        fprintf(stderr,"Error opening %s: %s\n",filename,strerror(errno));
+        return -1;
+    }
+
+    if(tags->artist != NULL) write_cue_string(f,"","PERFORMER",tags->artist,"");
+    if(tags->title != NULL) write_cue_string(f,"","TITLE",tags->title,"");
+    if(tags->composer != NULL) write_cue_string(f,"","SONGWRITER",tags->composer,"");
+    if(tags->date != NULL) fprintf(f,"REM DATE %s\n",tags->date);
+    if(album != NULL) {
+        format_gain(gain,sizeof(gain),REPLAYGAIN_REFERENCE - loudness_integrated(album),"dB");
+        format_peak(peak,sizeof(peak),album->samplePeak);
+        fprintf(f,"REM REPLAYGAIN_ALBUM_GAIN %s\nREM REPLAYGAIN_ALBUM_PEAK %s\n",gain,peak);
+    }
+    write_cue_string(f,"","FILE",wavName," WAVE");
+
+    for(i = 0; i < count; i++) {
+        frames = tracks[i].offsetFrames * CUE_FRAMES_PER_SECOND / sampleRate;
+        fprintf(f,"  TRACK %02u AUDIO\n",i + 1);
+        write_cue_string(f,"    ","TITLE",tracks[i].name,"");
+        if(tags->artist != NULL) {
+            write_cue_string(f,"    ","PERFORMER",tags->artist,"");
+        }
+        if(album != NULL) {
+            format_gain(gain,sizeof(gain),tracks[i].gain,"dB");
+            format_peak(peak,sizeof(peak),tracks[i].peak);
+            fprintf(f,"    REM REPLAYGAIN_TRACK_GAIN %s\n    REM REPLAYGAIN_TRACK_PEAK %s\n",gain,peak);
+        }
+        fprintf(f,"    INDEX 01 %02lu:%02lu:%02lu\n",
+          (unsigned long)(frames / CUE_FRAMES_PER_SECOND / 60),
+          (unsigned long)(frames / CUE_FRAMES_PER_SECOND % 60),
+          (unsigned long)(frames % CUE_FRAMES_PER_SECOND));
+    }
+
+    /* fprintf errors stick until fclose, which flushes the rest */
+    if(ferror(f)) {
+        fclose(f);
+        f = NULL;
+    }
+    if(f == NULL || fclose(f) != 0) {
+        fprintf(stderr,"Error writing %s\n",filename);
+        return -1;
+    }
+    return 0;
 }
 
 static int write_wav_header(FILE *f, uint64_t channels, uint64_t totalFrames, uint32_t sampleRate, str_buffer *id3) {
@@ -799,74 +2925,6 @@ static int write_wav_header(FILE *f, uint64_t channels, uint64_t totalFrames, ui
     return 1;
 }
 
-static void
-fade_frames_mono(int16_t *data, uint64_t framesRem, uint64_t framesFade, uint64_t frameCount) {
-    uint64_t i = 0;
-    uint64_t f = framesFade;
-    double fade;
-    int32_t s;
-
-    if(framesRem > framesFade) {
-        i = framesRem - framesFade;
-        f += i;
-    } else {
-        f = framesRem;
-    }
-
-    while(i<frameCount && f > i) {
-        fade = (double)(f-i) / (double)framesFade;
-        s = (int32_t)data[i];
-        s *= fade;
-        s = CLAMP(s,-0x8000,0x7FFF);
-        data[i] = (int16_t)s;
-        i++;
-    }
-
-    while(i<frameCount) {
-        data[i] = 0;
-        i++;
-    }
-
-    return;
-}
-
-
-static void
-fade_frames_stereo(int16_t *data, uint64_t framesRem, uint64_t framesFade, uint64_t frameCount) {
-    uint64_t i = 0;
-    uint64_t f = framesFade;
-    double fade;
-    int32_t sl, sr;
-
-    if(framesRem > framesFade) {
-        i = framesRem - framesFade;
-        f += i;
-    } else {
-        f = framesRem;
-    }
-
-    while(i<frameCount && f > i) {
-        fade = (double)(f-i) / (double)framesFade;
-        sl = (int32_t)data[(i*2)+0];
-        sr = (int32_t)data[(i*2)+1];
-        sl *= fade;
-        sr *= fade;
-        sl = CLAMP(sl,-0x8000,0x7FFF);
-        sr = CLAMP(sr,-0x8000,0x7FFF);
-        data[(i*2)+0] = (int16_t)sl;
-        data[(i*2)+1] = (int16_t)sr;
-        i++;
-    }
-
-    while(i<frameCount) {
-        data[(i*2)+0] = 0;
-        data[(i*2)+1] = 0;
-        i++;
-    }
-
-    return;
-}
-
 static void pack_frames_mono(uint8_t *d, int16_t *s, uint64_t frameCount) {
     uint64_t i = 0;
     while(i<frameCount) {
@@ -900,6 +2958,6 @@ static uint64_t scan_uint(const char *str) {
 }
 
 static int usage(const char *self, int e) {
-    printf("Usage: %s --mono --model=model --sample-rate=rate /path/to/file.gbs (/path/to/file.m3u)\n",self);
+    printf("Usage: %s --mono --model=model --sample-rate=rate --fast-apu(=factor) --quality=draft|standard|master --simd=auto|scalar|sse2|avx2 --bench(=runs) --baseline=file --split(=seconds) --threads=n --verify --seek-index(=seconds) --index-budget=KiB --memory-budget=MiB --apu-log --peaks(=frames) --start=seconds --journal(=file) --resume --dedupe --report(=file) --profile(=file) --trace(=file) --track-timeout=seconds --max-cycles=n --max-output=MiB --daemon=socket --cache=n --warm=n --catalog=file --query(=text) --speed=x --stems --low-memory --album=cue|tar --replaygain /path/to/file.gbs (/path/to/file.m3u)\n",self);
     return e;
 }
@@ -0,0 +1,252 @@
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync(fd) _commit(fd)
+#define fileno(f) _fileno(f)
+#else
+#include <unistd.h>
+#endif
+
+#define FNV_PRIME 0x100000001b3ULL
+#define JOURNAL_LINE_SIZE 4096
+#define TEMP_SUFFIX ".part"
+
+static char *str_dup(const char *s);
+static int parse_record(journal_record *r, char *line);
+
+int journal_open(journal *j, const char *filename, unsigned int resume) {
+    char line[JOURNAL_LINE_SIZE];
+    journal_record r;
+    void *t;
+    FILE *f;
+
+    memset(j,0,sizeof(journal));
+
+    if(resume && (f = fopen(filename,"rb")) != NULL) {
+        while(fgets(line,sizeof(line),f) != NULL) {
+            /* a torn last line from a crash is just skipped */
+            if(parse_record(&r,line) != 0) continue;
+            if(j->count == j->alloc) {
+                t = realloc(j->records,sizeof(journal_record) * (j->alloc ? j->alloc * 2 : 64));
+                if(t == NULL) {
+                    free(r.params);
+                    free(r.name);
+                    fclose(f);
+                    journal_close(j);
+                    return -1;
+                }
+                j->records = (journal_record *)t;
+                j->alloc = j->alloc ? j->alloc * 2 : 64;
+            }
+            j->records[j->count++] = r;
+        }
+        fclose(f);
+    }
+
+    j->f = fopen(filename,"ab");
+    if(j->f == NULL) {
+        fprintf(stderr,"Error opening %s: %s\n",filename,strerror(errno));
+        journal_close(j);
+        return -1;
+    }
+    return 0;
+}
+
+void journal_close(journal *j) {
+    unsigned int i;
+    if(j->f != NULL) fclose(j->f);
+    for(i = 0; i < j->count; i++) {
+        free(j->records[i].params);
+        free(j->records[i].name);
+    }
+    if(j->records != NULL) free(j->records);
+    memset(j,0,sizeof(journal));
+}
+
+const journal_record *journal_find(const journal *j, uint64_t input, unsigned int track, const char *params) {
+    unsigned int i = j->count;
+    while(i--) {
+        if(j->records[i].input == input && j->records[i].track == track &&
+          strcmp(j->records[i].params,params) == 0) return &j->records[i];
+    }
+    return NULL;
+}
+
+int journal_append(journal *j, uint64_t input, unsigned int track, const char *params, uint64_t output, uint64_t size, int64_t mtime, const char *name) {
+    if(fprintf(j->f,"%016llx %u %s %016llx %llu %lld %s\n",(unsigned long long)input,track,params,
+      (unsigned long long)output,(unsigned long long)size,(long long)mtime,name) < 0) return -1;
+    if(fflush(j->f) != 0) return -1;
+    return fsync(fileno(j->f));
+}
+
+uint64_t journal_hash(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *d = (const uint8_t *)data;
+    while(len--) {
+        hash = (hash ^ *d++) * FNV_PRIME;
+    }
+    return hash;
+}
+
+int journal_hash_file(const char *filename, uint64_t *hash) {
+    uint8_t buf[JOURNAL_LINE_SIZE];
+    size_t n;
+    FILE *f = fopen(filename,"rb");
+    if(f == NULL) return -1;
+
+    *hash = JOURNAL_HASH_INIT;
+    while( (n = fread(buf,1,sizeof(buf),f)) > 0) {
+        *hash = journal_hash(*hash,buf,n);
+    }
+    n = ferror(f);
+    fclose(f);
+    return n ? -1 : 0;
+}
+
+int journal_stat_file(const char *filename, uint64_t *size, int64_t *mtime) {
+    struct stat st;
+    if(stat(filename,&st) != 0) return -1;
+    *size = (uint64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtime;
+    return 0;
+}
+
+const char *output_add(output_set *s, const char *name) {
+    output_file *o;
+    void *t;
+
+    if(s->count == s->alloc) {
+        t = realloc(s->files,sizeof(output_file) * (s->alloc ? s->alloc * 2 : 16));
+        if(t == NULL) return NULL;
+        s->files = (output_file *)t;
+        s->alloc = s->alloc ? s->alloc * 2 : 16;
+    }
+
+    o = &s->files[s->count];
+    o->name = str_dup(name);
+    o->temp = (char *)malloc(strlen(name) + sizeof(TEMP_SUFFIX));
+    if(o->name == NULL || o->temp == NULL) {
+        if(o->name != NULL) free(o->name);
+        if(o->temp != NULL) free(o->temp);
+        return NULL;
+    }
+    memcpy(o->temp,name,strlen(name));
+    memcpy(&o->temp[strlen(name)],TEMP_SUFFIX,sizeof(TEMP_SUFFIX));
+    s->count++;
+    return o->temp;
+}
+
+FILE *output_open(output_set *s, const char *name) {
+    const char *temp = output_add(s,name);
+    FILE *f;
+
+    if(temp == NULL) {
+        fprintf(stderr,"out of memory\n");
+        return NULL;
+    }
+    /* readable too, for copying duplicate tracks out of album files */
+    f = fopen(temp,"w+b");
+    if(f == NULL) {
+        fprintf(stderr,"Error opening %s: %s\n",temp,strerror(errno));
+    }
+    return f;
+}
+
+int output_close(FILE *f) {
+    int r = 0;
+    /* a write that failed along the way left the error flag set */
+    if(fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0) r = -1;
+    if(fclose(f) != 0) r = -1;
+    return r;
+}
+
+int output_commit(output_set *s) {
+    unsigned int i;
+    int r = 0;
+
+    for(i = 0; i < s->count; i++) {
+#ifdef _WIN32
+        remove(s->files[i].name);
+#endif
+        if(rename(s->files[i].temp,s->files[i].name) != 0) {
+            fprintf(stderr,"Error renaming %s: %s\n",s->files[i].temp,strerror(errno));
+            remove(s->files[i].temp);
+            r = -1;
+        }
+        free(s->files[i].name);
+        free(s->files[i].temp);
+    }
+    s->count = 0;
+    return r;
+}
+
+void output_abort(output_set *s) {
+    output_discard(s,0);
+}
+
+void output_discard(output_set *s, unsigned int first) {
+    unsigned int i;
+    for(i = first; i < s->count; i++) {
+        remove(s->files[i].temp);
+        free(s->files[i].name);
+        free(s->files[i].temp);
+    }
+    if(first < s->count) s->count = first;
+}
+
+void output_free(output_set *s) {
+    output_abort(s);
+    if(s->files != NULL) free(s->files);
+    memset(s,0,sizeof(output_set));
+}
+
+static char *str_dup(const char *s) {
+    char *d = (char *)malloc(strlen(s) + 1);
+    if(d != NULL) memcpy(d,s,strlen(s) + 1);
+    return d;
+}
+
+/* splits "input track params output size mtime name\n" in place */
+static int parse_record(journal_record *r, char *line) {
+    char *field[6];
+    char *c = line;
+    char *end;
+    unsigned int i;
+    size_t len = strlen(line);
+
+    if(len == 0 || line[len - 1] != '\n') return -1;
+    line[len - 1] = '\0';
+
+    for(i = 0; i < 6; i++) {
+        field[i] = c;
+        c = strchr(c,' ');
+        if(c == NULL) return -1;
+        *c++ = '\0';
+    }
+    if(*c == '\0') return -1;
+
+    r->input = strtoull(field[0],&end,16);
+    if(*end != '\0') return -1;
+    r->track = (unsigned int)strtoul(field[1],&end,10);
+    if(*end != '\0') return -1;
+    r->output = strtoull(field[3],&end,16);
+    if(*end != '\0') return -1;
+    r->size = strtoull(field[4],&end,10);
+    if(*end != '\0') return -1;
+    r->mtime = strtoll(field[5],&end,10);
+    if(*end != '\0') return -1;
+
+    r->params = str_dup(field[2]);
+    r->name = str_dup(c);
+    if(r->params == NULL || r->name == NULL) {
+        if(r->params != NULL) free(r->params);
+        if(r->name != NULL) free(r->name);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+#ifndef GBS2WAV_JOURNAL_H
+#define GBS2WAV_JOURNAL_H
+
+/* crash-safe batch output.
+ *
+ * Outputs are written under a temporary name (the final name plus
+ * ".part") and renamed into place once complete, so an interrupted
+ * render never leaves a file that looks finished. Finished work is
+ * recorded in an append-only journal, one line per record:
+ *
+ *   <input hash> <track> <params> <output hash> <size> <mtime> <output name>
+ *
+ * Hashes are 64-bit FNV-1a in hex, params is a string without spaces.
+ * The output's size and modification time (seconds since the epoch)
+ * let a resume skip rehashing a file nobody has touched since.
+ * A record is only appended once its outputs have been renamed, so
+ * after a crash the journal never claims more than is on disk. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define JOURNAL_HASH_INIT 0xcbf29ce484222325ULL
+
+typedef struct journal_record {
+    uint64_t input;
+    unsigned int track;
+    char *params;
+    uint64_t output;
+    uint64_t size;
+    int64_t mtime;
+    char *name;
+} journal_record;
+
+typedef struct journal {
+    FILE *f;
+    journal_record *records;
+    unsigned int count;
+    unsigned int alloc;
+} journal;
+
+typedef struct output_file {
+    char *name;
+    char *temp;
+} output_file;
+
+/* outputs written under their temporary names, awaiting commit */
+typedef struct output_set {
+    output_file *files;
+    unsigned int count;
+    unsigned int alloc;
+} output_set;
+
+/* opens filename for appending, reading the records already in it
+ * when resume is set. Returns 0 on success */
+int journal_open(journal *j, const char *filename, unsigned int resume);
+void journal_close(journal *j);
+
+/* the latest record for input/track/params, NULL if there's none */
+const journal_record *journal_find(const journal *j, uint64_t input, unsigned int track, const char *params);
+
+/* appends a record and flushes it to disk */
+int journal_append(journal *j, uint64_t input, unsigned int track, const char *params, uint64_t output, uint64_t size, int64_t mtime, const char *name);
+
+uint64_t journal_hash(uint64_t hash, const void *data, size_t len);
+
+/* hashes a whole file, returns 0 on success */
+int journal_hash_file(const char *filename, uint64_t *hash);
+
+/* a file's size and modification time, returns 0 on success */
+int journal_stat_file(const char *filename, uint64_t *size, int64_t *mtime);
+
+/* registers name and returns the temporary name to write it under,
+ * NULL when out of memory. output_open also opens it for writing */
+const char *output_add(output_set *s, const char *name);
+FILE *output_open(output_set *s, const char *name);
+
+/* flushes f to disk and closes it. Returns -1 when that or any
+ * earlier write to f failed, the file can't be trusted then */
+int output_close(FILE *f);
+
+/* renames every pending output into place */
+int output_commit(output_set *s);
+
+/* removes every pending output's temporary file */
+void output_abort(output_set *s);
+
+/* as output_abort, for the outputs from index first on */
+void output_discard(output_set *s, unsigned int first);
+
+void output_free(output_set *s);
+
+#endif
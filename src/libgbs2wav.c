@@ -0,0 +1,2173 @@
+#include "libgbs2wav.h"
+#include "mix.h"
+
+#include "thirdparty/SameBoy/Core/gb.h"
+#include "thirdparty/SameBoy/Core/apu.h"
+
+#define NEZ_M3U_IMPLEMENTATION
+#define NEZ_M3U_STATIC
+#include "nez-m3u-parser.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define DEFAULT_GB_MODEL GB_MODEL_DMG_B
+
+/* per-channel DAC step and highpass charge factor, same as the APU's
+ * own mixer (MAX_CH_AMP / 0xF / 8) */
+#define STEM_CH_STEP (0x1FE0 / 0xF / 8)
+#define STEM_HIGHPASS_BASE 0.999958
+#define STEM_APU_CLOCK (1 << 21)
+/* APU samples whose stem lanes are mixed in one go */
+#define STEM_BLOCK_SAMPLES 256
+/* stem_block positions that aren't frames of the stems' dst */
+#define STEM_TO_SCRATCH UINT64_MAX
+#define STEM_TO_NOWHERE (UINT64_MAX - 1)
+/* units of h->cycles, what GB_run returns */
+#define RUN_CYCLES_PER_SECOND (1 << 23)
+
+#define DRAFT_APU_FACTOR 4
+
+#define GBS_HEADER_SIZE 0x70
+/* track lengths before the fade when the M3U doesn't give one: no
+ * time at all, or only a fade */
+#define DEFAULT_LENGTH_MS 170000
+#define DEFAULT_FADED_LENGTH_MS 180000
+#define DEFAULT_FADE_MS 10000
+#define MASTER_INTERFERENCE_VOLUME 1.0
+
+/* M3U tags are the first entries of gbs2wav_tag */
+#define M3U_TAG_COUNT (GBS2WAV_TAG_TAGGER + 1)
+/* a comment line with this sets the next track's start offset */
+#define M3U_START_KEY "@START"
+
+#define STATE_MAGIC "G2WS"
+#define STATE_VERSION 3
+
+#define INDEX_MAGIC "G2WI"
+#define INDEX_VERSION 2
+
+/* delta encoding: a literal ends at a run of this many zero bytes */
+#define DELTA_MIN_ZERO_RUN 8
+
+#define LOG_MAGIC "G2WL"
+#define LOG_VERSION 1
+#define LOG_HEADER_SIZE 136
+#define LOG_NAME_MAX 1024
+/* sound registers and wave RAM */
+#define LOG_REG_FIRST 0xFF10
+#define LOG_REG_LAST  0xFF3F
+
+/* the GBS a log replays through: init and play both return straight
+ * away, so the CPU sits halted while the APU runs */
+#define REPLAY_LOAD_ADDRESS 0x0470
+#define REPLAY_STACK 0xFFFE
+#define REPLAY_GBS_SIZE 0x71
+#define OP_RET 0xC9
+#define OP_HALT 0x76
+
+/* guest profiler: depth of the shadow call stack, the first size of
+ * the routine table (a power of two), and the interrupt vectors */
+#define PROFILE_STACK_DEPTH 64
+#define PROFILE_TABLE_MIN 256
+#define PROFILE_VECTOR_FIRST 0x40
+#define PROFILE_VECTOR_STEP 0x08
+
+#define BRANCH_NONE 0
+#define BRANCH_CALL 1
+#define BRANCH_RET  2
+#define BRANCH_JUMP 3
+
+#define CLAMP(val, min, max) ( (val) < (min) ? (min) : (val) > (max) ? (max) : (val) )
+
+typedef struct track_plan {
+    unsigned int number;
+    unsigned int song;
+    /* from the start of the song, startFrames of them aren't rendered */
+    uint64_t totalFrames;
+    uint64_t fadeFrames;
+    uint64_t startFrames;
+    char *name;
+} track_plan;
+
+typedef struct stem_state {
+    /* the caller's buffer for the render in progress */
+    int16_t *dst;
+    int32_t lastSample[GBS2WAV_MAX_CHANNELS];
+    int16_t scratch[GBS2WAV_MAX_APU_FACTOR * GBS2WAV_MAX_CHANNELS];
+} stem_state;
+
+/* the stem lanes of the APU samples since the last flush, and where
+ * each sample's frames go: a frame of the stems' dst or STEM_TO_* */
+typedef struct stem_block {
+    int32_t dac[STEM_BLOCK_SAMPLES * MIX_STEM_LANES];
+    int32_t gain[STEM_BLOCK_SAMPLES * MIX_STEM_LANES];
+    int32_t out[STEM_BLOCK_SAMPLES * MIX_STEM_LANES];
+    uint64_t pos[STEM_BLOCK_SAMPLES];
+    unsigned int frames[STEM_BLOCK_SAMPLES];
+    unsigned int count;
+} stem_block;
+
+/* the renderer's part of a snapshot, the core's state follows it */
+typedef struct saved_state {
+    char magic[4];
+    uint32_t version;
+    gbs2wav_config config;
+    uint64_t framesLeft;
+    uint64_t framesPending;
+    uint64_t fadeFrames;
+    uint64_t cycles;
+    uint64_t logPos;
+    uint64_t logNext;
+    int32_t lastSample[GBS2WAV_MAX_CHANNELS];
+    int32_t stemLastSample[GBS2WAV_STEM_COUNT][GBS2WAV_MAX_CHANNELS];
+    double stemCapacitor[GBS2WAV_STEM_COUNT][GBS2WAV_MAX_CHANNELS];
+    /* the core's own save state leaves this out: where the next sample
+     * falls, the DAC and highpass levels */
+    GB_apu_output_t apuOutput;
+    uint64_t coreSize;
+} saved_state;
+
+typedef struct index_entry {
+    uint64_t position;
+    uint64_t offset;
+    uint64_t length;
+} index_entry;
+
+/* sidecar header, written in host byte order */
+typedef struct index_header {
+    char magic[4];
+    uint32_t version;
+    gbs2wav_config config;
+    uint32_t song;
+    uint32_t count;
+    uint64_t totalFrames;
+    uint64_t fadeFrames;
+    uint64_t startFrames;
+    uint64_t stateSize;
+    uint64_t blobLen;
+} index_header;
+
+typedef struct seek_index {
+    unsigned int recording;
+    uint64_t intervalFrames;
+    size_t bytesPerMinute;
+    uint64_t nextMark;
+    /* the track the entries belong to */
+    unsigned int song;
+    uint64_t totalFrames;
+    uint64_t fadeFrames;
+    uint64_t startFrames;
+    size_t stateSize;
+    /* the decoded first snapshot, and room to decode or encode one */
+    uint8_t *base;
+    uint8_t *work;
+    uint8_t *encoded;
+    index_entry *entries;
+    unsigned int count;
+    unsigned int alloc;
+    uint8_t *blob;
+    uint64_t blobLen;
+    uint64_t blobAlloc;
+} seek_index;
+
+/* log files are little-endian: the header fields below, the name,
+ * then the events, each a varint cycle delta, a register offset from
+ * LOG_REG_FIRST and the value written */
+typedef struct apu_log {
+    unsigned int capturing;
+    /* capture missed writes, or the track was seeked */
+    unsigned int broken;
+    unsigned int model;
+    unsigned int number;
+    uint32_t lengthMs;
+    uint32_t fadeMs;
+    uint64_t cycles;
+    char *name;
+    uint8_t *events;
+    uint64_t len;
+    uint64_t alloc;
+    /* capture: cycle of the last event. Replay: read offset and the
+     * cycle of the event there, UINT64_MAX once they're all out */
+    uint64_t last;
+    uint64_t pos;
+    uint64_t next;
+} apu_log;
+
+/* a routine's samples, empty while samples is 0 */
+typedef struct profile_slot {
+    uint32_t key;
+    uint64_t samples;
+} profile_slot;
+
+typedef struct guest_profile {
+    gbs2wav_profile totals;
+    uint64_t nextSample;
+    /* from the GBS header */
+    uint16_t initAddress;
+    uint16_t playAddress;
+    unsigned int phase;
+    /* the instruction the last callback was for */
+    uint16_t lastAddress;
+    uint8_t lastOpcode;
+    /* routines entered by a call, rst or interrupt and not returned
+     * from, as bank << 16 | address. Entries past the depth are only
+     * counted, so returns still line up */
+    uint32_t stack[PROFILE_STACK_DEPTH];
+    unsigned int depth;
+    unsigned int overflow;
+    profile_slot *slots;
+    unsigned int slotAlloc;
+} guest_profile;
+
+struct gbs2wav_s {
+    GB_gameboy_t gb;
+    unsigned int gbInit;
+    GB_gbs_info_t info;
+    gbs2wav_config config;
+    unsigned int apuShift;
+    double highpassRate;
+    const mix_ops *mix;
+
+    char *tags[M3U_TAG_COUNT];
+    track_plan *tracks;
+    unsigned int trackCount;
+
+    /* the current track: what was started, frames not yet returned,
+     * and frames the core has yet to produce */
+    unsigned int song;
+    unsigned int trackIndex;
+    uint64_t cycles;
+    uint64_t trackFrames;
+    uint64_t framesLeft;
+    uint64_t framesPending;
+    uint64_t fadeFrames;
+    /* run through at the start without making samples */
+    uint64_t startFrames;
+    int32_t lastSample[GBS2WAV_MAX_CHANNELS];
+    stem_state stems[GBS2WAV_STEM_COUNT];
+    /* the stem highpass state, one lane per channel and side */
+    double stemCapacitor[MIX_STEM_LANES];
+    /* only with config.stems */
+    stem_block *stemBlock;
+    unsigned int stemsActive;
+    /* gbs2wav_skip in progress: samples only advance the position
+     * and the interpolation and stem filter state */
+    unsigned int skipping;
+
+    /* the caller's buffer for the render in progress, samples land
+     * there directly and only go through scratch when a GB_run
+     * produces more than fits */
+    int16_t *dst;
+    uint64_t dstFrames;
+    uint64_t dstPos;
+    int16_t scratch[GBS2WAV_MAX_APU_FACTOR * GBS2WAV_MAX_CHANNELS];
+
+    /* frames produced past the end of dst, returned first by the
+     * next render: the mix, then one buffer per stem */
+    int16_t *carry[1 + GBS2WAV_STEM_COUNT];
+    uint64_t carryFrames;
+    uint64_t carryAlloc;
+
+    seek_index index;
+    apu_log log;
+    unsigned int replay;
+    guest_profile profile;
+};
+
+static const char *m3u_tag_keys[M3U_TAG_COUNT] = {
+    "@TITLE",
+    "@ARTIST",
+    "@COMPOSER",
+    "@DATE",
+    "@RIPPER",
+    "@TAGGER",
+};
+
+static const struct {
+    const char *name;
+    GB_model_t model;
+} model_names[] = {
+    { "dmg-b",           GB_MODEL_DMG_B },
+    { "sgb",             GB_MODEL_SGB },
+    { "sgb-no-sfc",      GB_MODEL_SGB_NO_SFC },
+    { "sgb-ntsc",        GB_MODEL_SGB_NTSC },
+    { "sgb-ntsc-no-sfc", GB_MODEL_SGB_NTSC_NO_SFC },
+    { "sgb-pal",         GB_MODEL_SGB_PAL },
+    { "sgb-pal-no-sfc",  GB_MODEL_SGB_PAL_NO_SFC },
+    { "mgb",             GB_MODEL_MGB },
+    { "sgb2",            GB_MODEL_SGB2 },
+    { "sgb2-no-sfc",     GB_MODEL_SGB2_NO_SFC },
+    { "cgb-0",           GB_MODEL_CGB_0 },
+    { "cgb-a",           GB_MODEL_CGB_A },
+    { "cgb-b",           GB_MODEL_CGB_B },
+    { "cgb-c",           GB_MODEL_CGB_C },
+    { "cgb-d",           GB_MODEL_CGB_D },
+    { "cgb-e",           GB_MODEL_CGB_E },
+    { "agb-a",           GB_MODEL_AGB_A },
+    { "gbp-a",           GB_MODEL_GBP_A },
+    { "dmg",             GB_MODEL_DMG_B },
+    { "cgb",             GB_MODEL_CGB_E },
+    { "agb",             GB_MODEL_AGB },
+    { "gbp",             GB_MODEL_GBP },
+};
+
+static const char *simd_names[GBS2WAV_SIMD_COUNT] = {
+    "auto",
+    "scalar",
+    "sse2",
+    "avx2",
+};
+
+static const char *quality_names[GBS2WAV_QUALITY_COUNT] = {
+    "draft",
+    "standard",
+    "master",
+};
+
+static const char *NAME_DMG_B          = "Game Boy";
+static const char *NAME_SGB            = "Super Game Boy (NTSC)";
+static const char *NAME_SGB_NO_SFC     = "Super Game Boy (NTSC) (No SFC)";
+static const char *NAME_SGB_PAL        = "Super Game Boy (PAL)";
+static const char *NAME_SGB_PAL_NO_SFC = "Super Game Boy (PAL) (No SFC)";
+static const char *NAME_SGB2           = "Super Game Boy 2";
+static const char *NAME_SGB2_NO_SFC    = "Super Game Boy 2 (No SFC)";
+static const char *NAME_MGB            = "Game Boy Pocket/Light";
+static const char *NAME_CGB_0          = "Game Boy Color (CPU CGB 0)";
+static const char *NAME_CGB_A          = "Game Boy Color (CPU CGB A)";
+static const char *NAME_CGB_B          = "Game Boy Color (CPU CGB B)";
+static const char *NAME_CGB_C          = "Game Boy Color (CPU CGB C)";
+static const char *NAME_CGB_D          = "Game Boy Color (CPU CGB D)";
+static const char *NAME_CGB_E          = "Game Boy Color";
+static const char *NAME_AGB_A          = "Game Boy Advance";
+static const char *NAME_GBP_A          = "Game Boy Player";
+
+static int scan_m3u_tags(gbs2wav_t *h, const char *m3uData, unsigned int m3uSize);
+static int plan_tracks(gbs2wav_t *h, const char *m3uData, unsigned int m3uSize);
+static int plan_m3u(const GB_gbs_info_t *info, const char *m3uData, unsigned int m3uSize, gbs2wav_plan_track **tracks);
+
+static void on_sample(GB_gameboy_t *gb, GB_sample_t *sample);
+static void stems_gather(gbs2wav_t *h, uint64_t pos, uint64_t frameCount);
+static void stems_flush(gbs2wav_t *h);
+static void spill_frames(gbs2wav_t *h, uint64_t frameCount);
+static uint64_t drain_carry(gbs2wav_t *h, uint64_t frames);
+static uint64_t discard_carry(gbs2wav_t *h, uint64_t frames);
+static void reset_song(gbs2wav_t *h, unsigned int song, uint64_t totalFrames, uint64_t fadeFrames);
+static void fast_forward(gbs2wav_t *h);
+static void run_step(gbs2wav_t *h);
+static GB_apu_output_t *apu_output(gbs2wav_t *h);
+static int config_matches(const gbs2wav_config *a, const gbs2wav_config *b);
+static int start_song(gbs2wav_t *h, unsigned int song, uint64_t totalFrames, uint64_t fadeFrames);
+static uint32_t m3u_start_ms(const nez_m3u_t *m3u);
+
+static int index_alloc(seek_index *x, size_t stateSize);
+static void index_free(seek_index *x);
+static void index_capture(gbs2wav_t *h);
+static int index_restore(gbs2wav_t *h, unsigned int e);
+static uint64_t delta_encode(uint8_t *out, const uint8_t *cur, const uint8_t *ref, size_t len);
+static int delta_decode(uint8_t *out, const uint8_t *in, uint64_t inLen, const uint8_t *ref, size_t len);
+
+static bool on_write(GB_gameboy_t *gb, uint16_t addr, uint8_t data);
+static int log_parse(apu_log *l, const uint8_t *buf, size_t len);
+static void log_replay(gbs2wav_t *h);
+static void log_reset(gbs2wav_t *h);
+static void on_execute(GB_gameboy_t *gb, uint16_t address, uint8_t opcode);
+static unsigned int branch_kind(uint8_t opcode, unsigned int *len);
+static uint32_t routine_key(gbs2wav_t *h, uint16_t address);
+static void profile_reset(guest_profile *p);
+static void profile_step(gbs2wav_t *h, uint64_t cycles);
+static void profile_sample(gbs2wav_t *h, uint64_t weight);
+static int profile_grow(guest_profile *p);
+static int routine_compare(const void *a, const void *b);
+static uint8_t *put_varint(uint8_t *d, uint64_t n);
+static const uint8_t *get_varint(const uint8_t *s, const uint8_t *end, uint64_t *n);
+
+static void fade_frames(gbs2wav_t *h, int16_t *d, uint64_t frameCount);
+static void interp_frames_mono(int16_t *d, int32_t prev, int32_t cur, unsigned int shift, uint64_t frameCount);
+static void interp_frames_stereo(int16_t *d, const int32_t *prev, const int32_t *cur, unsigned int shift, uint64_t frameCount);
+
+void gbs2wav_config_init(gbs2wav_config *c) {
+    c->model = DEFAULT_GB_MODEL;
+    c->sampleRate = GBS2WAV_DEFAULT_SAMPLE_RATE;
+    c->channels = GBS2WAV_MAX_CHANNELS;
+    c->apuFactor = 1;
+    c->stems = 0;
+    c->quality = GBS2WAV_QUALITY_STANDARD;
+    c->simd = GBS2WAV_SIMD_AUTO;
+}
+
+void gbs2wav_config_set_quality(gbs2wav_config *c, gbs2wav_quality q) {
+    c->quality = q;
+    c->apuFactor = q == GBS2WAV_QUALITY_DRAFT ? DRAFT_APU_FACTOR : 1;
+}
+
+int gbs2wav_quality_lookup(const char *name) {
+    unsigned int i;
+    for(i = 0; i < GBS2WAV_QUALITY_COUNT; i++) {
+        if(strcasecmp(name,quality_names[i]) == 0) return (int)i;
+    }
+    return -1;
+}
+
+const char *gbs2wav_quality_name(int quality) {
+    if(quality < 0 || quality >= GBS2WAV_QUALITY_COUNT) return NULL;
+    return quality_names[quality];
+}
+
+int gbs2wav_simd_lookup(const char *name) {
+    unsigned int i;
+    for(i = 0; i < GBS2WAV_SIMD_COUNT; i++) {
+        if(strcasecmp(name,simd_names[i]) == 0) return (int)i;
+    }
+    return -1;
+}
+
+const char *gbs2wav_simd_name(int simd) {
+    if(simd < 0 || simd >= GBS2WAV_SIMD_COUNT) return NULL;
+    return simd_names[simd];
+}
+
+int gbs2wav_simd_supported(gbs2wav_simd simd) {
+    return mix_get(simd) != NULL;
+}
+
+gbs2wav_simd gbs2wav_simd_level(const gbs2wav_config *c) {
+    return (gbs2wav_simd)(c->simd == GBS2WAV_SIMD_AUTO ? mix_best() : (int)c->simd);
+}
+
+int gbs2wav_model_lookup(const char *name) {
+    unsigned int i;
+    for(i = 0; i < sizeof(model_names) / sizeof(model_names[0]); i++) {
+        if(strcasecmp(name,model_names[i].name) == 0) return (int)model_names[i].model;
+    }
+    return -1;
+}
+
+const char *gbs2wav_model_name(int model) {
+    switch(model) {
+        case GB_MODEL_DMG_B: return NAME_DMG_B;
+        case GB_MODEL_SGB: return NAME_SGB;
+        case GB_MODEL_SGB_NO_SFC: return NAME_SGB_NO_SFC;
+        case GB_MODEL_SGB_PAL: return NAME_SGB_PAL;
+        case GB_MODEL_SGB_PAL_NO_SFC: return NAME_SGB_PAL_NO_SFC;
+        case GB_MODEL_MGB: return NAME_MGB;
+        case GB_MODEL_SGB2: return NAME_SGB2;
+        case GB_MODEL_SGB2_NO_SFC: return NAME_SGB2_NO_SFC;
+        case GB_MODEL_CGB_0: return NAME_CGB_0;
+        case GB_MODEL_CGB_A: return NAME_CGB_A;
+        case GB_MODEL_CGB_B: return NAME_CGB_B;
+        case GB_MODEL_CGB_C: return NAME_CGB_C;
+        case GB_MODEL_CGB_D: return NAME_CGB_D;
+        case GB_MODEL_CGB_E: return NAME_CGB_E;
+        case GB_MODEL_AGB_A: return NAME_AGB_A;
+        case GB_MODEL_GBP_A: return NAME_GBP_A;
+        default: break;
+    }
+    return NULL;
+}
+
+gbs2wav_t *gbs2wav_open(const uint8_t *gbs, size_t gbsLen, const char *m3u, size_t m3uLen, const gbs2wav_config *c) {
+    gbs2wav_t *h;
+    gbs2wav_config def;
+    apu_log log;
+    uint8_t replayGbs[REPLAY_GBS_SIZE];
+
+    if(c == NULL) {
+        gbs2wav_config_init(&def);
+        c = &def;
+    }
+
+    memset(&log,0,sizeof(apu_log));
+    if(gbs2wav_log_detect(gbs,gbsLen)) {
+        if(log_parse(&log,gbs,gbsLen) != 0) goto fail_log;
+        if(c != &def) def = *c;
+        def.model = (int)log.model;
+        c = &def;
+
+        /* an idle driver, with the header strings the log carried */
+        memset(replayGbs,0,sizeof(replayGbs));
+        memcpy(replayGbs,"GBS",3);
+        replayGbs[0x03] = 1;
+        replayGbs[0x04] = 1;
+        replayGbs[0x05] = 1;
+        replayGbs[0x06] = replayGbs[0x08] = replayGbs[0x0A] = REPLAY_LOAD_ADDRESS & 0xFF;
+        replayGbs[0x07] = replayGbs[0x09] = replayGbs[0x0B] = REPLAY_LOAD_ADDRESS >> 8;
+        replayGbs[0x0C] = REPLAY_STACK & 0xFF;
+        replayGbs[0x0D] = REPLAY_STACK >> 8;
+        memcpy(&replayGbs[0x10],&gbs[24],96);
+        replayGbs[0x70] = OP_RET;
+        gbs = replayGbs;
+        gbsLen = sizeof(replayGbs);
+        m3u = NULL;
+    }
+    if(gbs2wav_model_name(c->model) == NULL) goto fail_log;
+    if(c->channels == 0 || c->channels > GBS2WAV_MAX_CHANNELS) goto fail_log;
+    if(c->apuFactor == 0 || c->apuFactor > GBS2WAV_MAX_APU_FACTOR || (c->apuFactor & (c->apuFactor - 1))) goto fail_log;
+    if(c->sampleRate == 0 || c->sampleRate % c->apuFactor != 0) goto fail_log;
+    if(gbs2wav_quality_name(c->quality) == NULL) goto fail_log;
+    if(mix_get(c->simd) == NULL) goto fail_log;
+
+    h = (gbs2wav_t *)malloc(sizeof(gbs2wav_t));
+    if(h == NULL) goto fail_log;
+    memset(h,0,sizeof(gbs2wav_t));
+
+    h->config = *c;
+    while( (1U << h->apuShift) < c->apuFactor) h->apuShift++;
+    h->highpassRate = pow(STEM_HIGHPASS_BASE, (double)STEM_APU_CLOCK / (double)(c->sampleRate / c->apuFactor));
+    h->mix = mix_get(c->simd);
+
+    GB_init(&h->gb, (GB_model_t)c->model);
+    h->gbInit = 1;
+    if(c->stems) {
+        h->stemBlock = (stem_block *)malloc(sizeof(stem_block));
+        if(h->stemBlock == NULL) goto fail;
+        h->stemBlock->count = 0;
+    }
+    GB_set_sample_rate(&h->gb, c->sampleRate / c->apuFactor);
+    GB_set_user_data(&h->gb, h);
+    GB_apu_set_sample_callback(&h->gb, on_sample);
+    GB_set_rendering_disabled(&h->gb, 1);
+    GB_set_turbo_mode(&h->gb, true, true);
+
+    /* standard leaves the core's defaults alone */
+    switch(c->quality) {
+        case GBS2WAV_QUALITY_DRAFT: {
+            GB_set_highpass_filter_mode(&h->gb, GB_HIGHPASS_OFF);
+            GB_set_interference_volume(&h->gb, 0.0);
+            break;
+        }
+        case GBS2WAV_QUALITY_MASTER: {
+            GB_set_highpass_filter_mode(&h->gb, GB_HIGHPASS_ACCURATE);
+            GB_set_interference_volume(&h->gb, MASTER_INTERFERENCE_VOLUME);
+            break;
+        }
+        default: break;
+    }
+
+    if(GB_load_gbs_from_buffer(&h->gb, gbs, gbsLen, &h->info) != 0) goto fail;
+    h->profile.initAddress = (uint16_t)(gbs[0x08] | (gbs[0x09] << 8));
+    h->profile.playAddress = (uint16_t)(gbs[0x0A] | (gbs[0x0B] << 8));
+
+    if(m3u != NULL) {
+        if(scan_m3u_tags(h,m3u,(unsigned int)m3uLen) != 0) goto fail;
+    }
+    if(plan_tracks(h,m3u,(unsigned int)m3uLen) != 0) goto fail;
+
+    h->log = log;
+    h->log.next = UINT64_MAX;
+    if(h->log.events != NULL) {
+        h->replay = 1;
+        memset(&log,0,sizeof(apu_log));
+        if(h->trackCount != 1) goto fail;
+        free(h->tracks[0].name);
+        h->tracks[0].name = h->log.name;
+        h->log.name = NULL;
+        h->tracks[0].number = h->log.number;
+        h->tracks[0].totalFrames = (uint64_t)h->log.lengthMs * c->sampleRate / 1000;
+        h->tracks[0].fadeFrames = (uint64_t)h->log.fadeMs * c->sampleRate / 1000;
+    }
+
+    return h;
+
+    fail:
+    gbs2wav_close(h);
+    fail_log:
+    if(log.name != NULL) free(log.name);
+    if(log.events != NULL) free(log.events);
+    return NULL;
+}
+
+void gbs2wav_close(gbs2wav_t *h) {
+    unsigned int i;
+
+    if(h == NULL) return;
+    if(h->gbInit) GB_free(&h->gb);
+
+    for(i = 0; i < M3U_TAG_COUNT; i++) {
+        if(h->tags[i] != NULL) free(h->tags[i]);
+    }
+    if(h->tracks != NULL) {
+        for(i = 0; i < h->trackCount; i++) {
+            free(h->tracks[i].name);
+        }
+        free(h->tracks);
+    }
+    for(i = 0; i < 1 + GBS2WAV_STEM_COUNT; i++) {
+        if(h->carry[i] != NULL) free(h->carry[i]);
+    }
+    if(h->stemBlock != NULL) free(h->stemBlock);
+    index_free(&h->index);
+    if(h->log.name != NULL) free(h->log.name);
+    if(h->log.events != NULL) free(h->log.events);
+    if(h->profile.slots != NULL) free(h->profile.slots);
+    free(h);
+}
+
+const gbs2wav_config *gbs2wav_get_config(const gbs2wav_t *h) {
+    return &h->config;
+}
+
+const char *gbs2wav_get_tag(const gbs2wav_t *h, gbs2wav_tag tag) {
+    switch(tag) {
+        case GBS2WAV_TAG_TITLE: {
+            if(h->tags[tag] != NULL) return h->tags[tag];
+            return strlen(h->info.title) ? h->info.title : NULL;
+        }
+        case GBS2WAV_TAG_ARTIST: {
+            if(h->tags[tag] != NULL) return h->tags[tag];
+            return strlen(h->info.author) ? h->info.author : NULL;
+        }
+        case GBS2WAV_TAG_COMPOSER:
+        case GBS2WAV_TAG_DATE:
+        case GBS2WAV_TAG_RIPPER:
+        case GBS2WAV_TAG_TAGGER: return h->tags[tag];
+        case GBS2WAV_TAG_GBS_TITLE: return h->info.title;
+        case GBS2WAV_TAG_GBS_AUTHOR: return h->info.author;
+        case GBS2WAV_TAG_GBS_COPYRIGHT: return h->info.copyright;
+        default: break;
+    }
+    return NULL;
+}
+
+unsigned int gbs2wav_gbs_track_count(const gbs2wav_t *h) {
+    return h->info.track_count;
+}
+
+unsigned int gbs2wav_gbs_first_track(const gbs2wav_t *h) {
+    return h->info.first_track;
+}
+
+unsigned int gbs2wav_track_count(const gbs2wav_t *h) {
+    return h->trackCount;
+}
+
+const char *gbs2wav_track_name(const gbs2wav_t *h, unsigned int index) {
+    if(index >= h->trackCount) return NULL;
+    return h->tracks[index].name;
+}
+
+unsigned int gbs2wav_track_number(const gbs2wav_t *h, unsigned int index) {
+    if(index >= h->trackCount) return 0;
+    return h->tracks[index].number;
+}
+
+unsigned int gbs2wav_track_song(const gbs2wav_t *h, unsigned int index) {
+    if(index >= h->trackCount) return 0;
+    return h->tracks[index].song;
+}
+
+uint64_t gbs2wav_track_frames(const gbs2wav_t *h, unsigned int index) {
+    if(index >= h->trackCount) return 0;
+    return h->tracks[index].totalFrames - h->tracks[index].startFrames;
+}
+
+uint64_t gbs2wav_track_fade(const gbs2wav_t *h, unsigned int index) {
+    if(index >= h->trackCount) return 0;
+    return h->tracks[index].fadeFrames;
+}
+
+uint64_t gbs2wav_track_start(const gbs2wav_t *h, unsigned int index) {
+    if(index >= h->trackCount) return 0;
+    return h->tracks[index].startFrames;
+}
+
+int gbs2wav_set_track_start(gbs2wav_t *h, unsigned int index, uint64_t frames) {
+    track_plan *t;
+
+    if(index >= h->trackCount) return -1;
+    t = &h->tracks[index];
+    /* at least one frame is left to render */
+    if(frames >= t->totalFrames) {
+        frames = t->totalFrames ? t->totalFrames - 1 : 0;
+    }
+    t->startFrames = frames;
+    return 0;
+}
+
+int gbs2wav_start_track(gbs2wav_t *h, unsigned int index) {
+    const track_plan *t;
+
+    if(index >= h->trackCount) return -1;
+    t = &h->tracks[index];
+    h->startFrames = t->startFrames;
+    if(start_song(h,t->song,t->totalFrames - t->startFrames,t->fadeFrames) != 0) return -1;
+    h->trackIndex = index;
+    return 0;
+}
+
+int gbs2wav_start_song(gbs2wav_t *h, unsigned int song, uint64_t totalFrames, uint64_t fadeFrames) {
+    h->startFrames = 0;
+    if(start_song(h,song,totalFrames,fadeFrames) != 0) return -1;
+    h->trackIndex = (unsigned int)-1;
+    return 0;
+}
+
+static int start_song(gbs2wav_t *h, unsigned int song, uint64_t totalFrames, uint64_t fadeFrames) {
+    if(song >= h->info.track_count) return -1;
+
+    reset_song(h,song,totalFrames,fadeFrames);
+    if(h->log.capturing) {
+        h->log.len = 0;
+        h->log.last = 0;
+        /* replaying a log starts from the top of the song */
+        h->log.broken = h->startFrames != 0;
+    }
+
+    if(h->index.recording) {
+        if(index_alloc(&h->index,gbs2wav_state_size(h)) != 0) return -1;
+        h->index.song = song;
+        h->index.totalFrames = totalFrames;
+        h->index.fadeFrames = fadeFrames;
+        h->index.startFrames = h->startFrames;
+        h->index.count = 0;
+        h->index.blobLen = 0;
+        h->index.nextMark = 0;
+        index_capture(h);
+    }
+    return 0;
+}
+
+static void reset_song(gbs2wav_t *h, unsigned int song, uint64_t totalFrames, uint64_t fadeFrames) {
+    unsigned int i;
+
+    h->song = song;
+    h->trackFrames = totalFrames;
+    h->framesLeft = totalFrames;
+    h->framesPending = totalFrames;
+    h->fadeFrames = fadeFrames;
+    h->lastSample[0] = 0;
+    h->lastSample[1] = 0;
+    for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+        h->stems[i].lastSample[0] = 0;
+        h->stems[i].lastSample[1] = 0;
+        h->stemCapacitor[(i * 2) + 0] = 0.0;
+        h->stemCapacitor[(i * 2) + 1] = 0.0;
+    }
+    if(h->stemBlock != NULL) h->stemBlock->count = 0;
+    h->carryFrames = 0;
+    h->cycles = 0;
+
+    GB_reset(&h->gb);
+    GB_gbs_switch_track(&h->gb,(uint8_t)song);
+    log_reset(h);
+    profile_reset(&h->profile);
+    if(h->startFrames) fast_forward(h);
+}
+
+/* runs up to the start offset with the APU making no samples, so
+ * there's no on_sample, mixing or resampling for the skipped part.
+ * Register writes (and log replay) still happen as usual */
+static void fast_forward(gbs2wav_t *h) {
+    uint64_t target = h->startFrames * RUN_CYCLES_PER_SECOND / h->config.sampleRate;
+
+    GB_set_sample_rate(&h->gb,0);
+    GB_apu_set_sample_callback(&h->gb,NULL);
+    while(h->cycles < target) {
+        run_step(h);
+    }
+    GB_set_sample_rate(&h->gb,h->config.sampleRate / h->config.apuFactor);
+    GB_apu_set_sample_callback(&h->gb,on_sample);
+}
+
+/* the core's sample timing and output filters, which sit outside
+ * GB_gameboy_t's public part */
+static GB_apu_output_t *apu_output(gbs2wav_t *h) {
+    return &((struct GB_gameboy_internal_s *)&h->gb)->apu_output;
+}
+
+/* one GB_run, with any logged writes due replayed ahead of it */
+static void run_step(gbs2wav_t *h) {
+    uint64_t cycles;
+
+    if(h->log.next <= h->cycles) log_replay(h);
+    cycles = (uint64_t)GB_run(&h->gb);
+    h->cycles += cycles;
+    if(h->profile.totals.intervalCycles) profile_step(h,cycles);
+}
+
+uint64_t gbs2wav_frames_left(const gbs2wav_t *h) {
+    return h->framesLeft;
+}
+
+uint64_t gbs2wav_track_cycles(const gbs2wav_t *h) {
+    return h->cycles;
+}
+
+uint64_t gbs2wav_render(gbs2wav_t *h, int16_t *dst, uint64_t frames) {
+    return gbs2wav_render_ex(h,dst,NULL,frames,0);
+}
+
+uint64_t gbs2wav_render_ex(gbs2wav_t *h, int16_t *dst, int16_t *const *stems, uint64_t frames, uint64_t maxCycles) {
+    unsigned int i;
+    uint64_t cycles = 0;
+    uint64_t count;
+
+    if(stems != NULL && !h->config.stems) return 0;
+    if(frames > h->framesLeft) frames = h->framesLeft;
+    if(frames == 0) return 0;
+
+    h->dst = dst;
+    h->dstFrames = frames;
+    h->stemsActive = stems != NULL;
+    for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+        h->stems[i].dst = stems != NULL ? stems[i] : NULL;
+    }
+    h->dstPos = drain_carry(h,frames);
+
+    /* a GB_run may overshoot by the samples of one instruction,
+     * those go to the carry buffer */
+    if(maxCycles == 0) {
+        while(h->dstPos < frames && h->framesPending) {
+            run_step(h);
+            if(h->index.recording) index_capture(h);
+        }
+    } else {
+        cycles = h->cycles + maxCycles;
+        while(h->dstPos < frames && h->framesPending && h->cycles < cycles) {
+            run_step(h);
+            if(h->index.recording) index_capture(h);
+        }
+    }
+    stems_flush(h);
+
+    count = h->dstPos;
+
+    /* the fade is positioned from the frames left at the start of
+     * the block, so it doesn't depend on the block size */
+    fade_frames(h,dst,count);
+    if(stems != NULL) {
+        for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+            fade_frames(h,stems[i],count);
+        }
+    }
+
+    h->framesLeft -= count;
+    h->dst = NULL;
+    h->dstFrames = 0;
+    h->dstPos = 0;
+    return count;
+}
+
+uint64_t gbs2wav_skip(gbs2wav_t *h, uint64_t frames) {
+    uint64_t skipped;
+    uint64_t start;
+    uint64_t target = 0;
+
+    if(frames > h->framesLeft) frames = h->framesLeft;
+    skipped = discard_carry(h,frames);
+    frames -= skipped;
+
+    start = h->framesPending;
+    if(frames < h->framesPending) {
+        target = h->framesPending - frames;
+    }
+
+    h->skipping = 1;
+    h->stemsActive = h->config.stems;
+    while(h->framesPending > target) {
+        run_step(h);
+        if(h->index.recording) index_capture(h);
+    }
+    stems_flush(h);
+    h->skipping = 0;
+
+    /* the last GB_run may have overshot, those frames are skipped too */
+    skipped += start - h->framesPending;
+    h->framesLeft -= skipped;
+    return skipped;
+}
+
+/* every setting that shapes the output, which the instruction set
+ * doesn't */
+static int config_matches(const gbs2wav_config *a, const gbs2wav_config *b) {
+    gbs2wav_config t = *a;
+    t.simd = b->simd;
+    return memcmp(&t,b,sizeof(gbs2wav_config)) == 0;
+}
+
+size_t gbs2wav_state_size(const gbs2wav_t *h) {
+    return sizeof(saved_state) + GB_get_save_state_size((GB_gameboy_t *)&h->gb);
+}
+
+int gbs2wav_save_state(gbs2wav_t *h, uint8_t *buf) {
+    saved_state st;
+    unsigned int i;
+
+    if(h->carryFrames != 0) return -1;
+    /* the stem filters have to be up to date */
+    stems_flush(h);
+
+    memset(&st,0,sizeof(saved_state));
+    memcpy(st.magic,STATE_MAGIC,4);
+    st.version = STATE_VERSION;
+    st.config = h->config;
+    /* with nothing carried over these only differ in the middle of a
+     * render, where everything produced counts as returned */
+    st.framesLeft = h->framesPending;
+    st.framesPending = h->framesPending;
+    st.fadeFrames = h->fadeFrames;
+    st.cycles = h->cycles;
+    st.logPos = h->log.pos;
+    st.logNext = h->log.next;
+    st.lastSample[0] = h->lastSample[0];
+    st.lastSample[1] = h->lastSample[1];
+    for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+        st.stemLastSample[i][0] = h->stems[i].lastSample[0];
+        st.stemLastSample[i][1] = h->stems[i].lastSample[1];
+        st.stemCapacitor[i][0] = h->stemCapacitor[(i * 2) + 0];
+        st.stemCapacitor[i][1] = h->stemCapacitor[(i * 2) + 1];
+    }
+    st.apuOutput = *apu_output(h);
+    /* the callback is this process's, not part of the state */
+    st.apuOutput.sample_callback = NULL;
+    st.coreSize = GB_get_save_state_size(&h->gb);
+
+    memcpy(buf,&st,sizeof(saved_state));
+    GB_save_state_to_buffer(&h->gb,&buf[sizeof(saved_state)]);
+    return 0;
+}
+
+int gbs2wav_load_state(gbs2wav_t *h, const uint8_t *buf, size_t len) {
+    saved_state st;
+    GB_sample_callback_t callback;
+    unsigned int i;
+
+    if(len < sizeof(saved_state)) return -1;
+    memcpy(&st,buf,sizeof(saved_state));
+    if(memcmp(st.magic,STATE_MAGIC,4) != 0 || st.version != STATE_VERSION) return -1;
+    if(!config_matches(&st.config,&h->config)) return -1;
+    if(st.coreSize != len - sizeof(saved_state)) return -1;
+
+    if(GB_load_state_from_buffer(&h->gb,&buf[sizeof(saved_state)],(size_t)st.coreSize) != 0) return -1;
+    callback = apu_output(h)->sample_callback;
+    *apu_output(h) = st.apuOutput;
+    apu_output(h)->sample_callback = callback;
+
+    h->framesLeft = st.framesLeft;
+    h->framesPending = st.framesPending;
+    h->trackFrames = st.framesLeft > h->trackFrames ? st.framesLeft : h->trackFrames;
+    h->fadeFrames = st.fadeFrames;
+    h->cycles = st.cycles;
+    if(h->replay) {
+        if(st.logPos > h->log.len) return -1;
+        h->log.pos = st.logPos;
+        h->log.next = st.logNext;
+    }
+    h->log.broken |= h->log.capturing;
+    h->lastSample[0] = st.lastSample[0];
+    h->lastSample[1] = st.lastSample[1];
+    for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+        h->stems[i].lastSample[0] = st.stemLastSample[i][0];
+        h->stems[i].lastSample[1] = st.stemLastSample[i][1];
+        h->stemCapacitor[(i * 2) + 0] = st.stemCapacitor[i][0];
+        h->stemCapacitor[(i * 2) + 1] = st.stemCapacitor[i][1];
+    }
+    h->carryFrames = 0;
+    return 0;
+}
+
+void gbs2wav_index_enable(gbs2wav_t *h, uint64_t intervalFrames, size_t bytesPerMinute) {
+    h->index.recording = intervalFrames != 0;
+    h->index.intervalFrames = intervalFrames;
+    h->index.bytesPerMinute = bytesPerMinute;
+}
+
+unsigned int gbs2wav_index_count(const gbs2wav_t *h) {
+    return h->index.count;
+}
+
+size_t gbs2wav_index_bytes(const gbs2wav_t *h) {
+    return sizeof(index_header) + sizeof(index_entry) * h->index.count + h->index.blobLen;
+}
+
+int gbs2wav_index_save(const gbs2wav_t *h, const char *filename) {
+    index_header hdr;
+    const seek_index *x = &h->index;
+    FILE *f;
+    int r = -1;
+
+    if(x->count == 0) return -1;
+
+    memset(&hdr,0,sizeof(index_header));
+    memcpy(hdr.magic,INDEX_MAGIC,4);
+    hdr.version = INDEX_VERSION;
+    hdr.config = h->config;
+    hdr.song = x->song;
+    hdr.count = x->count;
+    hdr.totalFrames = x->totalFrames;
+    hdr.fadeFrames = x->fadeFrames;
+    hdr.startFrames = x->startFrames;
+    hdr.stateSize = x->stateSize;
+    hdr.blobLen = x->blobLen;
+
+    f = fopen(filename,"wb");
+    if(f == NULL) return -1;
+    if(fwrite(&hdr,1,sizeof(index_header),f) != sizeof(index_header)) goto done;
+    if(fwrite(x->entries,sizeof(index_entry),x->count,f) != x->count) goto done;
+    if(fwrite(x->blob,1,x->blobLen,f) != x->blobLen) goto done;
+    r = 0;
+
+    done:
+    fclose(f);
+    return r;
+}
+
+int gbs2wav_index_load(gbs2wav_t *h, const char *filename) {
+    index_header hdr;
+    seek_index *x = &h->index;
+    FILE *f;
+    int r = -1;
+
+    f = fopen(filename,"rb");
+    if(f == NULL) return -1;
+    if(fread(&hdr,1,sizeof(index_header),f) != sizeof(index_header)) goto done;
+    if(memcmp(hdr.magic,INDEX_MAGIC,4) != 0 || hdr.version != INDEX_VERSION) goto done;
+    if(!config_matches(&hdr.config,&h->config)) goto done;
+    if(hdr.stateSize != gbs2wav_state_size(h) || hdr.count == 0) goto done;
+
+    if(index_alloc(x,(size_t)hdr.stateSize) != 0) goto done;
+    if(x->alloc < hdr.count) {
+        index_entry *t = (index_entry *)realloc(x->entries,sizeof(index_entry) * hdr.count);
+        if(t == NULL) goto done;
+        x->entries = t;
+        x->alloc = hdr.count;
+    }
+    if(x->blobAlloc < hdr.blobLen) {
+        uint8_t *t = (uint8_t *)realloc(x->blob,(size_t)hdr.blobLen);
+        if(t == NULL) goto done;
+        x->blob = t;
+        x->blobAlloc = hdr.blobLen;
+    }
+    x->count = 0;
+    if(fread(x->entries,sizeof(index_entry),hdr.count,f) != hdr.count) goto done;
+    if(fread(x->blob,1,(size_t)hdr.blobLen,f) != hdr.blobLen) goto done;
+    if(delta_decode(x->base,x->blob,x->entries[0].length,NULL,x->stateSize) != 0) goto done;
+
+    x->count = hdr.count;
+    x->blobLen = hdr.blobLen;
+    x->song = hdr.song;
+    x->totalFrames = hdr.totalFrames;
+    x->fadeFrames = hdr.fadeFrames;
+    x->startFrames = hdr.startFrames;
+    x->recording = 0;
+    r = 0;
+
+    done:
+    fclose(f);
+    return r;
+}
+
+int gbs2wav_seek(gbs2wav_t *h, uint64_t frame) {
+    seek_index *x = &h->index;
+    uint64_t pos = h->trackFrames - h->framesLeft;
+    unsigned int e = 0;
+    unsigned int found = 0;
+
+    if(frame > h->trackFrames) frame = h->trackFrames;
+
+    if(x->count && x->song == h->song && x->totalFrames == h->trackFrames && x->fadeFrames == h->fadeFrames && x->startFrames == h->startFrames) {
+        while(e + 1 < x->count && x->entries[e + 1].position <= frame) e++;
+        found = x->entries[e].position <= frame;
+    }
+
+    /* restore when the snapshot beats skipping from here */
+    if(found && (frame < pos || x->entries[e].position > pos)) {
+        if(index_restore(h,e) != 0) return -1;
+    } else if(frame < pos) {
+        reset_song(h,h->song,h->trackFrames,h->fadeFrames);
+        h->log.broken |= h->log.capturing;
+    }
+
+    pos = h->trackFrames - h->framesLeft;
+    if(frame > pos) {
+        gbs2wav_skip(h,frame - pos);
+    }
+    return 0;
+}
+
+void gbs2wav_log_enable(gbs2wav_t *h, unsigned int enable) {
+    h->log.capturing = enable;
+    h->log.len = 0;
+    h->log.broken = 1;
+    GB_set_write_memory_callback(&h->gb,enable ? on_write : NULL);
+}
+
+size_t gbs2wav_log_bytes(const gbs2wav_t *h) {
+    return h->log.capturing ? (size_t)h->log.len : 0;
+}
+
+static void put_le(uint8_t *d, uint64_t n, unsigned int size) {
+    while(size--) {
+        *d++ = (uint8_t)n;
+        n >>= 8;
+    }
+}
+
+static uint64_t get_le(const uint8_t *s, unsigned int size) {
+    uint64_t n = 0;
+    while(size--) {
+        n = (n << 8) | s[size];
+    }
+    return n;
+}
+
+static void copy_tag(uint8_t *d, const char *tag) {
+    size_t len = tag == NULL ? 0 : strlen(tag);
+    memset(d,0,32);
+    memcpy(d,tag,len > 32 ? 32 : len);
+}
+
+int gbs2wav_log_save(const gbs2wav_t *h, const char *filename) {
+    uint8_t hdr[LOG_HEADER_SIZE];
+    const char *name = gbs2wav_track_name(h,h->trackIndex);
+    size_t nameLen;
+    FILE *f;
+    int r = -1;
+
+    if(!h->log.capturing || h->log.broken || h->log.len > UINT32_MAX) return -1;
+    if(name == NULL) name = "";
+    nameLen = strlen(name);
+    if(nameLen > LOG_NAME_MAX) nameLen = LOG_NAME_MAX;
+
+    memcpy(hdr,LOG_MAGIC,4);
+    put_le(&hdr[4],LOG_VERSION,4);
+    put_le(&hdr[8],(uint64_t)h->config.model,4);
+    put_le(&hdr[12],h->trackIndex < h->trackCount ? h->tracks[h->trackIndex].number : h->song + 1,4);
+    put_le(&hdr[16],h->cycles,8);
+    copy_tag(&hdr[24],gbs2wav_get_tag(h,GBS2WAV_TAG_TITLE));
+    copy_tag(&hdr[56],gbs2wav_get_tag(h,GBS2WAV_TAG_ARTIST));
+    copy_tag(&hdr[88],h->info.copyright);
+    put_le(&hdr[120],h->trackFrames * 1000 / h->config.sampleRate,4);
+    put_le(&hdr[124],h->fadeFrames * 1000 / h->config.sampleRate,4);
+    put_le(&hdr[128],nameLen,4);
+    put_le(&hdr[132],h->log.len,4);
+
+    f = fopen(filename,"wb");
+    if(f == NULL) return -1;
+    if(fwrite(hdr,1,LOG_HEADER_SIZE,f) != LOG_HEADER_SIZE) goto done;
+    if(fwrite(name,1,nameLen,f) != nameLen) goto done;
+    if(fwrite(h->log.events,1,(size_t)h->log.len,f) != h->log.len) goto done;
+    r = 0;
+
+    done:
+    fclose(f);
+    return r;
+}
+
+int gbs2wav_log_detect(const uint8_t *buf, size_t len) {
+    return len >= LOG_HEADER_SIZE && memcmp(buf,LOG_MAGIC,4) == 0;
+}
+
+/* drops the old table and counts, the hook only runs while profiling */
+void gbs2wav_profile_enable(gbs2wav_t *h, uint64_t intervalCycles) {
+    guest_profile *p = &h->profile;
+
+    if(p->slots != NULL) free(p->slots);
+    p->slots = NULL;
+    p->slotAlloc = 0;
+    memset(&p->totals,0,sizeof(gbs2wav_profile));
+    p->totals.intervalCycles = intervalCycles;
+    p->nextSample = intervalCycles;
+    profile_reset(p);
+    GB_set_execution_callback(&h->gb,intervalCycles ? on_execute : NULL);
+}
+
+void gbs2wav_profile_get(const gbs2wav_t *h, gbs2wav_profile *p) {
+    *p = h->profile.totals;
+}
+
+unsigned int gbs2wav_profile_routines(const gbs2wav_t *h, gbs2wav_routine *dst, unsigned int max) {
+    const guest_profile *p = &h->profile;
+    gbs2wav_routine *all;
+    unsigned int i;
+    unsigned int count = 0;
+
+    if(p->totals.routines == 0 || max == 0) return 0;
+    all = (gbs2wav_routine *)malloc(sizeof(gbs2wav_routine) * p->totals.routines);
+    if(all == NULL) return 0;
+
+    for(i = 0; i < p->slotAlloc; i++) {
+        if(p->slots[i].samples == 0) continue;
+        all[count].bank = (uint16_t)(p->slots[i].key >> 16);
+        all[count].address = (uint16_t)(p->slots[i].key & 0xFFFF);
+        all[count].samples = p->slots[i].samples;
+        count++;
+    }
+    qsort(all,count,sizeof(gbs2wav_routine),routine_compare);
+
+    if(count > max) count = max;
+    memcpy(dst,all,sizeof(gbs2wav_routine) * count);
+    free(all);
+    return count;
+}
+
+/* the emulator struct plus the memory the core allocates for it */
+size_t gbs2wav_resident_size(const gbs2wav_t *h) {
+    static const GB_direct_access_t regions[] = {
+        GB_DIRECT_ACCESS_ROM,
+        GB_DIRECT_ACCESS_RAM,
+        GB_DIRECT_ACCESS_CART_RAM,
+        GB_DIRECT_ACCESS_VRAM,
+    };
+    size_t total = sizeof(gbs2wav_t);
+    size_t size;
+    unsigned int i;
+
+    for(i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        size = 0;
+        GB_get_direct_access((GB_gameboy_t *)&h->gb,regions[i],&size,NULL);
+        total += size;
+    }
+    total += sizeof(int16_t) * GBS2WAV_MAX_CHANNELS * h->carryAlloc * (h->config.stems ? 1 + GBS2WAV_STEM_COUNT : 1);
+    if(h->stemBlock != NULL) total += sizeof(stem_block);
+    return total;
+}
+
+static void on_sample(GB_gameboy_t *gb, GB_sample_t *sample) {
+    int32_t s[GBS2WAV_MAX_CHANNELS];
+    uint64_t n;
+    unsigned int direct;
+    int16_t *d;
+    gbs2wav_t *h = GB_get_user_data(gb);
+
+    if(h->framesPending == 0) return;
+
+    /* fast APU mode: the core renders one sample per apuFactor
+     * output frames, the frames in between are interpolated */
+    n = h->config.apuFactor;
+    if(n > h->framesPending) n = h->framesPending;
+
+    if(h->skipping) {
+        if(h->config.channels == 1) {
+            s[0] = ((int32_t)sample->left + (int32_t)sample->right) / 2;
+            h->lastSample[0] = CLAMP(s[0],-0x8000,0x7FFF);
+        } else {
+            h->lastSample[0] = sample->left;
+            h->lastSample[1] = sample->right;
+        }
+        /* the stem filters have to keep running */
+        if(h->stemsActive) {
+            stems_gather(h,STEM_TO_NOWHERE,n);
+        }
+        h->framesPending -= n;
+        return;
+    }
+
+    direct = h->dstPos + n <= h->dstFrames;
+    d = direct ? &h->dst[h->dstPos * h->config.channels] : h->scratch;
+
+    if(h->config.channels == 1) {
+        s[0] = (int32_t)sample->left;
+        s[0] += (int32_t)sample->right;
+        s[0] /= 2;
+        s[0] = CLAMP(s[0],-0x8000,0x7FFF);
+        if(h->config.apuFactor == 1) {
+            d[0] = (int16_t)s[0];
+        } else {
+            interp_frames_mono(d,h->lastSample[0],s[0],h->apuShift,n);
+        }
+        h->lastSample[0] = s[0];
+    } else {
+        s[0] = sample->left;
+        s[1] = sample->right;
+        if(h->config.apuFactor == 1) {
+            d[0] = (int16_t)s[0];
+            d[1] = (int16_t)s[1];
+        } else {
+            interp_frames_stereo(d,h->lastSample,s,h->apuShift,n);
+        }
+        h->lastSample[0] = s[0];
+        h->lastSample[1] = s[1];
+    }
+
+    if(h->stemsActive) {
+        if(direct) {
+            stems_gather(h,h->dstPos,n);
+        } else {
+            /* spill_frames takes this sample's stems from scratch */
+            stems_flush(h);
+            stems_gather(h,STEM_TO_SCRATCH,n);
+            stems_flush(h);
+        }
+    }
+
+    if(direct) {
+        h->dstPos += n;
+    } else {
+        spill_frames(h,n);
+    }
+    h->framesPending -= n;
+}
+
+/* records one APU sample's stem lanes: each channel's contribution to
+ * the mix from its current amplitude, NR50 volume, NR51 panning and
+ * DAC state. Its frameCount frames (more than one interpolates as in
+ * fast APU mode) go to the stems' dst at pos */
+static void stems_gather(gbs2wav_t *h, uint64_t pos, uint64_t frameCount) {
+    unsigned int i;
+    unsigned int j;
+    GB_gameboy_t *gb = &h->gb;
+    stem_block *b = h->stemBlock;
+    uint8_t nr50 = GB_safe_read_memory(gb, 0xFF24);
+    uint8_t nr51 = GB_safe_read_memory(gb, 0xFF25);
+    int32_t volume[GBS2WAV_MAX_CHANNELS];
+    int32_t *dac = &b->dac[b->count * MIX_STEM_LANES];
+    int32_t *gain = &b->gain[b->count * MIX_STEM_LANES];
+    bool enabled;
+
+    volume[0] = ((nr50 >> 4) & 7) + 1;
+    volume[1] = (nr50 & 7) + 1;
+
+    for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+        if(i == GB_WAVE) {
+            enabled = (GB_safe_read_memory(gb, 0xFF1A) & 0x80) != 0;
+        } else {
+            enabled = (GB_safe_read_memory(gb, 0xFF12 + (i * 5)) & 0xF8) != 0;
+        }
+        for(j = 0; j < GBS2WAV_MAX_CHANNELS; j++) {
+            dac[(i * 2) + j] = enabled ? 0xF - GB_get_channel_amplitude(gb, (GB_channel_t)i) * 2 : 0;
+            gain[(i * 2) + j] = (nr51 & ((0x10 >> (j * 4)) << i)) ? volume[j] * STEM_CH_STEP : 0;
+        }
+    }
+    b->pos[b->count] = pos;
+    b->frames[b->count] = (unsigned int)frameCount;
+    b->count++;
+    if(b->count == STEM_BLOCK_SAMPLES) stems_flush(h);
+}
+
+/* mixes the gathered samples and runs them through the same highpass
+ * as the APU (none in draft quality), all lanes and samples in one
+ * kernel call, then writes each sample's frames out */
+static void stems_flush(gbs2wav_t *h) {
+    unsigned int i;
+    unsigned int k;
+    stem_block *b = h->stemBlock;
+    int32_t *s;
+    stem_state *stem;
+    int16_t *d;
+
+    if(b == NULL || b->count == 0) return;
+    h->mix->stems(b->out,b->dac,b->gain,h->stemCapacitor,h->highpassRate,
+      h->config.quality != GBS2WAV_QUALITY_DRAFT,b->count);
+
+    for(k = 0; k < b->count; k++) {
+        for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+            stem = &h->stems[i];
+            s = &b->out[(k * MIX_STEM_LANES) + (i * 2)];
+            if(h->config.channels == 1) s[0] = (s[0] + s[1]) / 2;
+
+            if(b->pos[k] != STEM_TO_NOWHERE) {
+                d = b->pos[k] == STEM_TO_SCRATCH ? stem->scratch : &stem->dst[b->pos[k] * h->config.channels];
+                if(h->config.channels == 1) {
+                    if(b->frames[k] == 1) {
+                        d[0] = (int16_t)CLAMP(s[0],-0x8000,0x7FFF);
+                    } else {
+                        interp_frames_mono(d,stem->lastSample[0],s[0],h->apuShift,b->frames[k]);
+                    }
+                } else {
+                    if(b->frames[k] == 1) {
+                        d[0] = (int16_t)CLAMP(s[0],-0x8000,0x7FFF);
+                        d[1] = (int16_t)CLAMP(s[1],-0x8000,0x7FFF);
+                    } else {
+                        interp_frames_stereo(d,stem->lastSample,s,h->apuShift,b->frames[k]);
+                    }
+                }
+            }
+            stem->lastSample[0] = s[0];
+            stem->lastSample[1] = s[1];
+        }
+    }
+    b->count = 0;
+}
+
+/* splits frames from scratch between what's left of dst and the
+ * carry buffer */
+static void spill_frames(gbs2wav_t *h, uint64_t frameCount) {
+    unsigned int i;
+    unsigned int streams = h->stemsActive ? 1 + GBS2WAV_STEM_COUNT : 1;
+    unsigned int channels = h->config.channels;
+    uint64_t fit = h->dstFrames - h->dstPos;
+    uint64_t rest = frameCount - fit;
+    uint64_t alloc;
+    int16_t *t;
+    const int16_t *src;
+    int16_t *dst;
+
+    if(h->carryFrames + rest > h->carryAlloc) {
+        alloc = h->carryAlloc ? h->carryAlloc * 2 : GBS2WAV_MAX_APU_FACTOR * 16;
+        while(alloc < h->carryFrames + rest) alloc *= 2;
+        for(i = 0; i < 1 + GBS2WAV_STEM_COUNT; i++) {
+            if(i > 0 && !h->config.stems) break;
+            t = (int16_t *)realloc(h->carry[i],sizeof(int16_t) * GBS2WAV_MAX_CHANNELS * alloc);
+            /* nowhere to put them: drop the frames, the track then
+             * ends early with render returning 0 */
+            if(t == NULL) {
+                rest = 0;
+                break;
+            }
+            h->carry[i] = t;
+        }
+        if(rest) h->carryAlloc = alloc;
+    }
+
+    for(i = 0; i < streams; i++) {
+        src = i == 0 ? h->scratch : h->stems[i - 1].scratch;
+        dst = i == 0 ? h->dst : h->stems[i - 1].dst;
+        memcpy(&dst[h->dstPos * channels],src,sizeof(int16_t) * channels * fit);
+        if(rest) {
+            memcpy(&h->carry[i][h->carryFrames * channels],&src[fit * channels],sizeof(int16_t) * channels * rest);
+        }
+    }
+    h->dstPos += fit;
+    h->carryFrames += rest;
+}
+
+/* moves up to frames carried-over frames into dst, returns how many */
+static uint64_t drain_carry(gbs2wav_t *h, uint64_t frames) {
+    unsigned int i;
+    unsigned int streams = h->stemsActive ? 1 + GBS2WAV_STEM_COUNT : 1;
+    unsigned int channels = h->config.channels;
+    uint64_t count = h->carryFrames < frames ? h->carryFrames : frames;
+    int16_t *dst;
+
+    if(count == 0) return 0;
+
+    for(i = 0; i < streams; i++) {
+        dst = i == 0 ? h->dst : h->stems[i - 1].dst;
+        memcpy(dst,h->carry[i],sizeof(int16_t) * channels * count);
+        memmove(h->carry[i],&h->carry[i][count * channels],sizeof(int16_t) * channels * (h->carryFrames - count));
+    }
+    h->carryFrames -= count;
+    return count;
+}
+
+static int index_alloc(seek_index *x, size_t stateSize) {
+    if(x->base != NULL && x->stateSize == stateSize) return 0;
+    if(x->base != NULL) free(x->base);
+    if(x->work != NULL) free(x->work);
+    if(x->encoded != NULL) free(x->encoded);
+    x->stateSize = stateSize;
+    x->base = (uint8_t *)malloc(stateSize);
+    x->work = (uint8_t *)malloc(stateSize);
+    /* worst case: all literals, with a pair of varints per run */
+    x->encoded = (uint8_t *)malloc(stateSize + stateSize / DELTA_MIN_ZERO_RUN * 2 + 32);
+    if(x->base == NULL || x->work == NULL || x->encoded == NULL) {
+        /* so the next call tries again rather than finding base set */
+        if(x->base != NULL) free(x->base);
+        if(x->work != NULL) free(x->work);
+        if(x->encoded != NULL) free(x->encoded);
+        x->base = NULL;
+        x->work = NULL;
+        x->encoded = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void index_free(seek_index *x) {
+    if(x->base != NULL) free(x->base);
+    if(x->work != NULL) free(x->work);
+    if(x->encoded != NULL) free(x->encoded);
+    if(x->entries != NULL) free(x->entries);
+    if(x->blob != NULL) free(x->blob);
+    memset(x,0,sizeof(seek_index));
+}
+
+/* snapshots the track once it's past the next mark. Only between
+ * GB_runs with nothing carried over, so the snapshot sits exactly on
+ * the frames produced so far */
+static void index_capture(gbs2wav_t *h) {
+    seek_index *x = &h->index;
+    uint64_t pos = h->trackFrames - h->framesPending;
+    uint64_t len;
+    uint64_t allowed;
+    void *t;
+
+    if(pos < x->nextMark || h->carryFrames != 0) return;
+    while(x->nextMark <= pos) x->nextMark += x->intervalFrames;
+
+    if(gbs2wav_save_state(h,x->work) != 0) return;
+    len = delta_encode(x->encoded,x->work,x->count ? x->base : NULL,x->stateSize);
+
+    /* the first snapshot is always kept, it's what the others are
+     * relative to */
+    if(x->count) {
+        allowed = (uint64_t)x->bytesPerMinute * (pos / ((uint64_t)h->config.sampleRate * 60) + 1);
+        if(gbs2wav_index_bytes(h) + sizeof(index_entry) + len > allowed) return;
+    } else {
+        memcpy(x->base,x->work,x->stateSize);
+    }
+
+    if(x->count == x->alloc) {
+        t = realloc(x->entries,sizeof(index_entry) * (x->alloc ? x->alloc * 2 : 16));
+        if(t == NULL) return;
+        x->entries = (index_entry *)t;
+        x->alloc = x->alloc ? x->alloc * 2 : 16;
+    }
+    if(x->blobLen + len > x->blobAlloc) {
+        t = realloc(x->blob,(size_t)((x->blobLen + len) * 2));
+        if(t == NULL) return;
+        x->blob = (uint8_t *)t;
+        x->blobAlloc = (x->blobLen + len) * 2;
+    }
+
+    memcpy(&x->blob[x->blobLen],x->encoded,(size_t)len);
+    x->entries[x->count].position = pos;
+    x->entries[x->count].offset = x->blobLen;
+    x->entries[x->count].length = len;
+    x->blobLen += len;
+    x->count++;
+}
+
+static int index_restore(gbs2wav_t *h, unsigned int e) {
+    seek_index *x = &h->index;
+    const index_entry *entry = &x->entries[e];
+
+    if(e == 0) {
+        memcpy(x->work,x->base,x->stateSize);
+    } else if(delta_decode(x->work,&x->blob[entry->offset],entry->length,x->base,x->stateSize) != 0) {
+        return -1;
+    }
+    return gbs2wav_load_state(h,x->work,x->stateSize);
+}
+
+static bool on_write(GB_gameboy_t *gb, uint16_t addr, uint8_t data) {
+    gbs2wav_t *h = GB_get_user_data(gb);
+    apu_log *l = &h->log;
+    uint8_t *d;
+    void *t;
+
+    if(addr < LOG_REG_FIRST || addr > LOG_REG_LAST || l->broken) return true;
+
+    /* a varint of up to 10 bytes, the register and the value */
+    if(l->len + 12 > l->alloc) {
+        t = realloc(l->events,(size_t)(l->alloc ? l->alloc * 2 : 4096));
+        if(t == NULL) {
+            l->broken = 1;
+            return true;
+        }
+        l->events = (uint8_t *)t;
+        l->alloc = l->alloc ? l->alloc * 2 : 4096;
+    }
+
+    d = put_varint(&l->events[l->len],h->cycles - l->last);
+    *d++ = (uint8_t)(addr - LOG_REG_FIRST);
+    *d++ = data;
+    l->len = (uint64_t)(d - l->events);
+    l->last = h->cycles;
+    return true;
+}
+
+static int log_parse(apu_log *l, const uint8_t *buf, size_t len) {
+    uint64_t nameLen;
+
+    if(get_le(&buf[4],4) != LOG_VERSION) return -1;
+    l->model = (unsigned int)get_le(&buf[8],4);
+    l->number = (unsigned int)get_le(&buf[12],4);
+    l->cycles = get_le(&buf[16],8);
+    l->lengthMs = (uint32_t)get_le(&buf[120],4);
+    l->fadeMs = (uint32_t)get_le(&buf[124],4);
+    nameLen = get_le(&buf[128],4);
+    l->len = get_le(&buf[132],4);
+    if(nameLen > LOG_NAME_MAX || LOG_HEADER_SIZE + nameLen + l->len != len) return -1;
+    if(gbs2wav_model_name((int)l->model) == NULL) return -1;
+
+    l->name = (char *)malloc((size_t)nameLen + 1);
+    /* never empty, so replay handles can be told apart */
+    l->events = (uint8_t *)malloc((size_t)l->len + 1);
+    if(l->name == NULL || l->events == NULL) return -1;
+    memcpy(l->name,&buf[LOG_HEADER_SIZE],(size_t)nameLen);
+    l->name[nameLen] = '\0';
+    memcpy(l->events,&buf[LOG_HEADER_SIZE + nameLen],(size_t)l->len);
+    l->alloc = l->len;
+    return 0;
+}
+
+/* back to the first event, at the start of a track */
+static void log_reset(gbs2wav_t *h) {
+    apu_log *l = &h->log;
+
+    l->pos = 0;
+    l->next = UINT64_MAX;
+    if(!h->replay) return;
+    if(get_varint(l->events,l->events + l->len,&l->next) == NULL) {
+        l->next = UINT64_MAX;
+    }
+}
+
+/* writes out every event due by now. Each sits at the cycle count of
+ * the GB_run it was captured in, so it goes in ahead of the same run */
+static void log_replay(gbs2wav_t *h) {
+    apu_log *l = &h->log;
+    const uint8_t *end = l->events + l->len;
+    const uint8_t *s = l->events + l->pos;
+    uint64_t delta;
+
+    while(l->next <= h->cycles) {
+        /* skip the varint that brought us here */
+        while(s < end && (*s++ & 0x80)) { }
+        if(end - s < 2) {
+            l->next = UINT64_MAX;
+            break;
+        }
+        GB_write_memory(&h->gb,(uint16_t)(LOG_REG_FIRST + s[0]),s[1]);
+        s += 2;
+        l->pos = (uint64_t)(s - l->events);
+        if(get_varint(s,end,&delta) == NULL) {
+            l->next = UINT64_MAX;
+            break;
+        }
+        l->next += delta;
+    }
+}
+
+/* called before each instruction. Calls, rsts and interrupts push
+ * the routine they enter, returns pop it, and the phase follows the
+ * init and play addresses and HALT */
+static void on_execute(GB_gameboy_t *gb, uint16_t address, uint8_t opcode) {
+    gbs2wav_t *h = GB_get_user_data(gb);
+    guest_profile *p = &h->profile;
+    unsigned int len;
+    unsigned int kind = branch_kind(p->lastOpcode,&len);
+    unsigned int taken = address != (uint16_t)(p->lastAddress + len);
+    unsigned int vector = address >= PROFILE_VECTOR_FIRST
+      && address < PROFILE_VECTOR_FIRST + (GBS2WAV_INTERRUPT_COUNT * PROFILE_VECTOR_STEP)
+      && (address & (PROFILE_VECTOR_STEP - 1)) == 0;
+
+    /* a vector reached other than by a branch is a dispatch */
+    if(vector && kind == BRANCH_NONE && taken) {
+        p->totals.interrupts[(address - PROFILE_VECTOR_FIRST) / PROFILE_VECTOR_STEP]++;
+        kind = BRANCH_CALL;
+    }
+
+    if(kind == BRANCH_CALL && taken) {
+        if(p->depth < PROFILE_STACK_DEPTH) {
+            p->stack[p->depth++] = routine_key(h,address);
+        } else {
+            p->overflow++;
+        }
+    } else if(kind == BRANCH_RET && taken) {
+        if(p->overflow) {
+            p->overflow--;
+        } else if(p->depth) {
+            p->depth--;
+        }
+    }
+
+    /* drivers idle halted at the top level, which is also where a
+     * stack thrown off by a driver's own stack tricks comes right */
+    if(opcode == OP_HALT) {
+        p->phase = GBS2WAV_PHASE_HALT;
+        p->depth = 0;
+        p->overflow = 0;
+    } else if(address == p->playAddress) {
+        p->phase = GBS2WAV_PHASE_PLAY;
+    } else if(address == p->initAddress) {
+        p->phase = GBS2WAV_PHASE_INIT;
+    } else if(p->phase == GBS2WAV_PHASE_HALT) {
+        p->phase = GBS2WAV_PHASE_OTHER;
+    }
+
+    p->lastAddress = address;
+    p->lastOpcode = opcode;
+}
+
+/* what a control flow opcode does, and its length for telling
+ * whether a conditional one was taken */
+static unsigned int branch_kind(uint8_t opcode, unsigned int *len) {
+    *len = 1;
+    switch(opcode) {
+        case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC: {
+            *len = 3;
+            return BRANCH_CALL;
+        }
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF:
+        case 0xE7: case 0xEF: case 0xF7: case 0xFF: {
+            return BRANCH_CALL;
+        }
+        case 0xC9: case 0xD9: case 0xC0: case 0xC8: case 0xD0: case 0xD8: {
+            return BRANCH_RET;
+        }
+        case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA: {
+            *len = 3;
+            return BRANCH_JUMP;
+        }
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: {
+            *len = 2;
+            return BRANCH_JUMP;
+        }
+        case 0xE9: return BRANCH_JUMP;
+        default: break;
+    }
+    return BRANCH_NONE;
+}
+
+/* switchable ROM addresses carry the bank mapped in */
+static uint32_t routine_key(gbs2wav_t *h, uint16_t address) {
+    uint16_t bank = 0;
+    size_t size;
+
+    if(address >= 0x4000 && address < 0x8000) {
+        GB_get_direct_access(&h->gb,GB_DIRECT_ACCESS_ROM,&size,&bank);
+    }
+    return ((uint32_t)bank << 16) | address;
+}
+
+static void profile_reset(guest_profile *p) {
+    p->phase = GBS2WAV_PHASE_OTHER;
+    p->lastAddress = 0;
+    p->lastOpcode = 0;
+    p->depth = 0;
+    p->overflow = 0;
+}
+
+/* the cycles of a GB_run go to the phase its last instruction was
+ * in, and each sample mark crossed counts for the routine running */
+static void profile_step(gbs2wav_t *h, uint64_t cycles) {
+    guest_profile *p = &h->profile;
+    uint64_t weight;
+
+    p->totals.cycles += cycles;
+    p->totals.phaseCycles[p->phase] += cycles;
+    if(p->nextSample > p->totals.cycles) return;
+
+    weight = (p->totals.cycles - p->nextSample) / p->totals.intervalCycles + 1;
+    p->nextSample += weight * p->totals.intervalCycles;
+    p->totals.samples += weight;
+    profile_sample(h,weight);
+}
+
+/* the innermost routine entered, or the PC outside of any. Samples
+ * taken halted only count towards the HALT phase */
+static void profile_sample(gbs2wav_t *h, uint64_t weight) {
+    guest_profile *p = &h->profile;
+    uint32_t key;
+    unsigned int i;
+
+    if(p->phase == GBS2WAV_PHASE_HALT) return;
+    if(p->depth) {
+        key = p->stack[p->depth - 1];
+    } else {
+        key = routine_key(h,GB_get_registers(&h->gb)->pc);
+    }
+
+    if( (p->totals.routines + 1) * 4 > p->slotAlloc * 3) {
+        if(profile_grow(p) != 0) return;
+    }
+    i = (key * 2654435761U) & (p->slotAlloc - 1);
+    while(p->slots[i].samples && p->slots[i].key != key) {
+        i = (i + 1) & (p->slotAlloc - 1);
+    }
+    if(p->slots[i].samples == 0) {
+        p->slots[i].key = key;
+        p->totals.routines++;
+    }
+    p->slots[i].samples += weight;
+}
+
+static int profile_grow(guest_profile *p) {
+    profile_slot *slots;
+    unsigned int alloc = p->slotAlloc ? p->slotAlloc * 2 : PROFILE_TABLE_MIN;
+    unsigned int i;
+    unsigned int j;
+
+    slots = (profile_slot *)calloc(alloc,sizeof(profile_slot));
+    if(slots == NULL) return -1;
+    for(i = 0; i < p->slotAlloc; i++) {
+        if(p->slots[i].samples == 0) continue;
+        j = (p->slots[i].key * 2654435761U) & (alloc - 1);
+        while(slots[j].samples) j = (j + 1) & (alloc - 1);
+        slots[j] = p->slots[i];
+    }
+    if(p->slots != NULL) free(p->slots);
+    p->slots = slots;
+    p->slotAlloc = alloc;
+    return 0;
+}
+
+/* most samples first, then by bank and address */
+static int routine_compare(const void *a, const void *b) {
+    const gbs2wav_routine *x = (const gbs2wav_routine *)a;
+    const gbs2wav_routine *y = (const gbs2wav_routine *)b;
+
+    if(x->samples != y->samples) return x->samples > y->samples ? -1 : 1;
+    if(x->bank != y->bank) return x->bank < y->bank ? -1 : 1;
+    if(x->address != y->address) return x->address < y->address ? -1 : 1;
+    return 0;
+}
+
+static uint8_t *put_varint(uint8_t *d, uint64_t n) {
+    while(n >= 0x80) {
+        *d++ = (uint8_t)(n | 0x80);
+        n >>= 7;
+    }
+    *d++ = (uint8_t)n;
+    return d;
+}
+
+static const uint8_t *get_varint(const uint8_t *s, const uint8_t *end, uint64_t *n) {
+    unsigned int shift = 0;
+    *n = 0;
+    while(s < end && shift < 64) {
+        *n |= (uint64_t)(*s & 0x7F) << shift;
+        if(!(*s++ & 0x80)) return s;
+        shift += 7;
+    }
+    return NULL;
+}
+
+/* XORs cur against ref (NULL = zeros) and run-length encodes the
+ * result as pairs of varint zero-run and literal lengths, each
+ * followed by its literal bytes. Returns the encoded length */
+static uint64_t delta_encode(uint8_t *out, const uint8_t *cur, const uint8_t *ref, size_t len) {
+    uint8_t *d = out;
+    size_t i = 0;
+    size_t zeros;
+    size_t lit;
+    size_t run;
+
+    while(i < len) {
+        zeros = 0;
+        while(i + zeros < len && (cur[i + zeros] ^ (ref ? ref[i + zeros] : 0)) == 0) zeros++;
+        i += zeros;
+
+        /* a literal runs until DELTA_MIN_ZERO_RUN zero bytes in a row */
+        lit = 0;
+        run = 0;
+        while(i + lit + run < len && run < DELTA_MIN_ZERO_RUN) {
+            if((cur[i + lit + run] ^ (ref ? ref[i + lit + run] : 0)) == 0) {
+                run++;
+            } else {
+                lit += run + 1;
+                run = 0;
+            }
+        }
+
+        d = put_varint(d,zeros);
+        d = put_varint(d,lit);
+        while(lit--) {
+            *d++ = cur[i] ^ (ref ? ref[i] : 0);
+            i++;
+        }
+    }
+    return (uint64_t)(d - out);
+}
+
+static int delta_decode(uint8_t *out, const uint8_t *in, uint64_t inLen, const uint8_t *ref, size_t len) {
+    const uint8_t *end = in + inLen;
+    size_t i = 0;
+    uint64_t zeros;
+    uint64_t lit;
+
+    while(in < end) {
+        in = get_varint(in,end,&zeros);
+        if(in == NULL) return -1;
+        in = get_varint(in,end,&lit);
+        if(in == NULL) return -1;
+        if(zeros > len - i || lit > len - i - zeros || lit > (uint64_t)(end - in)) return -1;
+
+        while(zeros--) {
+            out[i] = ref ? ref[i] : 0;
+            i++;
+        }
+        while(lit--) {
+            out[i] = *in++ ^ (ref ? ref[i] : 0);
+            i++;
+        }
+    }
+    while(i < len) {
+        out[i] = ref ? ref[i] : 0;
+        i++;
+    }
+    return 0;
+}
+
+/* drops up to frames carried-over frames, returns how many */
+static uint64_t discard_carry(gbs2wav_t *h, uint64_t frames) {
+    unsigned int i;
+    unsigned int channels = h->config.channels;
+    uint64_t count = h->carryFrames < frames ? h->carryFrames : frames;
+
+    if(count == 0) return 0;
+
+    for(i = 0; i < 1 + GBS2WAV_STEM_COUNT; i++) {
+        if(h->carry[i] == NULL) continue;
+        memmove(h->carry[i],&h->carry[i][count * channels],sizeof(int16_t) * channels * (h->carryFrames - count));
+    }
+    h->carryFrames -= count;
+    return count;
+}
+
+/* value of the first @KEY tag found in each comment line at the top of
+ * the M3U. A first comment line without a tag is the album title */
+static int scan_m3u_tags(gbs2wav_t *h, const char *m3uData, unsigned int m3uSize) {
+    nez_m3u_t m3u;
+    unsigned int i = 0;
+    unsigned int t;
+    int tag;
+    char *line = NULL;
+    size_t lineAlloc = 0;
+    char *c = NULL;
+    char *val;
+
+    nez_m3u_init(&m3u);
+    while(nez_m3u_parse(&m3u,m3uData,m3uSize) != 0 && m3u.linetype == NEZ_M3U_COMMENT) {
+        if(lineAlloc < m3u.linelength + 1) {
+            c = realloc(line,m3u.linelength + 1);
+            if(c == NULL) goto fail;
+            line = c;
+            lineAlloc = m3u.linelength + 1;
+        }
+        memcpy(line,&m3u.line[0],m3u.linelength);
+        line[m3u.linelength] = '\0';
+
+        tag = -1;
+        for(t = 0; t < M3U_TAG_COUNT; t++) {
+            if( (c = strstr(line,m3u_tag_keys[t])) != NULL) {
+                c += strlen(m3u_tag_keys[t]);
+                if(*c == ':' || *c == '@') c++;
+                tag = (int)t;
+                break;
+            }
+        }
+        /* a track's start offset, not the album title */
+        if(tag == -1 && strstr(line,M3U_START_KEY) != NULL) {
+            i++;
+            continue;
+        }
+        if(tag == -1 && i == 0) {
+            c = line;
+            while(*c && *c == '#') c++;
+            tag = GBS2WAV_TAG_TITLE;
+        }
+        i++;
+        if(tag == -1) continue;
+
+        while(*c && *c == ' ') c++;
+        if(!*c) continue;
+
+        val = (char *)malloc(strlen(c) + 1);
+        if(val == NULL) goto fail;
+        memcpy(val,c,strlen(c) + 1);
+        if(h->tags[tag] != NULL) free(h->tags[tag]);
+        h->tags[tag] = val;
+    }
+
+    if(line != NULL) free(line);
+    return 0;
+
+    fail:
+    if(line != NULL) free(line);
+    return -1;
+}
+
+int gbs2wav_plan(const uint8_t *gbs, size_t gbsLen, const char *m3u, size_t m3uLen, gbs2wav_plan_track **tracks) {
+    GB_gbs_info_t info;
+
+    *tracks = NULL;
+    if(gbsLen < GBS_HEADER_SIZE || memcmp(gbs,"GBS",3) != 0 || gbs[3] != 1) return -1;
+
+    /* the fields GB_load_gbs_from_buffer fills in, read the same way */
+    memset(&info,0,sizeof(GB_gbs_info_t));
+    info.track_count = gbs[0x04];
+    info.first_track = (uint8_t)(gbs[0x05] - 1);
+    if(info.first_track >= info.track_count) info.first_track = 0;
+    memcpy(info.title,&gbs[0x10],32);
+
+    return plan_m3u(&info,m3u,(unsigned int)m3uLen,tracks);
+}
+
+void gbs2wav_plan_free(gbs2wav_plan_track *tracks, int count) {
+    int i;
+
+    if(tracks == NULL) return;
+    for(i = 0; i < count; i++) {
+        free(tracks[i].name);
+    }
+    free(tracks);
+}
+
+/* the planned tracks in frames at the config's sample rate */
+static int plan_tracks(gbs2wav_t *h, const char *m3uData, unsigned int m3uSize) {
+    int i;
+    int count;
+    uint64_t sampleRate = h->config.sampleRate;
+    uint64_t start;
+    gbs2wav_plan_track *plan;
+    track_plan *entry;
+
+    count = plan_m3u(&h->info,m3uData,m3uSize,&plan);
+    if(count <= 0) {
+        gbs2wav_plan_free(plan,0);
+        return count;
+    }
+
+    h->tracks = (track_plan *)malloc(sizeof(track_plan) * (size_t)count);
+    if(h->tracks == NULL) {
+        gbs2wav_plan_free(plan,count);
+        return -1;
+    }
+
+    for(i = 0; i < count; i++) {
+        entry = &h->tracks[h->trackCount++];
+        entry->number = plan[i].number;
+        entry->song = plan[i].song;
+        entry->fadeFrames = (uint64_t)plan[i].fadeMs * sampleRate / 1000;
+        entry->totalFrames = (uint64_t)plan[i].lengthMs * sampleRate / 1000 + entry->fadeFrames;
+        start = (uint64_t)plan[i].startMs * sampleRate / 1000;
+        if(start >= entry->totalFrames) start = entry->totalFrames ? entry->totalFrames - 1 : 0;
+        entry->startFrames = start;
+        entry->name = plan[i].name;
+        plan[i].name = NULL;
+    }
+
+    gbs2wav_plan_free(plan,count);
+    return 0;
+}
+
+/* walks the M3U (or the GBS header when there's none) for the tracks
+ * to render. Returns the count, or -1 */
+static int plan_m3u(const GB_gbs_info_t *info, const char *m3uData, unsigned int m3uSize, gbs2wav_plan_track **tracks) {
+    unsigned int i;
+    unsigned int t;
+    int count = 0;
+    uint32_t start;
+    uint32_t ms;
+    gbs2wav_plan_track *list;
+    gbs2wav_plan_track *entry;
+    nez_m3u_t m3u;
+
+    *tracks = NULL;
+    if(info->first_track >= info->track_count) return 0;
+
+    list = (gbs2wav_plan_track *)malloc(sizeof(gbs2wav_plan_track) * (info->track_count - info->first_track));
+    if(list == NULL) return -1;
+
+    if(m3uData != NULL) {
+        nez_m3u_init(&m3u);
+    }
+
+    i = info->first_track;
+    while(i < info->track_count) {
+        entry = &list[count];
+        entry->number = i + 1;
+        entry->startMs = 0;
+        t = 0;
+
+        if(m3uData == NULL) {
+            entry->song = i;
+            entry->lengthMs = DEFAULT_LENGTH_MS;
+            entry->fadeMs = DEFAULT_FADE_MS;
+        } else {
+            start = 0;
+            if(nez_m3u_parse(&m3u,m3uData,m3uSize) == 0) break;
+            while(m3u.linetype != NEZ_M3U_TRACK) {
+                if(m3u.linetype == NEZ_M3U_COMMENT && (ms = m3u_start_ms(&m3u)) != 0) {
+                    start = ms;
+                }
+                if(nez_m3u_parse(&m3u,m3uData,m3uSize) == 0) break;
+            }
+            if(m3u.linetype != NEZ_M3U_TRACK) break;
+
+            entry->song = m3u.tracknum;
+            t = nez_m3u_title(&m3u, NULL, 0);
+            if(m3u.length != -1) {
+                entry->lengthMs = (uint32_t)m3u.length;
+            } else {
+                entry->lengthMs = m3u.fade == -1 ? DEFAULT_LENGTH_MS : DEFAULT_FADED_LENGTH_MS;
+            }
+            entry->fadeMs = m3u.fade != -1 ? (uint32_t)m3u.fade : DEFAULT_FADE_MS;
+            entry->startMs = start;
+        }
+
+        if(t > 0) {
+            entry->name = (char *)malloc(t + 1);
+            if(entry->name == NULL) goto fail;
+            nez_m3u_title(&m3u,entry->name,t + 1);
+        } else {
+            t = (unsigned int)snprintf(NULL,0,"%s %03d/%03d", info->title,entry->song + 1,info->track_count);
+            entry->name = (char *)malloc(t + 1);
+            if(entry->name == NULL) goto fail;
+            snprintf(entry->name,t + 1,"%s %03d/%03d", info->title,entry->song + 1,info->track_count);
+        }
+
+        count++;
+        i++;
+    }
+
+    *tracks = list;
+    return count;
+
+    fail:
+    gbs2wav_plan_free(list,count);
+    return -1;
+}
+
+/* milliseconds for a "# @START m:ss.ms" comment line, 0 without one */
+static uint32_t m3u_start_ms(const nez_m3u_t *m3u) {
+    unsigned int keyLen = (unsigned int)strlen(M3U_START_KEY);
+    unsigned int i = 0;
+    int ms = 0;
+
+    while(i + keyLen <= m3u->linelength && memcmp(&m3u->line[i],M3U_START_KEY,keyLen) != 0) i++;
+    if(i + keyLen > m3u->linelength) return 0;
+    i += keyLen;
+    while(i < m3u->linelength && (m3u->line[i] == ' ' || m3u->line[i] == ':')) i++;
+
+    if(nez_m3u_parse_timestamp(&ms,&m3u->line[i],m3u->linelength - i) == 0 || ms < 0) return 0;
+    return (uint32_t)ms;
+}
+
+/* fades the frames of a render block, anything past the end of the
+ * track is zeroed */
+static void fade_frames(gbs2wav_t *h, int16_t *data, uint64_t frameCount) {
+    uint64_t framesRem = h->framesLeft;
+    uint64_t framesFade = h->fadeFrames;
+    unsigned int channels = h->config.channels;
+    uint64_t i = 0;
+    uint64_t f = framesFade;
+
+    if(framesRem > framesFade) {
+        i = framesRem - framesFade;
+        f += i;
+    } else {
+        f = framesRem;
+    }
+
+    if(i < frameCount && f > i) {
+        h->mix->fade(&data[i * channels],channels,f - i,framesFade,
+          (f < frameCount ? f : frameCount) - i);
+        i = f;
+    }
+
+    if(i < frameCount) {
+        memset(&data[i * channels],0,sizeof(int16_t) * channels * (frameCount - i));
+    }
+
+    return;
+}
+
+/* linear ramp from prev (exclusive) to cur (inclusive) across
+ * 1 << shift frames, only the first frameCount are written */
+static void interp_frames_mono(int16_t *d, int32_t prev, int32_t cur, unsigned int shift, uint64_t frameCount) {
+    uint64_t i = 0;
+    int32_t delta = cur - prev;
+    while(i<frameCount) {
+        d[i] = (int16_t)(prev + ((delta * (int32_t)(i + 1)) >> shift));
+        i++;
+    }
+}
+
+static void interp_frames_stereo(int16_t *d, const int32_t *prev, const int32_t *cur, unsigned int shift, uint64_t frameCount) {
+    uint64_t i = 0;
+    int32_t dl = cur[0] - prev[0];
+    int32_t dr = cur[1] - prev[1];
+    while(i<frameCount) {
+        d[(i*2)+0] = (int16_t)(prev[0] + ((dl * (int32_t)(i + 1)) >> shift));
+        d[(i*2)+1] = (int16_t)(prev[1] + ((dr * (int32_t)(i + 1)) >> shift));
+        i++;
+    }
+}
@@ -0,0 +1,305 @@
+#ifndef LIBGBS2WAV_H
+#define LIBGBS2WAV_H
+
+/* libgbs2wav - render GBS tracks to 16-bit PCM.
+ *
+ * A handle owns one emulator instance, the parsed M3U track list and
+ * its tags. Handles share no state, so separate handles can be used
+ * from separate threads at the same time. PCM is written straight
+ * into caller-owned buffers, already faded. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GBS2WAV_DEFAULT_SAMPLE_RATE 48000
+#define GBS2WAV_MAX_CHANNELS 2
+#define GBS2WAV_MAX_APU_FACTOR 64
+
+/* one stem per APU channel */
+#define GBS2WAV_STEM_COUNT 4
+
+typedef struct gbs2wav_s gbs2wav_t;
+
+typedef enum gbs2wav_tag {
+    /* from the M3U. TITLE and ARTIST fall back to the GBS header,
+     * returning the same pointer as GBS_TITLE and GBS_AUTHOR */
+    GBS2WAV_TAG_TITLE,
+    GBS2WAV_TAG_ARTIST,
+    GBS2WAV_TAG_COMPOSER,
+    GBS2WAV_TAG_DATE,
+    GBS2WAV_TAG_RIPPER,
+    GBS2WAV_TAG_TAGGER,
+    /* straight from the GBS header */
+    GBS2WAV_TAG_GBS_TITLE,
+    GBS2WAV_TAG_GBS_AUTHOR,
+    GBS2WAV_TAG_GBS_COPYRIGHT,
+    GBS2WAV_TAG_COUNT
+} gbs2wav_tag;
+
+/* fidelity/speed presets for the APU's filtering and synthesis, the
+ * core has no separate resampler setting */
+typedef enum gbs2wav_quality {
+    /* highpass and interference emulation off, fast APU at 4x */
+    GBS2WAV_QUALITY_DRAFT,
+    /* the core's default settings */
+    GBS2WAV_QUALITY_STANDARD,
+    /* accurate highpass and interference emulation */
+    GBS2WAV_QUALITY_MASTER,
+    GBS2WAV_QUALITY_COUNT
+} gbs2wav_quality;
+
+/* instruction sets for the renderer's stem mix, highpass and fade.
+ * Every level produces bit-identical output, they only differ in
+ * speed */
+typedef enum gbs2wav_simd {
+    /* the best the CPU supports */
+    GBS2WAV_SIMD_AUTO,
+    GBS2WAV_SIMD_SCALAR,
+    GBS2WAV_SIMD_SSE2,
+    GBS2WAV_SIMD_AVX2,
+    GBS2WAV_SIMD_COUNT
+} gbs2wav_simd;
+
+/* where the guest CPU's time goes, see gbs2wav_profile_enable */
+typedef enum gbs2wav_phase {
+    /* from the init address until the CPU halts */
+    GBS2WAV_PHASE_INIT,
+    /* from the play address until the CPU halts */
+    GBS2WAV_PHASE_PLAY,
+    GBS2WAV_PHASE_HALT,
+    /* anything else, like interrupt vectors and the code around init
+     * and play */
+    GBS2WAV_PHASE_OTHER,
+    GBS2WAV_PHASE_COUNT
+} gbs2wav_phase;
+
+/* VBlank, STAT, timer, serial and joypad */
+#define GBS2WAV_INTERRUPT_COUNT 5
+
+typedef struct gbs2wav_config {
+    /* from gbs2wav_model_lookup */
+    int model;
+    unsigned int sampleRate;
+    /* 1 downmixes to mono */
+    unsigned int channels;
+    /* fast APU: synthesize one sample per apuFactor frames and
+     * interpolate the rest, a power of two, 1 = off */
+    unsigned int apuFactor;
+    /* non-zero to allow gbs2wav_render_ex to produce stems */
+    unsigned int stems;
+    gbs2wav_quality quality;
+    /* the instruction set for the renderer's mixing. It doesn't change
+     * the output, so snapshots and seek indexes load whatever it is */
+    gbs2wav_simd simd;
+} gbs2wav_config;
+
+void gbs2wav_config_init(gbs2wav_config *c);
+
+/* sets the quality and the fast APU factor that goes with it */
+void gbs2wav_config_set_quality(gbs2wav_config *c, gbs2wav_quality q);
+
+/* returns a gbs2wav_quality, or -1 for an unknown name */
+int gbs2wav_quality_lookup(const char *name);
+const char *gbs2wav_quality_name(int quality);
+
+/* returns a gbs2wav_simd, or -1 for an unknown name */
+int gbs2wav_simd_lookup(const char *name);
+const char *gbs2wav_simd_name(int simd);
+
+/* non-zero when the build and the CPU have it. gbs2wav_open fails
+ * for a config whose simd isn't supported */
+int gbs2wav_simd_supported(gbs2wav_simd simd);
+
+/* the level handles opened with c use, never GBS2WAV_SIMD_AUTO */
+gbs2wav_simd gbs2wav_simd_level(const gbs2wav_config *c);
+
+/* returns a model for gbs2wav_config, or -1 for an unknown name */
+int gbs2wav_model_lookup(const char *name);
+const char *gbs2wav_model_name(int model);
+
+/* m3u and c may be NULL. Both buffers are copied or parsed, the
+ * caller can free them once this returns. NULL on failure.
+ * gbs can also be an APU log from gbs2wav_log_save, which opens with
+ * the one track it holds and the model it was captured on; m3u is
+ * ignored then. */
+gbs2wav_t *gbs2wav_open(const uint8_t *gbs, size_t gbsLen, const char *m3u, size_t m3uLen, const gbs2wav_config *c);
+void gbs2wav_close(gbs2wav_t *h);
+
+const gbs2wav_config *gbs2wav_get_config(const gbs2wav_t *h);
+
+/* NULL when the tag isn't available */
+const char *gbs2wav_get_tag(const gbs2wav_t *h, gbs2wav_tag tag);
+unsigned int gbs2wav_gbs_track_count(const gbs2wav_t *h);
+unsigned int gbs2wav_gbs_first_track(const gbs2wav_t *h);
+
+/* one track of the plan gbs2wav_open makes, in milliseconds: the
+ * length before the fade, the fade, and the M3U start offset */
+typedef struct gbs2wav_plan_track {
+    unsigned int number;
+    unsigned int song;
+    uint32_t lengthMs;
+    uint32_t fadeMs;
+    uint32_t startMs;
+    char *name;
+} gbs2wav_plan_track;
+
+/* the track list gbs2wav_open would plan, from the GBS header (the
+ * first 0x70 bytes are enough) and the M3U, without starting the
+ * emulator. m3u may be NULL. Returns the track count and sets *tracks
+ * for gbs2wav_plan_free, or -1 when gbs isn't a GBS */
+int gbs2wav_plan(const uint8_t *gbs, size_t gbsLen, const char *m3u, size_t m3uLen, gbs2wav_plan_track **tracks);
+void gbs2wav_plan_free(gbs2wav_plan_track *tracks, int count);
+
+/* the planned track list: M3U entries, or every GBS song at
+ * 3 minutes with a 10 second fade when there's no M3U */
+unsigned int gbs2wav_track_count(const gbs2wav_t *h);
+const char *gbs2wav_track_name(const gbs2wav_t *h, unsigned int index);
+/* 1-based number used for output file names */
+unsigned int gbs2wav_track_number(const gbs2wav_t *h, unsigned int index);
+/* the GBS song to play */
+unsigned int gbs2wav_track_song(const gbs2wav_t *h, unsigned int index);
+/* total length including the fade, in frames, less the start offset */
+uint64_t gbs2wav_track_frames(const gbs2wav_t *h, unsigned int index);
+uint64_t gbs2wav_track_fade(const gbs2wav_t *h, unsigned int index);
+
+/* frames into the song where rendering starts, from a "# @START m:ss"
+ * comment line just before the track in the M3U. gbs2wav_start_track
+ * runs the emulator up to there with sample generation off, which is
+ * much quicker than rendering and throwing the audio away. Setting it
+ * leaves at least one frame of the track, and shortens
+ * gbs2wav_track_frames to match. APU logs can't be captured from a
+ * track with an offset. */
+uint64_t gbs2wav_track_start(const gbs2wav_t *h, unsigned int index);
+int gbs2wav_set_track_start(gbs2wav_t *h, unsigned int index, uint64_t frames);
+
+/* resets the emulator and starts a planned track */
+int gbs2wav_start_track(gbs2wav_t *h, unsigned int index);
+
+/* resets the emulator and starts any GBS song with the given
+ * length (including the fade) and fade, in frames */
+int gbs2wav_start_song(gbs2wav_t *h, unsigned int song, uint64_t totalFrames, uint64_t fadeFrames);
+
+/* frames of the current track not yet returned */
+uint64_t gbs2wav_frames_left(const gbs2wav_t *h);
+
+/* emulated 8MHz cycles run since the current track started */
+uint64_t gbs2wav_track_cycles(const gbs2wav_t *h);
+
+/* fills dst with up to frames interleaved frames of faded PCM,
+ * returns the number written, 0 once the track is done */
+uint64_t gbs2wav_render(gbs2wav_t *h, int16_t *dst, uint64_t frames);
+
+/* as gbs2wav_render, and when stems isn't NULL also fills
+ * stems[0..GBS2WAV_STEM_COUNT-1] with the same frames of each APU
+ * channel (the handle must be opened with config.stems). Pass stems
+ * on every call of a track or on none. maxCycles stops early after
+ * that many emulated 8MHz cycles, 0 = no limit. */
+uint64_t gbs2wav_render_ex(gbs2wav_t *h, int16_t *dst, int16_t *const *stems, uint64_t frames, uint64_t maxCycles);
+
+/* runs the current track without producing output, for frames
+ * frames or a little more since the core runs whole instructions.
+ * Returns the number of frames skipped, gbs2wav_frames_left drops by
+ * the same amount */
+uint64_t gbs2wav_skip(gbs2wav_t *h, uint64_t frames);
+
+/* snapshots of the current track: the emulator plus the renderer's
+ * own state (position, fade, interpolation and stem filters). Loading
+ * needs a handle opened from the same GBS with the same config.
+ * Saving fails while frames produced by the last render are still
+ * waiting to be returned, it always works right after
+ * gbs2wav_start_track or gbs2wav_skip. The core's audio output state,
+ * which its own save states leave out, is carried too, so rendering
+ * from a loaded snapshot gives the same samples as a straight render */
+size_t gbs2wav_state_size(const gbs2wav_t *h);
+int gbs2wav_save_state(gbs2wav_t *h, uint8_t *buf);
+int gbs2wav_load_state(gbs2wav_t *h, const uint8_t *buf, size_t len);
+
+/* seek index: while a track renders (or is skipped through), keep a
+ * snapshot every intervalFrames, stored as an XOR delta against the
+ * track's first snapshot and run-length encoded. Snapshots beyond the
+ * first are dropped when the index would grow past bytesPerMinute
+ * per minute of audio rendered so far. Takes effect from the next
+ * start, which fails if the index's buffers can't be allocated.
+ * intervalFrames 0 turns it off */
+void gbs2wav_index_enable(gbs2wav_t *h, uint64_t intervalFrames, size_t bytesPerMinute);
+
+/* the index of the current track: snapshot count and encoded size */
+unsigned int gbs2wav_index_count(const gbs2wav_t *h);
+size_t gbs2wav_index_bytes(const gbs2wav_t *h);
+
+/* writes the index to a sidecar file, or reads one back. A loaded
+ * index is used by gbs2wav_seek once its track is started */
+int gbs2wav_index_save(const gbs2wav_t *h, const char *filename);
+int gbs2wav_index_load(gbs2wav_t *h, const char *filename);
+
+/* moves the current track to frame, restoring the nearest snapshot
+ * at or before it when the index covers the track, then skipping the
+ * rest of the way. Without one it restarts the track if it has to go
+ * backwards */
+int gbs2wav_seek(gbs2wav_t *h, uint64_t frame);
+
+/* APU log: with capture on, each track started records every write
+ * to the sound registers and wave RAM, stamped with the emulated 8MHz
+ * cycle it happened on. Opening a saved log replays the writes into
+ * an APU driven by an idle GBS, so re-rendering at another sample
+ * rate, length or quality (or as stems) needs no CPU emulation of
+ * the original driver. Seeking or loading a state during capture
+ * leaves the log unusable until the next start. */
+void gbs2wav_log_enable(gbs2wav_t *h, unsigned int enable);
+
+/* size of the log captured so far */
+size_t gbs2wav_log_bytes(const gbs2wav_t *h);
+
+int gbs2wav_log_save(const gbs2wav_t *h, const char *filename);
+
+/* non-zero when buf starts like an APU log */
+int gbs2wav_log_detect(const uint8_t *buf, size_t len);
+
+typedef struct gbs2wav_profile {
+    /* 0 while the profiler is off */
+    uint64_t intervalCycles;
+    uint64_t samples;
+    /* emulated 8MHz cycles, split by phase */
+    uint64_t cycles;
+    uint64_t phaseCycles[GBS2WAV_PHASE_COUNT];
+    /* interrupts dispatched, by vector */
+    uint64_t interrupts[GBS2WAV_INTERRUPT_COUNT];
+    /* distinct routines sampled */
+    unsigned int routines;
+} gbs2wav_profile;
+
+typedef struct gbs2wav_routine {
+    /* the ROM bank for 0x4000-0x7FFF, otherwise 0 */
+    uint16_t bank;
+    uint16_t address;
+    uint64_t samples;
+} gbs2wav_routine;
+
+/* guest profiler: while tracks render, skip or run up to a start
+ * offset, sample which routine the emulated CPU is in every
+ * intervalCycles 8MHz cycles. A routine is the address a call, rst or
+ * interrupt entered, tracked on a shadow call stack. Cycles are also
+ * counted by phase, and interrupts by vector. Totals carry on across
+ * tracks; enabling starts them over, 0 turns it off. It costs a
+ * callback per emulated instruction */
+void gbs2wav_profile_enable(gbs2wav_t *h, uint64_t intervalCycles);
+
+void gbs2wav_profile_get(const gbs2wav_t *h, gbs2wav_profile *p);
+
+/* copies up to max routines, the most sampled first, and returns how
+ * many. Samples taken while halted aren't in any routine */
+unsigned int gbs2wav_profile_routines(const gbs2wav_t *h, gbs2wav_routine *dst, unsigned int max);
+
+/* bytes held by the handle: itself, the emulator and what the core
+ * allocated for ROM, RAM and VRAM */
+size_t gbs2wav_resident_size(const gbs2wav_t *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
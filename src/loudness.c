@@ -0,0 +1,211 @@
+#include "loudness.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define LOUDNESS_OFFSET (-0.691)
+#define LOUDNESS_ABSOLUTE_GATE (-70.0)
+#define LOUDNESS_RELATIVE_GATE (-10.0)
+#define LOUDNESS_BIN_WIDTH 0.01
+
+static double energy_to_lufs(double e) {
+    return LOUDNESS_OFFSET + 10.0 * log10(e);
+}
+
+/* BS.1770 filter coefficients re-derived for any sample rate */
+static void k_weighting(loudness_state *l, double rate) {
+    double f0 = 1681.974450955533;
+    double g = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / rate);
+    double vh = pow(10.0, g / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+
+    l->b[0][0] = (vh + vb * k / q + k * k) / a0;
+    l->b[0][1] = 2.0 * (k * k - vh) / a0;
+    l->b[0][2] = (vh - vb * k / q + k * k) / a0;
+    l->a[0][0] = 1.0;
+    l->a[0][1] = 2.0 * (k * k - 1.0) / a0;
+    l->a[0][2] = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+
+    l->b[1][0] = 1.0;
+    l->b[1][1] = -2.0;
+    l->b[1][2] = 1.0;
+    l->a[1][0] = 1.0;
+    l->a[1][1] = 2.0 * (k * k - 1.0) / a0;
+    l->a[1][2] = (1.0 - k / q + k * k) / a0;
+}
+
+/* Hann-windowed sinc lowpass at the original Nyquist, split into
+ * one sub-filter per interpolated phase */
+static void true_peak_filter(loudness_state *l) {
+    unsigned int p;
+    unsigned int j;
+    double center = (double)(LOUDNESS_TP_PHASES * LOUDNESS_TP_TAPS - 1) / 2.0;
+    double n;
+    double x;
+    double w;
+
+    for(p = 0; p < LOUDNESS_TP_PHASES; p++) {
+        for(j = 0; j < LOUDNESS_TP_TAPS; j++) {
+            n = (double)(j * LOUDNESS_TP_PHASES + p);
+            x = (n - center) / (double)LOUDNESS_TP_PHASES;
+            w = 0.5 - 0.5 * cos(2.0 * M_PI * (n + 0.5) / (double)(LOUDNESS_TP_PHASES * LOUDNESS_TP_TAPS));
+            l->tpCoeffs[p][j] = (x == 0.0 ? 1.0 : sin(M_PI * x) / (M_PI * x)) * w;
+        }
+    }
+}
+
+int loudness_init(loudness_state *l, unsigned int channels, uint64_t sampleRate) {
+    memset(l,0,sizeof(loudness_state));
+    if(channels == 0 || channels > LOUDNESS_MAX_CHANNELS) return -1;
+
+    l->channels = channels;
+    l->subblockFrames = sampleRate / 10;
+    k_weighting(l,(double)sampleRate);
+    true_peak_filter(l);
+
+    l->hist = (loudness_histogram *)malloc(sizeof(loudness_histogram));
+    if(l->hist == NULL) return -1;
+
+    loudness_reset(l);
+    return 0;
+}
+
+void loudness_free(loudness_state *l) {
+    if(l->hist != NULL) free(l->hist);
+    l->hist = NULL;
+}
+
+void loudness_reset(loudness_state *l) {
+    memset(l->z,0,sizeof(l->z));
+    memset(l->subblock,0,sizeof(l->subblock));
+    memset(l->tpHistory,0,sizeof(l->tpHistory));
+    l->subblocks = 0;
+    l->acc = 0.0;
+    l->accFrames = 0;
+    memset(l->hist,0,sizeof(loudness_histogram));
+}
+
+static void add_block(loudness_histogram *h, double e) {
+    double lufs;
+    long bin;
+
+    if(e <= 0.0) return;
+    lufs = energy_to_lufs(e);
+    if(lufs < LOUDNESS_ABSOLUTE_GATE) return;
+
+    bin = (long)((lufs - LOUDNESS_ABSOLUTE_GATE) / LOUDNESS_BIN_WIDTH);
+    if(bin >= LOUDNESS_HISTOGRAM_BINS) bin = LOUDNESS_HISTOGRAM_BINS - 1;
+    h->count[bin]++;
+    h->energy[bin] += e;
+}
+
+static double true_peak(loudness_state *l, unsigned int ch, double x) {
+    unsigned int p;
+    unsigned int j;
+    double y;
+    double peak = fabs(x);
+    double *hist = l->tpHistory[ch];
+
+    memmove(&hist[1],&hist[0],sizeof(double) * (LOUDNESS_TP_TAPS - 1));
+    hist[0] = x;
+
+    for(p = 0; p < LOUDNESS_TP_PHASES; p++) {
+        y = 0.0;
+        for(j = 0; j < LOUDNESS_TP_TAPS; j++) {
+            y += l->tpCoeffs[p][j] * hist[j];
+        }
+        y = fabs(y);
+        if(y > peak) peak = y;
+    }
+    return peak;
+}
+
+void loudness_add_frames(loudness_state *l, const int16_t *samples, uint64_t frameCount) {
+    uint64_t i;
+    unsigned int ch;
+    unsigned int f;
+    double x;
+    double y;
+    double peak;
+    double *z;
+
+    for(i = 0; i < frameCount; i++) {
+        for(ch = 0; ch < l->channels; ch++) {
+            x = (double)samples[i * l->channels + ch] / 32768.0;
+
+            if(fabs(x) > l->hist->samplePeak) l->hist->samplePeak = fabs(x);
+            peak = true_peak(l,ch,x);
+            if(peak > l->hist->truePeak) l->hist->truePeak = peak;
+
+            for(f = 0; f < 2; f++) {
+                z = l->z[ch][f];
+                y = l->b[f][0] * x + z[0];
+                z[0] = l->b[f][1] * x - l->a[f][1] * y + z[1];
+                z[1] = l->b[f][2] * x - l->a[f][2] * y;
+                x = y;
+            }
+            l->acc += x * x;
+        }
+
+        if(++l->accFrames == l->subblockFrames) {
+            l->subblock[l->subblocks % 4] = l->acc / (double)l->subblockFrames;
+            l->subblocks++;
+            if(l->subblocks >= 4) {
+                add_block(l->hist,(l->subblock[0] + l->subblock[1] + l->subblock[2] + l->subblock[3]) / 4.0);
+            }
+            l->acc = 0.0;
+            l->accFrames = 0;
+        }
+    }
+}
+
+double loudness_integrated(const loudness_histogram *h) {
+    unsigned int i;
+    uint64_t count = 0;
+    double energy = 0.0;
+    double gate;
+    long start;
+
+    for(i = 0; i < LOUDNESS_HISTOGRAM_BINS; i++) {
+        count += h->count[i];
+        energy += h->energy[i];
+    }
+    if(count == 0) return -HUGE_VAL;
+
+    gate = energy_to_lufs(energy / (double)count) + LOUDNESS_RELATIVE_GATE;
+    start = (long)ceil((gate - LOUDNESS_ABSOLUTE_GATE) / LOUDNESS_BIN_WIDTH);
+    if(start < 0) start = 0;
+
+    count = 0;
+    energy = 0.0;
+    for(i = (unsigned int)start; i < LOUDNESS_HISTOGRAM_BINS; i++) {
+        count += h->count[i];
+        energy += h->energy[i];
+    }
+    if(count == 0) return -HUGE_VAL;
+
+    return energy_to_lufs(energy / (double)count);
+}
+
+void loudness_merge(loudness_histogram *dst, const loudness_histogram *src) {
+    unsigned int i;
+    for(i = 0; i < LOUDNESS_HISTOGRAM_BINS; i++) {
+        dst->count[i] += src->count[i];
+        dst->energy[i] += src->energy[i];
+    }
+    if(src->samplePeak > dst->samplePeak) dst->samplePeak = src->samplePeak;
+    if(src->truePeak > dst->truePeak) dst->truePeak = src->truePeak;
+}
@@ -0,0 +1,62 @@
+#ifndef GBS2WAV_LOUDNESS_H
+#define GBS2WAV_LOUDNESS_H
+
+/* EBU R128 / ITU BS.1770 loudness, sample peak and 4x oversampled
+ * true peak, measured incrementally on 16-bit interleaved PCM.
+ *
+ * Gating blocks are kept in a histogram (0.01 LU bins over the
+ * -70..+5 LUFS range, with the exact energy summed per bin), so
+ * several tracks can be merged for an album measurement without
+ * keeping every block around. */
+
+#include <stdint.h>
+
+#define LOUDNESS_MAX_CHANNELS 2
+#define LOUDNESS_HISTOGRAM_BINS 7500
+#define LOUDNESS_TP_PHASES 4
+#define LOUDNESS_TP_TAPS 12
+
+typedef struct loudness_histogram {
+    uint64_t count[LOUDNESS_HISTOGRAM_BINS];
+    double energy[LOUDNESS_HISTOGRAM_BINS];
+    double samplePeak;
+    double truePeak;
+} loudness_histogram;
+
+typedef struct loudness_state {
+    unsigned int channels;
+    uint64_t subblockFrames;
+
+    /* K-weighting: shelving pre-filter then RLB highpass,
+     * transposed direct form II, 2 delays per biquad */
+    double b[2][3];
+    double a[2][3];
+    double z[LOUDNESS_MAX_CHANNELS][2][2];
+
+    /* 100ms sub-block energies, a gating block is the last 4 */
+    double subblock[4];
+    unsigned int subblocks;
+    double acc;
+    uint64_t accFrames;
+
+    /* true peak interpolator history, newest sample first */
+    double tpCoeffs[LOUDNESS_TP_PHASES][LOUDNESS_TP_TAPS];
+    double tpHistory[LOUDNESS_MAX_CHANNELS][LOUDNESS_TP_TAPS];
+
+    loudness_histogram *hist;
+} loudness_state;
+
+int loudness_init(loudness_state *l, unsigned int channels, uint64_t sampleRate);
+void loudness_free(loudness_state *l);
+
+/* clears filter state and measurements for a new track */
+void loudness_reset(loudness_state *l);
+
+void loudness_add_frames(loudness_state *l, const int16_t *samples, uint64_t frameCount);
+
+/* integrated loudness in LUFS, -HUGE_VAL if nothing passed the gates */
+double loudness_integrated(const loudness_histogram *h);
+
+void loudness_merge(loudness_histogram *dst, const loudness_histogram *src);
+
+#endif
@@ -0,0 +1,203 @@
+#include "mix.h"
+#include "libgbs2wav.h"
+
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MIX_X86
+#include <immintrin.h>
+#define TARGET(t) __attribute__((target(t)))
+#endif
+
+#define CLAMP(val, min, max) ( (val) < (min) ? (min) : (val) > (max) ? (max) : (val) )
+
+static void stems_scalar(int32_t *out, const int32_t *dac, const int32_t *gain, double *capacitor, double rate, unsigned int filter, unsigned int frames);
+static void fade_scalar(int16_t *d, unsigned int channels, uint64_t remaining, uint64_t fadeFrames, uint64_t count);
+
+static const mix_ops ops_scalar = { stems_scalar, fade_scalar };
+
+#ifdef MIX_X86
+static void stems_sse2(int32_t *out, const int32_t *dac, const int32_t *gain, double *capacitor, double rate, unsigned int filter, unsigned int frames) TARGET("sse2");
+static void fade_sse2(int16_t *d, unsigned int channels, uint64_t remaining, uint64_t fadeFrames, uint64_t count) TARGET("sse2");
+static void stems_avx2(int32_t *out, const int32_t *dac, const int32_t *gain, double *capacitor, double rate, unsigned int filter, unsigned int frames) TARGET("avx2");
+static void fade_avx2(int16_t *d, unsigned int channels, uint64_t remaining, uint64_t fadeFrames, uint64_t count) TARGET("avx2");
+
+static const mix_ops ops_sse2 = { stems_sse2, fade_sse2 };
+static const mix_ops ops_avx2 = { stems_avx2, fade_avx2 };
+#endif
+
+const mix_ops *mix_get(int level) {
+    if(level == GBS2WAV_SIMD_AUTO) level = mix_best();
+    switch(level) {
+        case GBS2WAV_SIMD_SCALAR: return &ops_scalar;
+#ifdef MIX_X86
+        case GBS2WAV_SIMD_SSE2: {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2") ? &ops_sse2 : NULL;
+        }
+        case GBS2WAV_SIMD_AVX2: {
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? &ops_avx2 : NULL;
+        }
+#endif
+        default: break;
+    }
+    return NULL;
+}
+
+int mix_best(void) {
+    if(mix_get(GBS2WAV_SIMD_AVX2) != NULL) return GBS2WAV_SIMD_AVX2;
+    if(mix_get(GBS2WAV_SIMD_SSE2) != NULL) return GBS2WAV_SIMD_SSE2;
+    return GBS2WAV_SIMD_SCALAR;
+}
+
+static void stems_scalar(int32_t *out, const int32_t *dac, const int32_t *gain, double *capacitor, double rate, unsigned int filter, unsigned int frames) {
+    unsigned int i;
+    unsigned int n = frames * MIX_STEM_LANES;
+    double s;
+    double o;
+
+    for(i = 0; i < n; i++) {
+        /* the product is a small integer, exact as a double */
+        s = (double)dac[i] * (double)gain[i];
+        if(filter) {
+            o = s - capacitor[i % MIX_STEM_LANES];
+            capacitor[i % MIX_STEM_LANES] = s - o * rate;
+            s = o;
+        }
+        out[i] = (int32_t)s;
+    }
+}
+
+static void fade_scalar(int16_t *d, unsigned int channels, uint64_t remaining, uint64_t fadeFrames, uint64_t count) {
+    uint64_t i;
+    unsigned int j;
+    double fade;
+    int32_t s;
+
+    for(i = 0; i < count; i++) {
+        fade = (double)(remaining - i) / (double)fadeFrames;
+        for(j = 0; j < channels; j++) {
+            s = (int32_t)d[(i*channels)+j];
+            s *= fade;
+            s = CLAMP(s,-0x8000,0x7FFF);
+            d[(i*channels)+j] = (int16_t)s;
+        }
+    }
+}
+
+#ifdef MIX_X86
+
+/* two lanes per step, the left and right of one channel. The filter
+ * state stays in registers for the whole block */
+static void stems_sse2(int32_t *out, const int32_t *dac, const int32_t *gain, double *capacitor, double rate, unsigned int filter, unsigned int frames) {
+    unsigned int i;
+    unsigned int n = frames * MIX_STEM_LANES;
+    __m128d r = _mm_set1_pd(rate);
+    __m128d c[MIX_STEM_LANES / 2];
+    __m128d s;
+    __m128d o;
+
+    for(i = 0; i < MIX_STEM_LANES; i += 2) {
+        c[i / 2] = _mm_loadu_pd(&capacitor[i]);
+    }
+    for(i = 0; i < n; i += 2) {
+        s = _mm_mul_pd(_mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i *)&dac[i])),
+          _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i *)&gain[i])));
+        if(filter) {
+            o = _mm_sub_pd(s,c[(i % MIX_STEM_LANES) / 2]);
+            c[(i % MIX_STEM_LANES) / 2] = _mm_sub_pd(s,_mm_mul_pd(o,r));
+            s = o;
+        }
+        _mm_storel_epi64((__m128i *)&out[i],_mm_cvttpd_epi32(s));
+    }
+    for(i = 0; i < MIX_STEM_LANES; i += 2) {
+        _mm_storeu_pd(&capacitor[i],c[i / 2]);
+    }
+}
+
+/* four samples per step. Each sample's fade is worked out exactly as
+ * the scalar code does it: the frame count (below 2^53, so exact as a
+ * double) divided by the fade length. The saturating pack is the
+ * clamp. */
+static void fade_sse2(int16_t *d, unsigned int channels, uint64_t remaining, uint64_t fadeFrames, uint64_t count) {
+    uint64_t i = 0;
+    uint64_t samples = count * channels;
+    __m128d len = _mm_set1_pd((double)fadeFrames);
+    /* frame offset of each sample within the step */
+    __m128d offLo = channels == 1 ? _mm_set_pd(1.0,0.0) : _mm_set_pd(0.0,0.0);
+    __m128d offHi = channels == 1 ? _mm_set_pd(3.0,2.0) : _mm_set_pd(1.0,1.0);
+    __m128d base;
+    __m128i v;
+    __m128i lo;
+    __m128i hi;
+
+    for(; i + 4 <= samples; i += 4) {
+        base = _mm_set1_pd((double)(remaining - (i / channels)));
+        v = _mm_loadl_epi64((const __m128i *)&d[i]);
+        v = _mm_srai_epi32(_mm_unpacklo_epi16(v,v),16);
+        lo = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(v),
+          _mm_div_pd(_mm_sub_pd(base,offLo),len)));
+        hi = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v,0xEE)),
+          _mm_div_pd(_mm_sub_pd(base,offHi),len)));
+        v = _mm_packs_epi32(_mm_unpacklo_epi64(lo,hi),_mm_setzero_si128());
+        _mm_storel_epi64((__m128i *)&d[i],v);
+    }
+
+    fade_scalar(&d[i],channels,remaining - (i / channels),fadeFrames,count - (i / channels));
+}
+
+/* four lanes per step, two channels at a time, otherwise as
+ * stems_sse2 */
+static void stems_avx2(int32_t *out, const int32_t *dac, const int32_t *gain, double *capacitor, double rate, unsigned int filter, unsigned int frames) {
+    unsigned int i;
+    unsigned int n = frames * MIX_STEM_LANES;
+    __m256d r = _mm256_set1_pd(rate);
+    __m256d c[MIX_STEM_LANES / 4];
+    __m256d s;
+    __m256d o;
+
+    for(i = 0; i < MIX_STEM_LANES; i += 4) {
+        c[i / 4] = _mm256_loadu_pd(&capacitor[i]);
+    }
+    for(i = 0; i < n; i += 4) {
+        s = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)&dac[i])),
+          _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)&gain[i])));
+        if(filter) {
+            o = _mm256_sub_pd(s,c[(i % MIX_STEM_LANES) / 4]);
+            c[(i % MIX_STEM_LANES) / 4] = _mm256_sub_pd(s,_mm256_mul_pd(o,r));
+            s = o;
+        }
+        _mm_storeu_si128((__m128i *)&out[i],_mm256_cvttpd_epi32(s));
+    }
+    for(i = 0; i < MIX_STEM_LANES; i += 4) {
+        _mm256_storeu_pd(&capacitor[i],c[i / 4]);
+    }
+}
+
+/* eight samples per step, otherwise as fade_sse2 */
+static void fade_avx2(int16_t *d, unsigned int channels, uint64_t remaining, uint64_t fadeFrames, uint64_t count) {
+    uint64_t i = 0;
+    uint64_t samples = count * channels;
+    __m256d len = _mm256_set1_pd((double)fadeFrames);
+    __m256d offLo = channels == 1 ? _mm256_set_pd(3.0,2.0,1.0,0.0) : _mm256_set_pd(1.0,1.0,0.0,0.0);
+    __m256d offHi = channels == 1 ? _mm256_set_pd(7.0,6.0,5.0,4.0) : _mm256_set_pd(3.0,3.0,2.0,2.0);
+    __m256d base;
+    __m256i v;
+    __m128i lo;
+    __m128i hi;
+
+    for(; i + 8 <= samples; i += 8) {
+        base = _mm256_set1_pd((double)(remaining - (i / channels)));
+        v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)&d[i]));
+        lo = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)),
+          _mm256_div_pd(_mm256_sub_pd(base,offLo),len)));
+        hi = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v,1)),
+          _mm256_div_pd(_mm256_sub_pd(base,offHi),len)));
+        _mm_storeu_si128((__m128i *)&d[i],_mm_packs_epi32(lo,hi));
+    }
+
+    fade_scalar(&d[i],channels,remaining - (i / channels),fadeFrames,count - (i / channels));
+}
+
+#endif
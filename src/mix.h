@@ -0,0 +1,32 @@
+#ifndef GBS2WAV_MIX_H
+#define GBS2WAV_MIX_H
+
+/* block kernels for the renderer's own mixing: the per-channel stem
+ * mix and highpass, and the fade. Each instruction set has its own
+ * copy, picked at runtime. They all do the same IEEE double operations
+ * in the same order (no fused multiply-add), so every copy produces
+ * bit-identical output. */
+
+#include <stdint.h>
+
+/* stem lanes: GBS2WAV_STEM_COUNT channels, left and right */
+#define MIX_STEM_LANES 8
+
+typedef struct mix_ops {
+    /* out = dac * gain, through the highpass when filter is set, for
+     * every lane of frames frames, MIX_STEM_LANES values each.
+     * capacitor holds the filter state per lane */
+    void (*stems)(int32_t *out, const int32_t *dac, const int32_t *gain, double *capacitor, double rate, unsigned int filter, unsigned int frames);
+    /* scales count frames by (remaining - n) / fadeFrames, n being the
+     * frame's offset into d */
+    void (*fade)(int16_t *d, unsigned int channels, uint64_t remaining, uint64_t fadeFrames, uint64_t count);
+} mix_ops;
+
+/* a gbs2wav_simd level, NULL when it's not built in or the CPU lacks
+ * it. GBS2WAV_SIMD_AUTO gives the best one available */
+const mix_ops *mix_get(int level);
+
+/* the level mix_get(GBS2WAV_SIMD_AUTO) picks */
+int mix_best(void);
+
+#endif
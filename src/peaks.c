@@ -0,0 +1,206 @@
+#include "peaks.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PEAKS_MAGIC "GBPK"
+#define PEAKS_VERSION 1
+#define PEAKS_HEADER_SIZE 28
+#define PEAKS_WRITE_SIZE 4096
+
+static void level_clear(peaks_level *l) {
+    unsigned int c;
+    for(c = 0; c < PEAKS_MAX_CHANNELS; c++) {
+        l->min[c] = 0x7FFF;
+        l->max[c] = -0x8000;
+    }
+    l->fill = 0;
+}
+
+/* stores level n's peak and merges it into the one building above */
+static void level_emit(peaks_state *p, unsigned int n) {
+    peaks_level *l = &p->level[n];
+    peaks_level *up;
+    unsigned int c;
+
+    /* more frames than the track was planned with are left out */
+    if(l->count < l->alloc) {
+        for(c = 0; c < p->channels; c++) {
+            l->peaks[(l->count * p->channels + c) * 2 + 0] = l->min[c];
+            l->peaks[(l->count * p->channels + c) * 2 + 1] = l->max[c];
+        }
+        l->count++;
+    }
+
+    if(n + 1 < PEAKS_LEVELS) {
+        up = &p->level[n + 1];
+        for(c = 0; c < p->channels; c++) {
+            if(l->min[c] < up->min[c]) up->min[c] = l->min[c];
+            if(l->max[c] > up->max[c]) up->max[c] = l->max[c];
+        }
+        up->fill++;
+        level_clear(l);
+        if(up->fill == PEAKS_LEVEL_FACTOR) level_emit(p,n + 1);
+    } else {
+        level_clear(l);
+    }
+}
+
+static void put_le32(uint8_t *d, uint32_t n) {
+    d[0] = (uint8_t)(n & 0xFF);
+    d[1] = (uint8_t)((n >> 8) & 0xFF);
+    d[2] = (uint8_t)((n >> 16) & 0xFF);
+    d[3] = (uint8_t)(n >> 24);
+}
+
+void peaks_init(peaks_state *p, unsigned int channels, uint64_t framesPerPeak) {
+    memset(p,0,sizeof(peaks_state));
+    p->channels = channels;
+    p->framesPerPeak = framesPerPeak;
+}
+
+void peaks_free(peaks_state *p) {
+    unsigned int n;
+    for(n = 0; n < PEAKS_LEVELS; n++) {
+        if(p->level[n].peaks != NULL) free(p->level[n].peaks);
+    }
+    memset(p,0,sizeof(peaks_state));
+}
+
+int peaks_reset(peaks_state *p, uint64_t totalFrames) {
+    peaks_level *l;
+    uint64_t count = (totalFrames + p->framesPerPeak - 1) / p->framesPerPeak;
+    unsigned int n;
+    void *t;
+
+    for(n = 0; n < PEAKS_LEVELS; n++) {
+        l = &p->level[n];
+        if(count > 0xFFFFFFFFULL) return -1;
+        if(count > l->alloc || l->peaks == NULL) {
+            t = realloc(l->peaks,sizeof(int16_t) * 2 * p->channels * (count ? count : 1));
+            if(t == NULL) return -1;
+            l->peaks = (int16_t *)t;
+        }
+        l->alloc = (uint32_t)count;
+        l->count = 0;
+        level_clear(l);
+        count = (count + PEAKS_LEVEL_FACTOR - 1) / PEAKS_LEVEL_FACTOR;
+    }
+    p->frames = 0;
+    return 0;
+}
+
+void peaks_add_frames(peaks_state *p, const int16_t *samples, uint64_t frameCount) {
+    peaks_level *l = &p->level[0];
+    uint64_t n;
+    uint64_t i;
+    int16_t s;
+
+    while(frameCount) {
+        n = p->framesPerPeak - l->fill;
+        if(n > frameCount) n = frameCount;
+
+        if(p->channels == 1) {
+            for(i = 0; i < n; i++) {
+                s = samples[i];
+                if(s < l->min[0]) l->min[0] = s;
+                if(s > l->max[0]) l->max[0] = s;
+            }
+        } else {
+            for(i = 0; i < n; i++) {
+                s = samples[(i*2)+0];
+                if(s < l->min[0]) l->min[0] = s;
+                if(s > l->max[0]) l->max[0] = s;
+                s = samples[(i*2)+1];
+                if(s < l->min[1]) l->min[1] = s;
+                if(s > l->max[1]) l->max[1] = s;
+            }
+        }
+
+        samples += n * p->channels;
+        frameCount -= n;
+        p->frames += n;
+        l->fill += n;
+        if(l->fill == p->framesPerPeak) level_emit(p,0);
+    }
+}
+
+void peaks_finish(peaks_state *p) {
+    unsigned int n;
+    for(n = 0; n < PEAKS_LEVELS; n++) {
+        if(p->level[n].fill) level_emit(p,n);
+    }
+}
+
+int peaks_save(const peaks_state *p, const char *filename, uint32_t sampleRate) {
+    uint8_t buf[PEAKS_WRITE_SIZE];
+    const peaks_level *l;
+    uint64_t framesPerPeak = p->framesPerPeak;
+    size_t len;
+    size_t total;
+    size_t i;
+    unsigned int n;
+    FILE *f;
+    int r = -1;
+
+    f = fopen(filename,"wb");
+    if(f == NULL) return -1;
+
+    memcpy(&buf[0],PEAKS_MAGIC,4);
+    put_le32(&buf[4],PEAKS_VERSION);
+    put_le32(&buf[8],p->channels);
+    put_le32(&buf[12],sampleRate);
+    put_le32(&buf[16],(uint32_t)(p->frames & 0xFFFFFFFF));
+    put_le32(&buf[20],(uint32_t)(p->frames >> 32));
+    put_le32(&buf[24],PEAKS_LEVELS);
+    len = PEAKS_HEADER_SIZE;
+    for(n = 0; n < PEAKS_LEVELS; n++) {
+        put_le32(&buf[len],(uint32_t)framesPerPeak);
+        put_le32(&buf[len + 4],p->level[n].count);
+        len += 8;
+        framesPerPeak *= PEAKS_LEVEL_FACTOR;
+    }
+    if(fwrite(buf,1,len,f) != len) goto done;
+
+    for(n = 0; n < PEAKS_LEVELS; n++) {
+        l = &p->level[n];
+        total = (size_t)l->count * p->channels * 2;
+        len = 0;
+        for(i = 0; i < total; i++) {
+            buf[len++] = (uint8_t)((uint16_t)l->peaks[i] & 0xFF);
+            buf[len++] = (uint8_t)((uint16_t)l->peaks[i] >> 8);
+            if(len == sizeof(buf)) {
+                if(fwrite(buf,1,len,f) != len) goto done;
+                len = 0;
+            }
+        }
+        if(len && fwrite(buf,1,len,f) != len) goto done;
+    }
+    r = 0;
+
+    done:
+    if(fclose(f) != 0) r = -1;
+    return r;
+}
+
+peaks_state *peaks_clone(const peaks_state *p) {
+    peaks_state *c = (peaks_state *)malloc(sizeof(peaks_state));
+    size_t size;
+    unsigned int n;
+
+    if(c == NULL) return NULL;
+    memcpy(c,p,sizeof(peaks_state));
+    for(n = 0; n < PEAKS_LEVELS; n++) {
+        size = sizeof(int16_t) * 2 * p->channels * (p->level[n].count ? p->level[n].count : 1);
+        c->level[n].peaks = (int16_t *)malloc(size);
+        if(c->level[n].peaks == NULL) {
+            while(n--) free(c->level[n].peaks);
+            free(c);
+            return NULL;
+        }
+        memcpy(c->level[n].peaks,p->level[n].peaks,sizeof(int16_t) * 2 * p->channels * p->level[n].count);
+        c->level[n].alloc = p->level[n].count;
+    }
+    return c;
+}
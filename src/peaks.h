@@ -0,0 +1,58 @@
+#ifndef GBS2WAV_PEAKS_H
+#define GBS2WAV_PEAKS_H
+
+/* waveform overview: the lowest and highest sample per channel over
+ * runs of frames, at several zoom levels, measured incrementally on
+ * 16-bit interleaved PCM.
+ *
+ * Level 0 has one peak per framesPerPeak frames, each level above it
+ * one per PEAKS_LEVEL_FACTOR peaks of the level below, so only level 0
+ * looks at samples.
+ *
+ * The sidecar file is little-endian: "GBPK", version, channels,
+ * sample rate (u32 each), frames (u64), level count (u32), then per
+ * level its frames per peak and peak count (u32 each), then every
+ * level's peaks in that order, each a min and max (s16) per channel.
+ * A level's last peak may cover fewer frames. */
+
+#include <stdint.h>
+
+#define PEAKS_MAX_CHANNELS 2
+#define PEAKS_LEVELS 5
+#define PEAKS_LEVEL_FACTOR 4
+
+typedef struct peaks_level {
+    /* min and max per channel, per peak */
+    int16_t *peaks;
+    uint32_t count;
+    uint32_t alloc;
+    /* the peak being built, over fill frames (level 0) or peaks */
+    int16_t min[PEAKS_MAX_CHANNELS];
+    int16_t max[PEAKS_MAX_CHANNELS];
+    uint64_t fill;
+} peaks_level;
+
+typedef struct peaks_state {
+    unsigned int channels;
+    uint64_t framesPerPeak;
+    uint64_t frames;
+    peaks_level level[PEAKS_LEVELS];
+} peaks_state;
+
+void peaks_init(peaks_state *p, unsigned int channels, uint64_t framesPerPeak);
+void peaks_free(peaks_state *p);
+
+/* clears the overview for a new track, with room for totalFrames */
+int peaks_reset(peaks_state *p, uint64_t totalFrames);
+
+void peaks_add_frames(peaks_state *p, const int16_t *samples, uint64_t frameCount);
+
+/* ends the partial peaks once the track is done */
+void peaks_finish(peaks_state *p);
+
+int peaks_save(const peaks_state *p, const char *filename, uint32_t sampleRate);
+
+/* a copy of a finished overview, NULL when out of memory */
+peaks_state *peaks_clone(const peaks_state *p);
+
+#endif
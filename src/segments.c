@@ -0,0 +1,259 @@
+#include "segments.h"
+#include "budget.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *segment_worker(void *userdata);
+static int segment_render(segment_job *j, gbs2wav_t *h, segment *seg);
+static uint64_t segment_bytes(const segment_job *j, const segment *seg);
+static void segment_free(segment_job *j, segment *seg);
+
+int segments_start(segment_job *j, gbs2wav_t *h, unsigned int index, const uint8_t *gbs, size_t gbsLen, const char *m3u, size_t m3uLen, uint64_t segmentFrames, unsigned int threads, segments_stop_func stop, void *userdata) {
+    unsigned int k;
+    uint64_t total;
+    uint64_t pos;
+    uint64_t target;
+    segment *seg;
+
+    memset(j,0,sizeof(segment_job));
+    j->gbs = gbs;
+    j->gbsLen = gbsLen;
+    j->m3u = m3u;
+    j->m3uLen = m3uLen;
+    j->config = *gbs2wav_get_config(h);
+    j->stateSize = gbs2wav_state_size(h);
+
+    total = gbs2wav_track_frames(h,index);
+    if(total == 0 || segmentFrames == 0 || threads == 0) return -1;
+
+    j->count = (unsigned int)((total + segmentFrames - 1) / segmentFrames);
+    j->segments = (segment *)malloc(sizeof(segment) * j->count);
+    if(j->segments == NULL) return -1;
+    memset(j->segments,0,sizeof(segment) * j->count);
+
+    /* prepass: skip through the track, snapshotting as we go. Segments
+     * start wherever the skip landed, a few frames past the mark */
+    if(gbs2wav_start_track(h,index) != 0) goto fail;
+    pos = 0;
+    for(k = 0; k < j->count; k++) {
+        target = (uint64_t)k * segmentFrames;
+        if(target > pos) {
+            pos += gbs2wav_skip(h,target - pos);
+        }
+        if(pos >= total) break;
+        if(stop != NULL && stop(userdata,h)) {
+            segments_finish(j);
+            return 1;
+        }
+
+        seg = &j->segments[k];
+        seg->offset = pos;
+        seg->state = (uint8_t *)malloc(j->stateSize);
+        if(seg->state == NULL) goto fail;
+        budget_charge(j->stateSize);
+        if(gbs2wav_save_state(h,seg->state) != 0) goto fail;
+    }
+    j->count = k;
+    for(k = 0; k < j->count; k++) {
+        seg = &j->segments[k];
+        seg->frames = (k + 1 < j->count ? j->segments[k + 1].offset : total) - seg->offset;
+    }
+
+    j->window = threads * 2;
+    j->threads = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    if(j->threads == NULL) goto fail;
+    pthread_mutex_init(&j->lock,NULL);
+    pthread_cond_init(&j->cond,NULL);
+
+    for(k = 0; k < threads; k++) {
+        if(pthread_create(&j->threads[k],NULL,segment_worker,j) != 0) break;
+        j->threadCount++;
+    }
+    if(j->threadCount == 0) goto fail;
+
+    return 0;
+
+    fail:
+    segments_finish(j);
+    return -1;
+}
+
+const segment *segments_wait(segment_job *j, unsigned int k) {
+    segment *seg = &j->segments[k];
+    unsigned int status;
+    uint64_t traceStart = trace_begin();
+
+    pthread_mutex_lock(&j->lock);
+    while(seg->status == SEGMENT_PENDING || seg->status == SEGMENT_RUNNING) {
+        pthread_cond_wait(&j->cond,&j->lock);
+    }
+    status = seg->status;
+    pthread_mutex_unlock(&j->lock);
+    trace_end(traceStart,"segment wait",(int)k);
+
+    return status == SEGMENT_DONE ? seg : NULL;
+}
+
+void segments_release(segment_job *j, unsigned int k) {
+    pthread_mutex_lock(&j->lock);
+    j->held -= j->segments[k].budgeted;
+    pthread_mutex_unlock(&j->lock);
+    segment_free(j,&j->segments[k]);
+
+    pthread_mutex_lock(&j->lock);
+    j->released = k + 1;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void segments_finish(segment_job *j) {
+    unsigned int k;
+
+    if(j->threads != NULL) {
+        pthread_mutex_lock(&j->lock);
+        j->cancel = 1;
+        pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+
+        for(k = 0; k < j->threadCount; k++) {
+            pthread_join(j->threads[k],NULL);
+        }
+        pthread_mutex_destroy(&j->lock);
+        pthread_cond_destroy(&j->cond);
+        free(j->threads);
+    }
+
+    if(j->segments != NULL) {
+        for(k = 0; k < j->count; k++) {
+            segment_free(j,&j->segments[k]);
+        }
+        free(j->segments);
+    }
+    memset(j,0,sizeof(segment_job));
+}
+
+unsigned int segments_cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n > 0) return (unsigned int)n;
+#endif
+    return 1;
+}
+
+static void *segment_worker(void *userdata) {
+    segment_job *j = (segment_job *)userdata;
+    segment *seg;
+    unsigned int ok;
+    uint64_t size;
+    uint64_t traceStart;
+    size_t resident = 0;
+    gbs2wav_t *h;
+
+    trace_thread_name("segment worker");
+    traceStart = trace_begin();
+    h = gbs2wav_open(j->gbs,j->gbsLen,j->m3u,j->m3uLen,&j->config);
+    trace_end(traceStart,"open",-1);
+
+    if(h != NULL) {
+        resident = gbs2wav_resident_size(h);
+        budget_charge(resident);
+    }
+
+    pthread_mutex_lock(&j->lock);
+    while(1) {
+        while(!j->cancel && j->next < j->count && j->next >= j->released + j->window) {
+            pthread_cond_wait(&j->cond,&j->lock);
+        }
+        if(j->cancel || j->next >= j->count) break;
+        seg = &j->segments[j->next];
+        size = segment_bytes(j,seg);
+
+        /* a finished segment keeps its memory until it's written, and
+         * that waits for every segment before it. So only the oldest
+         * segment may wait for memory (with none of the others holding
+         * any), the rest take it when it's free and hold off otherwise */
+        if(j->held == 0 && !j->waiting) {
+            j->waiting = 1;
+            j->next++;
+            pthread_mutex_unlock(&j->lock);
+            budget_acquire(size,1);
+            pthread_mutex_lock(&j->lock);
+            j->waiting = 0;
+            pthread_cond_broadcast(&j->cond);
+        } else if(j->waiting || budget_acquire(size,0) != 0) {
+            pthread_cond_wait(&j->cond,&j->lock);
+            continue;
+        } else {
+            j->next++;
+        }
+        seg->budgeted = size;
+        j->held += size;
+        seg->status = SEGMENT_RUNNING;
+        pthread_mutex_unlock(&j->lock);
+
+        traceStart = trace_begin();
+        ok = h != NULL && segment_render(j,h,seg) == 0;
+        trace_end(traceStart,"segment",(int)(seg - j->segments));
+
+        pthread_mutex_lock(&j->lock);
+        seg->status = ok ? SEGMENT_DONE : SEGMENT_FAILED;
+        pthread_cond_broadcast(&j->cond);
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    gbs2wav_close(h);
+    budget_refund(resident);
+    return NULL;
+}
+
+static int segment_render(segment_job *j, gbs2wav_t *h, segment *seg) {
+    unsigned int i;
+    unsigned int channels = j->config.channels;
+    unsigned int stemCount = j->config.stems ? GBS2WAV_STEM_COUNT : 0;
+    uint64_t pos = 0;
+    uint64_t frames;
+    int16_t *stems[GBS2WAV_STEM_COUNT];
+
+    seg->samples = (int16_t *)malloc(sizeof(int16_t) * channels * seg->frames);
+    if(seg->samples == NULL) return -1;
+    for(i = 0; i < stemCount; i++) {
+        seg->stems[i] = (int16_t *)malloc(sizeof(int16_t) * channels * seg->frames);
+        if(seg->stems[i] == NULL) return -1;
+    }
+
+    if(gbs2wav_load_state(h,seg->state,j->stateSize) != 0) return -1;
+
+    while(pos < seg->frames) {
+        for(i = 0; i < stemCount; i++) {
+            stems[i] = &seg->stems[i][pos * channels];
+        }
+        frames = gbs2wav_render_ex(h,&seg->samples[pos * channels],
+          stemCount ? stems : NULL,seg->frames - pos,0);
+        if(frames == 0) return -1;
+        pos += frames;
+    }
+    return 0;
+}
+
+/* the sample buffers segment_render allocates */
+static uint64_t segment_bytes(const segment_job *j, const segment *seg) {
+    unsigned int stemCount = j->config.stems ? GBS2WAV_STEM_COUNT : 0;
+    return sizeof(int16_t) * j->config.channels * seg->frames * (1 + stemCount);
+}
+
+static void segment_free(segment_job *j, segment *seg) {
+    unsigned int i;
+    if(seg->budgeted) budget_release(seg->budgeted);
+    if(seg->state != NULL) {
+        free(seg->state);
+        budget_refund(j->stateSize);
+    }
+    if(seg->samples != NULL) free(seg->samples);
+    for(i = 0; i < GBS2WAV_STEM_COUNT; i++) {
+        if(seg->stems[i] != NULL) free(seg->stems[i]);
+    }
+    memset(seg,0,sizeof(segment));
+}
@@ -0,0 +1,78 @@
+#ifndef SEGMENTS_H
+#define SEGMENTS_H
+
+/* renders one track as consecutive segments on worker threads.
+ * A prepass skips through the track saving a snapshot at the start
+ * of each segment, each worker then loads a snapshot into its own
+ * renderer and renders that segment. Segments come back in order
+ * through segments_wait, at most window of them are held at once */
+
+#include "libgbs2wav.h"
+
+#include <pthread.h>
+
+#define SEGMENT_PENDING 0
+#define SEGMENT_RUNNING 1
+#define SEGMENT_DONE    2
+#define SEGMENT_FAILED  3
+
+typedef struct segment {
+    /* first frame within the track and length */
+    uint64_t offset;
+    uint64_t frames;
+    uint8_t *state;
+    /* frames * channels each, filled by the worker */
+    int16_t *samples;
+    int16_t *stems[GBS2WAV_STEM_COUNT];
+    /* taken from the memory budget for samples and stems */
+    uint64_t budgeted;
+    unsigned int status;
+} segment;
+
+/* asked between prepass steps, non-zero stops the prepass */
+typedef int (*segments_stop_func)(void *userdata, const gbs2wav_t *h);
+
+typedef struct segment_job {
+    const uint8_t *gbs;
+    size_t gbsLen;
+    const char *m3u;
+    size_t m3uLen;
+    gbs2wav_config config;
+    size_t stateSize;
+
+    segment *segments;
+    unsigned int count;
+    /* next segment a worker picks up, and segments released */
+    unsigned int next;
+    unsigned int released;
+    unsigned int window;
+    unsigned int cancel;
+    /* budget held by segments not yet released, and whether the
+     * oldest is waiting for some */
+    uint64_t held;
+    unsigned int waiting;
+
+    pthread_t *threads;
+    unsigned int threadCount;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} segment_job;
+
+/* runs the prepass for track index on h (which is left at the end of
+ * the track) and starts the workers, each opening its own renderer
+ * from the same GBS and M3U buffers. stop may be NULL. Returns 0 on
+ * success, 1 when stop ended the prepass (nothing is left to finish) */
+int segments_start(segment_job *j, gbs2wav_t *h, unsigned int index, const uint8_t *gbs, size_t gbsLen, const char *m3u, size_t m3uLen, uint64_t segmentFrames, unsigned int threads, segments_stop_func stop, void *userdata);
+
+/* blocks until segment k is rendered, NULL if it failed */
+const segment *segments_wait(segment_job *j, unsigned int k);
+
+/* frees segment k's buffers, segments are released in order */
+void segments_release(segment_job *j, unsigned int k);
+
+/* stops the workers and frees everything */
+void segments_finish(segment_job *j);
+
+unsigned int segments_cpu_count(void);
+
+#endif
@@ -0,0 +1,180 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* spans per buffer, a thread chains on another when one fills */
+#define TRACE_CHUNK_SPANS 4096
+
+typedef struct trace_span {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    int arg;
+} trace_span;
+
+typedef struct trace_chunk {
+    trace_span spans[TRACE_CHUNK_SPANS];
+    unsigned int count;
+    struct trace_chunk *next;
+} trace_chunk;
+
+typedef struct trace_thread {
+    unsigned int tid;
+    const char *name;
+    trace_chunk *first;
+    trace_chunk *last;
+    /* spans lost to a failed allocation */
+    uint64_t dropped;
+    struct trace_thread *next;
+} trace_thread;
+
+volatile int trace_on = 0;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static trace_thread *threads = NULL;
+static unsigned int threadCount = 0;
+static struct timespec origin;
+static __thread trace_thread *local = NULL;
+
+static trace_thread *local_thread(void);
+
+void trace_enable(void) {
+    clock_gettime(CLOCK_MONOTONIC,&origin);
+    trace_on = 1;
+}
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)(ts.tv_sec - origin.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec - (uint64_t)origin.tv_nsec + 1;
+}
+
+void trace_record(uint64_t start, const char *name, int arg) {
+    trace_thread *t = local_thread();
+    trace_chunk *c;
+    trace_span *s;
+
+    if(t == NULL) return;
+    c = t->last;
+    if(c == NULL || c->count == TRACE_CHUNK_SPANS) {
+        c = (trace_chunk *)malloc(sizeof(trace_chunk));
+        if(c == NULL) {
+            t->dropped++;
+            return;
+        }
+        c->count = 0;
+        c->next = NULL;
+        if(t->last != NULL) {
+            t->last->next = c;
+        } else {
+            t->first = c;
+        }
+        t->last = c;
+    }
+
+    s = &c->spans[c->count++];
+    s->name = name;
+    s->start = start;
+    s->end = trace_now();
+    s->arg = arg;
+}
+
+void trace_thread_name(const char *name) {
+    trace_thread *t;
+
+    if(!trace_on) return;
+    t = local_thread();
+    if(t != NULL) t->name = name;
+}
+
+int trace_write(const char *filename) {
+    trace_thread *t;
+    trace_thread *next;
+    trace_chunk *c;
+    trace_chunk *cn;
+    unsigned int i;
+    unsigned int first = 1;
+    uint64_t dropped = 0;
+    int r = -1;
+    FILE *f;
+
+    trace_on = 0;
+    pthread_mutex_lock(&traceLock);
+
+    f = fopen(filename,"wb");
+    if(f == NULL) {
+        fprintf(stderr,"Error opening %s: %s\n",filename,strerror(errno));
+        goto done;
+    }
+
+    /* times are in microseconds */
+    fprintf(f,"{\"traceEvents\":[");
+    for(t = threads; t != NULL; t = t->next) {
+        if(t->name != NULL) {
+            fprintf(f,"%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+              first ? "" : ",",t->tid,t->name);
+            first = 0;
+        }
+        for(c = t->first; c != NULL; c = c->next) {
+            for(i = 0; i < c->count; i++) {
+                fprintf(f,"%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                  first ? "" : ",",c->spans[i].name,t->tid,
+                  (double)(c->spans[i].start - 1) / 1000.0,
+                  (double)(c->spans[i].end - c->spans[i].start) / 1000.0);
+                if(c->spans[i].arg >= 0) {
+                    fprintf(f,",\"args\":{\"n\":%d}",c->spans[i].arg);
+                }
+                fprintf(f,"}");
+                first = 0;
+            }
+        }
+        dropped += t->dropped;
+    }
+    fprintf(f,"\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%llu}}\n",(unsigned long long)dropped);
+
+    if(fclose(f) != 0) {
+        fprintf(stderr,"Error writing %s\n",filename);
+        goto done;
+    }
+    r = 0;
+
+    done:
+    for(t = threads; t != NULL; t = next) {
+        next = t->next;
+        for(c = t->first; c != NULL; c = cn) {
+            cn = c->next;
+            free(c);
+        }
+        free(t);
+    }
+    threads = NULL;
+    local = NULL;
+    pthread_mutex_unlock(&traceLock);
+    return r;
+}
+
+/* the calling thread's buffers, registered the first time through */
+static trace_thread *local_thread(void) {
+    trace_thread *t = local;
+    trace_thread **p;
+
+    if(t != NULL) return t;
+    t = (trace_thread *)malloc(sizeof(trace_thread));
+    if(t == NULL) return NULL;
+    memset(t,0,sizeof(trace_thread));
+
+    pthread_mutex_lock(&traceLock);
+    t->tid = ++threadCount;
+    /* kept in registration order, so the main thread comes first */
+    for(p = &threads; *p != NULL; p = &(*p)->next);
+    *p = t;
+    pthread_mutex_unlock(&traceLock);
+
+    local = t;
+    return t;
+}
@@ -0,0 +1,40 @@
+#ifndef GBS2WAV_TRACE_H
+#define GBS2WAV_TRACE_H
+
+/* host-side trace spans, for seeing stalls, imbalance between threads
+ * and I/O waits on a timeline. Each thread records into buffers of its
+ * own, the only lock is taken once per thread, when it records its
+ * first span. trace_write saves them as Chrome trace-event JSON, which
+ * chrome://tracing and Perfetto open.
+ *
+ * Until trace_enable, trace_begin is a load and a branch and
+ * trace_end a compare:
+ *
+ *     uint64_t t = trace_begin();
+ *     ...
+ *     trace_end(t,"render",track);
+ *
+ * Names aren't copied, they have to be string constants. */
+
+#include <stdint.h>
+
+extern volatile int trace_on;
+
+#define trace_begin() (trace_on ? trace_now() : 0)
+/* arg is shown with the span, -1 for none */
+#define trace_end(start, name, arg) do { if(start) trace_record((start),(name),(arg)); } while(0)
+
+void trace_enable(void);
+
+/* nanoseconds since trace_enable, never 0 */
+uint64_t trace_now(void);
+void trace_record(uint64_t start, const char *name, int arg);
+
+/* names the calling thread on the timeline, when tracing is on */
+void trace_thread_name(const char *name);
+
+/* turns tracing off, writes every thread's spans and frees them. Call
+ * it once the other threads have stopped recording */
+int trace_write(const char *filename);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef GBS2WAV_MEMORY_MAP_H
+#define GBS2WAV_MEMORY_MAP_H
+
+/* memory access for the variant build, included at the top of its
+ * patched copy of the core's memory.c (see memory.sed).
+ *
+ * The default build finds the handler for each read and write through
+ * the 16 entry page tables, read_map[addr >> 12] and write_map[...],
+ * an indirect call per access. Here a switch on the page calls each
+ * table entry with a constant index, so ROM, banked ROM, WRAM and the
+ * FFxx page's handlers become direct calls the compiler can inline
+ * into the access. The handlers themselves are unchanged, so bank
+ * switches, I/O and timing behave exactly as before */
+
+#define GB_VARIANT_PAGES(X) \
+    X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+    X(8) X(9) X(A) X(B) X(C) X(D) X(E) X(F)
+
+#define GB_VARIANT_READ_PAGE(n) \
+    case 0x##n: data_ = read_map[0x##n](gb_, addr_); break;
+#define GB_VARIANT_WRITE_PAGE(n) \
+    case 0x##n: write_map[0x##n](gb_, addr_, value_); break;
+
+#define GB_VARIANT_READ(gb, addr) ({ \
+    GB_gameboy_t *gb_ = (gb); \
+    uint16_t addr_ = (addr); \
+    uint8_t data_ = 0xFF; \
+    switch (addr_ >> 12) { \
+        GB_VARIANT_PAGES(GB_VARIANT_READ_PAGE) \
+    } \
+    data_; \
+})
+
+#define GB_VARIANT_WRITE(gb, addr, value) do { \
+    GB_gameboy_t *gb_ = (gb); \
+    uint16_t addr_ = (addr); \
+    uint8_t value_ = (value); \
+    switch (addr_ >> 12) { \
+        GB_VARIANT_PAGES(GB_VARIANT_WRITE_PAGE) \
+    } \
+} while (0)
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef GBS2WAV_THREADED_DISPATCH_H
+#define GBS2WAV_THREADED_DISPATCH_H
+
+/* opcode dispatch for the variant build, included at the top of its
+ * patched copy of the core's sm83_cpu.c (see sm83_cpu.sed).
+ *
+ * The default build calls every opcode through one indirect call,
+ * opcodes[opcode](gb, opcode). Here the opcode picks a label with a
+ * computed goto instead, and each label calls its own table entry with
+ * a constant index. The patch makes the table const, so those become
+ * direct calls the compiler can inline, with the handler's decoding of
+ * the opcode (which register, which condition) folded away. Handlers
+ * run exactly as before, so timing and output don't change */
+
+#define GB_VARIANT_OPCODES(X) \
+    X(00) X(01) X(02) X(03) X(04) X(05) X(06) X(07) \
+    X(08) X(09) X(0A) X(0B) X(0C) X(0D) X(0E) X(0F) \
+    X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) \
+    X(18) X(19) X(1A) X(1B) X(1C) X(1D) X(1E) X(1F) \
+    X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) \
+    X(28) X(29) X(2A) X(2B) X(2C) X(2D) X(2E) X(2F) \
+    X(30) X(31) X(32) X(33) X(34) X(35) X(36) X(37) \
+    X(38) X(39) X(3A) X(3B) X(3C) X(3D) X(3E) X(3F) \
+    X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) \
+    X(48) X(49) X(4A) X(4B) X(4C) X(4D) X(4E) X(4F) \
+    X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) \
+    X(58) X(59) X(5A) X(5B) X(5C) X(5D) X(5E) X(5F) \
+    X(60) X(61) X(62) X(63) X(64) X(65) X(66) X(67) \
+    X(68) X(69) X(6A) X(6B) X(6C) X(6D) X(6E) X(6F) \
+    X(70) X(71) X(72) X(73) X(74) X(75) X(76) X(77) \
+    X(78) X(79) X(7A) X(7B) X(7C) X(7D) X(7E) X(7F) \
+    X(80) X(81) X(82) X(83) X(84) X(85) X(86) X(87) \
+    X(88) X(89) X(8A) X(8B) X(8C) X(8D) X(8E) X(8F) \
+    X(90) X(91) X(92) X(93) X(94) X(95) X(96) X(97) \
+    X(98) X(99) X(9A) X(9B) X(9C) X(9D) X(9E) X(9F) \
+    X(A0) X(A1) X(A2) X(A3) X(A4) X(A5) X(A6) X(A7) \
+    X(A8) X(A9) X(AA) X(AB) X(AC) X(AD) X(AE) X(AF) \
+    X(B0) X(B1) X(B2) X(B3) X(B4) X(B5) X(B6) X(B7) \
+    X(B8) X(B9) X(BA) X(BB) X(BC) X(BD) X(BE) X(BF) \
+    X(C0) X(C1) X(C2) X(C3) X(C4) X(C5) X(C6) X(C7) \
+    X(C8) X(C9) X(CA) X(CB) X(CC) X(CD) X(CE) X(CF) \
+    X(D0) X(D1) X(D2) X(D3) X(D4) X(D5) X(D6) X(D7) \
+    X(D8) X(D9) X(DA) X(DB) X(DC) X(DD) X(DE) X(DF) \
+    X(E0) X(E1) X(E2) X(E3) X(E4) X(E5) X(E6) X(E7) \
+    X(E8) X(E9) X(EA) X(EB) X(EC) X(ED) X(EE) X(EF) \
+    X(F0) X(F1) X(F2) X(F3) X(F4) X(F5) X(F6) X(F7) \
+    X(F8) X(F9) X(FA) X(FB) X(FC) X(FD) X(FE) X(FF)
+
+#define GB_VARIANT_LABEL_NAME(n) op_##n,
+#define GB_VARIANT_LABEL_ADDRESS(n) &&op_##n,
+#define GB_VARIANT_LABEL_CALL(n) op_##n: opcodes[0x##n](gb_, 0x##n); goto done_;
+
+/* labels are local to the block, so this can be used more than once
+ * in a function */
+#define GB_VARIANT_DISPATCH(gb, opcode) do { \
+    __label__ GB_VARIANT_OPCODES(GB_VARIANT_LABEL_NAME) done_; \
+    static void *const targets_[256] = { \
+        GB_VARIANT_OPCODES(GB_VARIANT_LABEL_ADDRESS) \
+    }; \
+    GB_gameboy_t *gb_ = (gb); \
+    goto *targets_[(uint8_t)(opcode)]; \
+    GB_VARIANT_OPCODES(GB_VARIANT_LABEL_CALL) \
+    done_:; \
+} while (0)
+
+#endif